@@ -0,0 +1,218 @@
+/**
+ * @file aesd-circular-buffer-bench.c
+ * @brief Userspace benchmark of the circular buffer lookups at capacities from 10 to 1M entries
+ *
+ * Fills a buffer past its capacity with 20 byte entries, then times
+ * aesd_circular_buffer_find_entry_offset_for_fpos, aesd_circular_buffer_get_count and
+ * aesd_circular_buffer_get_absolute_offset against the linear walks over every entry they
+ * replaced, and aesd_circular_buffer_add_entry. Exits with 1 if a lookup disagrees with its walk.
+ * Built with "make bench".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "aesd-circular-buffer.h"
+
+#define BENCH_ENTRY_SIZE 20
+#define BENCH_MIN_CAPACITY 10
+#define BENCH_MAX_CAPACITY 1000000
+/**
+ * Entries visited per lookup timing, so small buffers are timed over more calls
+ */
+#define BENCH_WORK (20 * 1000 * 1000L)
+#define BENCH_MIN_CALLS 200
+#define BENCH_ADDS 1000000
+
+static volatile size_t bench_sink;
+
+static double bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * @return the @param i'th of a sequence of values spread evenly over [0, @param range)
+ */
+static size_t bench_spread(long i, size_t range)
+{
+    return (size_t)((uint64_t)i * 0x9e3779b97f4a7c15ULL % range);
+}
+
+/**
+ * aesd_circular_buffer_find_entry_offset_for_fpos as it was, walking the entries from out_offs
+ */
+static struct aesd_buffer_entry *bench_linear_find(struct aesd_circular_buffer *buffer, size_t char_offset,
+                                                   size_t *entry_offset_byte_rtn)
+{
+    uint32_t entries = aesd_circular_buffer_get_entries(buffer);
+    uint32_t i;
+
+    for (i = 0; i < entries; i++)
+    {
+        struct aesd_buffer_entry *entry = &buffer->entry[(buffer->out_offs + i) & buffer->mask];
+        if (char_offset < entry->size)
+        {
+            *entry_offset_byte_rtn = char_offset;
+            return entry;
+        }
+        char_offset -= entry->size;
+    }
+    return NULL;
+}
+
+/**
+ * aesd_circular_buffer_get_count as it was, summing every entry
+ */
+static size_t bench_linear_count(struct aesd_circular_buffer *buffer)
+{
+    uint32_t entries = aesd_circular_buffer_get_entries(buffer);
+    size_t count = 0;
+    uint32_t i;
+
+    for (i = 0; i < entries; i++)
+    {
+        count += buffer->entry[(buffer->out_offs + i) & buffer->mask].size;
+    }
+    return count;
+}
+
+/**
+ * aesd_circular_buffer_get_absolute_offset as it was, summing the entries before @param entry_offset
+ */
+static ssize_t bench_linear_absolute_offset(struct aesd_circular_buffer *buffer, uint32_t entry_offset,
+                                            size_t char_offset)
+{
+    ssize_t offset = 0;
+    uint32_t i;
+
+    if (entry_offset >= aesd_circular_buffer_get_entries(buffer))
+    {
+        return -1;
+    }
+    for (i = 0; i < entry_offset; i++)
+    {
+        offset += buffer->entry[(buffer->out_offs + i) & buffer->mask].size;
+    }
+    if (buffer->entry[(buffer->out_offs + entry_offset) & buffer->mask].size <= char_offset)
+    {
+        return -1;
+    }
+    return offset + char_offset;
+}
+
+/**
+ * Times the lookups of a full buffer of @param capacity entries and prints one line of ns per call
+ * @return 0, or 1 if a lookup disagreed with its linear walk
+ */
+static int bench_capacity(uint32_t capacity)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entry = {"", BENCH_ENTRY_SIZE};
+    long calls = BENCH_WORK / capacity > BENCH_MIN_CALLS ? BENCH_WORK / capacity : BENCH_MIN_CALLS;
+    double start, find, linear_find, count, linear_count, absolute, linear_absolute, add;
+    size_t total, offset, linear_offset;
+    int status = 0;
+    long i;
+
+    if (aesd_circular_buffer_init_capacity(&buffer, capacity) != 0)
+    {
+        fprintf(stderr, "Failed to allocate a buffer of %u entries\n", capacity);
+        return 1;
+    }
+    for (i = 0; i < (long)capacity + 7; i++)
+    {
+        aesd_circular_buffer_add_entry(&buffer, &entry);
+    }
+    total = aesd_circular_buffer_get_count(&buffer);
+
+    // Positions spread over the whole buffer, the walks cost half of it on average
+    start = bench_now_ns();
+    for (i = 0; i < calls; i++)
+    {
+        bench_sink +=
+            (size_t)aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, bench_spread(i, total), &offset);
+    }
+    find = (bench_now_ns() - start) / calls;
+    start = bench_now_ns();
+    for (i = 0; i < calls; i++)
+    {
+        bench_sink += (size_t)bench_linear_find(&buffer, bench_spread(i, total), &offset);
+    }
+    linear_find = (bench_now_ns() - start) / calls;
+
+    start = bench_now_ns();
+    for (i = 0; i < calls; i++)
+    {
+        bench_sink += aesd_circular_buffer_get_count(&buffer);
+    }
+    count = (bench_now_ns() - start) / calls;
+    start = bench_now_ns();
+    for (i = 0; i < calls; i++)
+    {
+        bench_sink += bench_linear_count(&buffer);
+    }
+    linear_count = (bench_now_ns() - start) / calls;
+
+    start = bench_now_ns();
+    for (i = 0; i < calls; i++)
+    {
+        bench_sink += aesd_circular_buffer_get_absolute_offset(&buffer, bench_spread(i, capacity), 3);
+    }
+    absolute = (bench_now_ns() - start) / calls;
+    start = bench_now_ns();
+    for (i = 0; i < calls; i++)
+    {
+        bench_sink += bench_linear_absolute_offset(&buffer, bench_spread(i, capacity), 3);
+    }
+    linear_absolute = (bench_now_ns() - start) / calls;
+
+    for (i = 0; i < 1000; i++)
+    {
+        size_t position = bench_spread(i, total + 1);
+        struct aesd_buffer_entry *found = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, position, &offset);
+        if (found != bench_linear_find(&buffer, position, &linear_offset) ||
+            (found != NULL && offset != linear_offset) ||
+            aesd_circular_buffer_get_absolute_offset(&buffer, bench_spread(i, capacity), i % 25) !=
+                bench_linear_absolute_offset(&buffer, bench_spread(i, capacity), i % 25))
+        {
+            status = 1;
+        }
+    }
+    if (total != bench_linear_count(&buffer))
+    {
+        status = 1;
+    }
+
+    start = bench_now_ns();
+    for (i = 0; i < BENCH_ADDS; i++)
+    {
+        aesd_circular_buffer_add_entry(&buffer, &entry);
+    }
+    add = (bench_now_ns() - start) / BENCH_ADDS;
+
+    printf("%8u entries: find %7.1f ns (walk %11.1f)  count %5.1f ns (walk %11.1f)  "
+           "absolute offset %5.1f ns (walk %11.1f)  add %5.1f ns\n",
+           capacity, find, linear_find, count, linear_count, absolute, linear_absolute, add);
+    if (status != 0)
+    {
+        fprintf(stderr, "Lookups of %u entries disagree with the linear walks\n", capacity);
+    }
+    aesd_circular_buffer_free(&buffer);
+    return status;
+}
+
+int main(void)
+{
+    int status = 0;
+    uint32_t capacity;
+
+    for (capacity = BENCH_MIN_CAPACITY; capacity <= BENCH_MAX_CAPACITY; capacity *= 10)
+    {
+        status |= bench_capacity(capacity);
+    }
+    return status;
+}
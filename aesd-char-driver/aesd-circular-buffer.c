@@ -10,12 +10,41 @@
 
 #ifdef __KERNEL__
 #include <linux/string.h>
+#include <linux/errno.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#define aesd_circular_buffer_alloc(count, size) kvmalloc_array(count, size, GFP_KERNEL)
+#define aesd_circular_buffer_release(pointer) kvfree(pointer)
 #else
 #include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#define aesd_circular_buffer_alloc(count, size) calloc(count, size)
+#define aesd_circular_buffer_release(pointer) free(pointer)
 #endif
 
 #include "aesd-circular-buffer.h"
 
+/**
+ * @return the number of entries held by @param buffer
+ */
+uint32_t aesd_circular_buffer_get_entries(const struct aesd_circular_buffer *buffer)
+{
+    if (buffer->full)
+    {
+        return buffer->capacity;
+    }
+    return (buffer->in_offs - buffer->out_offs) & buffer->mask;
+}
+
+/**
+ * @return the location in the entry structure of the @param entry_offset'th entry from out_offs
+ */
+static uint32_t aesd_circular_buffer_slot(const struct aesd_circular_buffer *buffer, uint32_t entry_offset)
+{
+    return (buffer->out_offs + entry_offset) & buffer->mask;
+}
+
 /**
  * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller.
  * @param char_offset the position to search for in the buffer list, describing the zero referenced
@@ -25,34 +54,38 @@
  *      in aesd_buffer.
  * @return the struct aesd_buffer_entry structure representing the position described by char_offset, or
  * NULL if this position is not available in the buffer (not enough data is written).
+ * Binary search over the entry start offsets, O(log n) in the number of entries.
  */
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
                                                                           size_t char_offset, size_t *entry_offset_byte_rtn)
 {
-    /**
-     * TODO: implement per description
-     */
-    uint8_t entry_offset = buffer->out_offs;
-    bool first_and_full = buffer->full;
-    while (entry_offset != buffer->in_offs || first_and_full)
+    size_t base;
+    uint32_t low, high, slot;
+
+    if (char_offset >= buffer->total_size)
+    {
+        return NULL;
+    }
+    // The last entry starting at or before char_offset holds it, empty entries
+    // sharing its start come before it
+    base = buffer->entry_start[buffer->out_offs];
+    low = 0;
+    high = aesd_circular_buffer_get_entries(buffer) - 1;
+    while (low < high)
     {
-        first_and_full = false;
-        if (buffer->entry[entry_offset].size <= char_offset)
+        uint32_t middle = low + (high - low + 1) / 2;
+        if (buffer->entry_start[aesd_circular_buffer_slot(buffer, middle)] - base <= char_offset)
         {
-            char_offset -= buffer->entry[entry_offset].size;
-            entry_offset++;
-            if (entry_offset >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
-            {
-                entry_offset = 0;
-            }
+            low = middle;
         }
         else
         {
-            *entry_offset_byte_rtn = char_offset;
-            return &buffer->entry[entry_offset];
+            high = middle - 1;
         }
     }
-    return NULL;
+    slot = aesd_circular_buffer_slot(buffer, low);
+    *entry_offset_byte_rtn = char_offset - (buffer->entry_start[slot] - base);
+    return &buffer->entry[slot];
 }
 
 /**
@@ -64,87 +97,212 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
  */
 struct aesd_buffer_entry aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
-    /**
-     * TODO: implement per description
-     */
     struct aesd_buffer_entry ret_val = {0};
+    size_t start = 0;
+
+    // The running offset carries on from the end of the newest entry
+    if (buffer->full || buffer->in_offs != buffer->out_offs)
+    {
+        start = buffer->entry_start[buffer->out_offs] + buffer->total_size;
+    }
     if (buffer->full)
     {
         ret_val = buffer->entry[buffer->out_offs];
+        buffer->total_size -= ret_val.size;
     }
     buffer->entry[buffer->in_offs] = *add_entry;
-    buffer->in_offs++;
-    if (buffer->in_offs >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
-    {
-        buffer->in_offs = 0;
-    }
+    buffer->entry_start[buffer->in_offs] = start;
+    buffer->total_size += add_entry->size;
     if (buffer->full)
     {
-        buffer->out_offs++;
-        if (buffer->out_offs >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
-        {
-            buffer->out_offs = 0;
-        }
+        buffer->out_offs = (buffer->out_offs + 1) & buffer->mask;
     }
-    else if (buffer->in_offs == buffer->out_offs)
+    else if (aesd_circular_buffer_get_entries(buffer) + 1 == buffer->capacity)
     {
         buffer->full = true;
     }
+    buffer->in_offs = (buffer->in_offs + 1) & buffer->mask;
 
     return ret_val;
 }
 
 /**
- * Initializes the circular buffer described by @param buffer to an empty struct
+ * Removes the oldest entry of @param buffer and advances buffer->out_offs past it.
+ * Any necessary locking must be handled by the caller
+ * @return the removed entry, with a NULL buffptr if the buffer was empty
+ */
+struct aesd_buffer_entry aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer)
+{
+    struct aesd_buffer_entry ret_val = {0};
+
+    if (!buffer->full && buffer->in_offs == buffer->out_offs)
+    {
+        return ret_val;
+    }
+    ret_val = buffer->entry[buffer->out_offs];
+    buffer->total_size -= ret_val.size;
+    buffer->out_offs = (buffer->out_offs + 1) & buffer->mask;
+    buffer->full = false;
+    return ret_val;
+}
+
+/**
+ * @return the size of the arrays holding @param capacity entries, the next power of two
+ */
+static uint32_t aesd_circular_buffer_slots(uint32_t capacity)
+{
+    uint32_t slots = 1;
+    while (slots < capacity)
+    {
+        slots <<= 1;
+    }
+    return slots;
+}
+
+/**
+ * Allocates the arrays of @param buffer for @param capacity entries, leaving it untouched on failure
+ * @return 0 on success, -EINVAL if capacity is 0 or above AESDCHAR_CAPACITY_MAX, -ENOMEM
+ */
+static int aesd_circular_buffer_allocate(struct aesd_circular_buffer *buffer, uint32_t capacity)
+{
+    uint32_t slots;
+    struct aesd_buffer_entry *entry;
+    size_t *entry_start;
+
+    if (capacity == 0 || capacity > AESDCHAR_CAPACITY_MAX)
+    {
+        return -EINVAL;
+    }
+    slots = aesd_circular_buffer_slots(capacity);
+    entry = aesd_circular_buffer_alloc(slots, sizeof(*entry));
+    entry_start = aesd_circular_buffer_alloc(slots, sizeof(*entry_start));
+    if (entry == NULL || entry_start == NULL)
+    {
+        aesd_circular_buffer_release(entry);
+        aesd_circular_buffer_release(entry_start);
+        return -ENOMEM;
+    }
+    memset(entry, 0, slots * sizeof(*entry));
+    memset(entry_start, 0, slots * sizeof(*entry_start));
+    buffer->entry = entry;
+    buffer->entry_start = entry_start;
+    buffer->capacity = capacity;
+    buffer->mask = slots - 1;
+    return 0;
+}
+
+/**
+ * Initializes the circular buffer described by @param buffer to an empty struct holding up to
+ * @param capacity entries
+ * @return 0 on success, -EINVAL if capacity is 0 or above AESDCHAR_CAPACITY_MAX, -ENOMEM
  */
-void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
+int aesd_circular_buffer_init_capacity(struct aesd_circular_buffer *buffer, uint32_t capacity)
 {
     memset(buffer, 0, sizeof(struct aesd_circular_buffer));
+    return aesd_circular_buffer_allocate(buffer, capacity);
 }
 
-size_t aesd_circular_buffer_get_count(struct aesd_circular_buffer *buffer)
+/**
+ * Initializes the circular buffer described by @param buffer to an empty struct holding up to
+ * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries, as it did before the capacity could be set
+ * @return 0 on success, -ENOMEM
+ */
+int aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
-    uint8_t current = buffer->out_offs;
-    bool first_and_full = buffer->full;
-    size_t output = 0;
-    while (first_and_full || current != buffer->in_offs)
+    return aesd_circular_buffer_init_capacity(buffer, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+}
+
+/**
+ * Fills the empty buffer @param resized, from aesd_circular_buffer_init_capacity, with the newest entries of
+ * @param buffer that fit its capacity, keeping their positions, and @param evicted with the arrays of
+ * @param buffer holding the entries that do not fit. @param buffer is left as it is: the caller
+ * replaces it with @param resized, then takes the evicted entries out with
+ * aesd_circular_buffer_remove_entry before aesd_circular_buffer_free. Does not allocate, so the caller
+ * can do the replacement alone in whatever section publishes the buffer to lockless readers.
+ * Any necessary locking must be handled by the caller
+ */
+void aesd_circular_buffer_move(const struct aesd_circular_buffer *buffer, struct aesd_circular_buffer *resized,
+                               struct aesd_circular_buffer *evicted)
+{
+    uint32_t entries, dropped, i;
+
+    entries = aesd_circular_buffer_get_entries(buffer);
+    dropped = entries > resized->capacity ? entries - resized->capacity : 0;
+    for (i = dropped; i < entries; i++)
     {
-        first_and_full = false;
-        output += buffer->entry[current].size;
-        current++;
-        if (current >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
-        {
-            current = 0;
-        }
+        uint32_t slot = aesd_circular_buffer_slot(buffer, i);
+        resized->entry[i - dropped] = buffer->entry[slot];
+        resized->entry_start[i - dropped] = buffer->entry_start[slot];
     }
-    return output;
+    resized->in_offs = (entries - dropped) & resized->mask;
+    resized->full = entries - dropped == resized->capacity;
+
+    // What is left of the old arrays is the dropped entries, at least one entry is kept
+    *evicted = *buffer;
+    evicted->in_offs = aesd_circular_buffer_slot(buffer, dropped);
+    evicted->full = false;
+    evicted->total_size = dropped == 0 ? 0 : buffer->entry_start[evicted->in_offs] - buffer->entry_start[buffer->out_offs];
+    resized->total_size = buffer->total_size - evicted->total_size;
 }
 
-ssize_t aesd_circular_buffer_get_absolute_offset(struct aesd_circular_buffer *buffer, uint8_t entry_offset, size_t char_offset)
+/**
+ * Changes the number of entries @param buffer holds to @param capacity, keeping the newest entries
+ * and their positions. The entries that no longer fit are left in @param evicted, to be taken out
+ * with aesd_circular_buffer_remove_entry before aesd_circular_buffer_free.
+ * Any necessary locking must be handled by the caller
+ * @return 0 on success, -EINVAL or -ENOMEM with @param buffer unchanged
+ */
+int aesd_circular_buffer_resize(struct aesd_circular_buffer *buffer, uint32_t capacity,
+                                struct aesd_circular_buffer *evicted)
 {
-    uint8_t current = buffer->out_offs;
-    bool first_and_full = buffer->full;
-    ssize_t output = 0;
-    int i;
-    for (i = 0; i < entry_offset; i++)
+    struct aesd_circular_buffer resized;
+    int result;
+
+    result = aesd_circular_buffer_init_capacity(&resized, capacity);
+    if (result != 0)
     {
-        if (!first_and_full && current == buffer->in_offs)
-        {
-            return -1;
-        }
-        first_and_full = false;
-        output += buffer->entry[current].size;
-        current++;
-        if (current >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
-        {
-            current = 0;
-        }
+        return result;
     }
+    aesd_circular_buffer_move(buffer, &resized, evicted);
+    *buffer = resized;
+    return 0;
+}
+
+/**
+ * Releases the arrays of @param buffer. The memory referenced by its entries is managed by the caller.
+ */
+void aesd_circular_buffer_free(struct aesd_circular_buffer *buffer)
+{
+    aesd_circular_buffer_release(buffer->entry);
+    aesd_circular_buffer_release(buffer->entry_start);
+    buffer->entry = NULL;
+    buffer->entry_start = NULL;
+}
 
-    if (buffer->entry[current].size <= char_offset)
+/**
+ * @return the total bytes held by @param buffer, in constant time
+ */
+size_t aesd_circular_buffer_get_count(struct aesd_circular_buffer *buffer)
+{
+    return buffer->total_size;
+}
+
+/**
+ * @return the position of byte @param char_offset of the @param entry_offset'th entry when all entries are
+ * concatenated end to end, in constant time, or -1 if the entry or byte does not exist
+ */
+ssize_t aesd_circular_buffer_get_absolute_offset(struct aesd_circular_buffer *buffer, uint32_t entry_offset, size_t char_offset)
+{
+    uint32_t slot;
+
+    if (entry_offset >= aesd_circular_buffer_get_entries(buffer))
     {
         return -1;
     }
-
-    return output + char_offset;
+    slot = aesd_circular_buffer_slot(buffer, entry_offset);
+    if (buffer->entry[slot].size <= char_offset)
+    {
+        return -1;
+    }
+    return buffer->entry_start[slot] - buffer->entry_start[buffer->out_offs] + char_offset;
 }
@@ -13,10 +13,21 @@
 #else
 #include <stddef.h> // size_t
 #include <stdint.h> // uintx_t
+#include <sys/types.h> // ssize_t
 #include <stdbool.h>
 #endif
 
+/**
+ * Default number of write operations kept, held by aesd_circular_buffer_init. Other capacities
+ * are set at runtime with aesd_circular_buffer_init_capacity and aesd_circular_buffer_resize
+ */
+#ifndef AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+#endif
+/**
+ * Largest capacity accepted
+ */
+#define AESDCHAR_CAPACITY_MAX (1U << 20)
 
 struct aesd_buffer_entry
 {
@@ -33,18 +44,38 @@ struct aesd_buffer_entry
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * An array of pointers to memory allocated for the most recent write operations,
+     * mask + 1 entries long
      */
-    struct aesd_buffer_entry entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    struct aesd_buffer_entry *entry;
+    /**
+     * Running byte offset of the first byte of each entry, counted over every entry
+     * ever added. Increasing from out_offs to in_offs, so an entry is found by binary
+     * search; positions in the buffer are differences to the start of out_offs.
+     */
+    size_t *entry_start;
+    /**
+     * Number of entries kept before the oldest is overwritten
+     */
+    uint32_t capacity;
+    /**
+     * The arrays hold capacity rounded up to a power of two entries, less one, so
+     * locations wrap with a mask
+     */
+    uint32_t mask;
+    /**
+     * Total bytes held by the entries
+     */
+    size_t total_size;
     /**
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    uint32_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    uint32_t out_offs;
     /**
      * set to true when the buffer entry structure is full
      */
@@ -52,11 +83,11 @@ struct aesd_circular_buffer
     /**
      * The current file position entry
      */
-    uint8_t f_pos_offs;
+    uint32_t f_pos_offs;
     /**
      * The current file position character offset
      */
-    uint8_t f_pos_char_offset;
+    uint32_t f_pos_char_offset;
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
@@ -64,29 +95,44 @@ extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos
 
 extern struct aesd_buffer_entry aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
-extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
+extern struct aesd_buffer_entry aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer);
+
+extern int aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
+
+extern int aesd_circular_buffer_init_capacity(struct aesd_circular_buffer *buffer, uint32_t capacity);
+
+extern void aesd_circular_buffer_move(const struct aesd_circular_buffer *buffer, struct aesd_circular_buffer *resized,
+                                      struct aesd_circular_buffer *evicted);
+
+extern int aesd_circular_buffer_resize(struct aesd_circular_buffer *buffer, uint32_t capacity,
+                                       struct aesd_circular_buffer *evicted);
+
+extern void aesd_circular_buffer_free(struct aesd_circular_buffer *buffer);
 
 extern size_t aesd_circular_buffer_get_count(struct aesd_circular_buffer *buffer);
 
-extern ssize_t aesd_circular_buffer_get_absolute_offset(struct aesd_circular_buffer *buffer, uint8_t entry_offset, size_t char_offset);
+extern uint32_t aesd_circular_buffer_get_entries(const struct aesd_circular_buffer *buffer);
+
+extern ssize_t aesd_circular_buffer_get_absolute_offset(struct aesd_circular_buffer *buffer, uint32_t entry_offset, size_t char_offset);
 
 /**
- * Create a for loop to iterate over each member of the circular buffer.
+ * Create a for loop to iterate over each member of the circular buffer, from the oldest
+ * entry to the newest. Unused slots and slots of removed entries are not visited.
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a uint32_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
  *      free(entry->buffptr);
  * }
  */
-#define AESD_CIRCULAR_BUFFER_FOREACH(entryptr, buffer, index) \
-    for (index = 0, entryptr = &((buffer)->entry[index]);     \
-         index < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;     \
-         index++, entryptr = &((buffer)->entry[index]))
+#define AESD_CIRCULAR_BUFFER_FOREACH(entryptr, buffer, index)                    \
+    for (index = 0, entryptr = &((buffer)->entry[(buffer)->out_offs]);           \
+         index < aesd_circular_buffer_get_entries(buffer);                       \
+         index++, entryptr = &((buffer)->entry[((buffer)->out_offs + index) & (buffer)->mask]))
 
 #endif /* AESD_CIRCULAR_BUFFER_H */
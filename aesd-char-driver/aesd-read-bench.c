@@ -0,0 +1,263 @@
+/**
+ * @file aesd-read-bench.c
+ * @brief Benchmark of reading the whole aesdchar device with read() and readv()
+ *
+ * Fills the device with write commands of a fixed size, then reads it from the start to the end
+ * with read() and with readv() of 8 segments, at user buffer sizes from 64 B to 1 MB, and reports
+ * the system calls and us per full-device read next to the calls aesd_read took when it returned
+ * the rest of one write command per call. Checks that every full-device read returns the commands
+ * written. Replaces the commands on the device and restores its capacity and retention policy when
+ * done. Skips when the device is absent. Built with "make bench".
+ *
+ * Usage: aesd-read-bench [device, default /dev/aesdchar]. Any other file is truncated and filled
+ * instead, to check the benchmark itself.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "aesd_ioctl.h"
+
+#define READ_BENCH_DEVICE "/dev/aesdchar"
+#define READ_BENCH_MAX_READ (1024 * 1024)
+#define READ_BENCH_SEGMENTS 8
+/**
+ * Bytes read per timing, so small devices are read more times
+ */
+#define READ_BENCH_WORK (64 * 1024 * 1024L)
+#define READ_BENCH_MIN_READS 5
+
+static double read_bench_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/**
+ * Fills @param command with write command @param index of @param size bytes: its index, one repeated
+ * letter and a newline
+ */
+static void read_bench_command(char *command, size_t size, size_t index)
+{
+    char digits[24];
+    size_t length = (size_t)snprintf(digits, sizeof(digits), "%zu ", index);
+
+    memset(command, 'a' + index % 26, size - 1);
+    memcpy(command, digits, length < size - 1 ? length : size - 1);
+    command[size - 1] = '\n';
+}
+
+/**
+ * Replaces the contents of @param fd with @param entries write commands of @param entry_size bytes,
+ * copied to @param expected
+ * @return 0, or -1 on failure
+ */
+static int read_bench_fill(int fd, bool device, uint32_t entries, size_t entry_size, char *expected)
+{
+    uint32_t i;
+
+    if (device && ioctl(fd, AESDCHAR_IOCSETCAPACITY, &entries) != 0)
+    {
+        fprintf(stderr, "Failed to set the capacity to %u: %s\n", entries, strerror(errno));
+        return -1;
+    }
+    if (!device && ftruncate(fd, 0) != 0)
+    {
+        fprintf(stderr, "Failed to truncate: %s\n", strerror(errno));
+        return -1;
+    }
+    // With a capacity of entries, the commands written push out everything held before
+    for (i = 0; i < entries; i++)
+    {
+        read_bench_command(expected + (size_t)i * entry_size, entry_size, i);
+        if (write(fd, expected + (size_t)i * entry_size, entry_size) != (ssize_t)entry_size)
+        {
+            fprintf(stderr, "Failed to write command %u: %s\n", i, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Reads all of @param fd from the start @param reads times, with readv() of READ_BENCH_SEGMENTS
+ * segments of @param buf when @param vectored is set and with read() otherwise, in calls of
+ * @param count bytes
+ * @return the us per full-device read, with the system calls per full-device read in @param calls and
+ * the bytes of the last one in @param data of @param size bytes, or a negative value on failure
+ */
+static double read_bench_device(int fd, bool vectored, char *buf, size_t count, long reads, long *calls,
+                                char *data, size_t size)
+{
+    struct iovec iov[READ_BENCH_SEGMENTS];
+    size_t segment = count / READ_BENCH_SEGMENTS;
+    double start;
+    size_t pos;
+    ssize_t result;
+    long i;
+    int j;
+
+    for (j = 0; j < READ_BENCH_SEGMENTS; j++)
+    {
+        iov[j].iov_base = buf + j * segment;
+        iov[j].iov_len = segment;
+    }
+    *calls = 0;
+    start = read_bench_now_us();
+    for (i = 0; i < reads; i++)
+    {
+        if (lseek(fd, 0, SEEK_SET) != 0)
+        {
+            return -1;
+        }
+        (*calls)++;
+        pos = 0;
+        do
+        {
+            result = vectored ? readv(fd, iov, READ_BENCH_SEGMENTS) : read(fd, buf, count);
+            (*calls)++;
+            if (result < 0 || pos + result > size)
+            {
+                return -1;
+            }
+            memcpy(data + pos, buf, result);
+            pos += result;
+        } while (result > 0);
+        if (pos != size)
+        {
+            return -1;
+        }
+    }
+    *calls /= reads;
+    return (read_bench_now_us() - start) / reads;
+}
+
+/**
+ * Times full-device reads of @param entries write commands of @param entry_size bytes and prints one
+ * line for each user buffer size
+ * @return 0, or 1 on failure or if a read returned other data than written
+ */
+static int read_bench_entries(int fd, bool device, uint32_t entries, size_t entry_size)
+{
+    // The 16 KB reads are the REPLAY_CHUNK of the aesdsocket replay
+    static const size_t counts[] = {64, 1024, 16 * 1024, READ_BENCH_MAX_READ};
+    size_t total = (size_t)entries * entry_size;
+    long reads = READ_BENCH_WORK / total > READ_BENCH_MIN_READS ? READ_BENCH_WORK / total : READ_BENCH_MIN_READS;
+    char *expected = malloc(total);
+    char *data = malloc(total);
+    char *buf = malloc(READ_BENCH_MAX_READ);
+    long read_calls, readv_calls, one_entry_calls;
+    double read_us, readv_us;
+    int status = 0;
+    size_t count;
+    size_t i;
+
+    if (expected == NULL || data == NULL || buf == NULL || read_bench_fill(fd, device, entries, entry_size, expected))
+    {
+        free(expected);
+        free(data);
+        free(buf);
+        return 1;
+    }
+    for (i = 0; i < sizeof(counts) / sizeof(counts[0]) && status == 0; i++)
+    {
+        count = counts[i];
+        memset(data, 0, total);
+        read_us = read_bench_device(fd, false, buf, count, reads, &read_calls, data, total);
+        if (read_us < 0 || memcmp(data, expected, total) != 0)
+        {
+            status = 1;
+        }
+        memset(data, 0, total);
+        readv_us = read_bench_device(fd, true, buf, count, reads, &readv_calls, data, total);
+        if (readv_us < 0 || memcmp(data, expected, total) != 0)
+        {
+            status = 1;
+        }
+        // One call per piece of each command that fits the user buffer, the lseek and the read at the end
+        one_entry_calls = (long)entries * ((entry_size + count - 1) / count) + 2;
+        printf("%7u x %5zu B, %7zu B reads: read %7ld calls %9.1f us, readv %7ld calls %9.1f us "
+               "(one entry per read: %7ld calls)\n",
+               entries, entry_size, count, read_calls, read_us, readv_calls, readv_us, one_entry_calls);
+    }
+    if (status != 0)
+    {
+        fprintf(stderr, "Reads of %u commands of %zu bytes failed or returned other data than written\n", entries,
+                entry_size);
+    }
+    free(expected);
+    free(data);
+    free(buf);
+    return status;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct
+    {
+        uint32_t entries;
+        size_t entry_size;
+    } cases[] = {
+        {10, 20},
+        {1000, 64},
+        {1000, 4096},
+        {100000, 64},
+    };
+    const char *path = argc > 1 ? argv[1] : READ_BENCH_DEVICE;
+    struct aesd_retention retention = {AESDCHAR_RETAIN_COUNT, 0, 0};
+    struct aesd_usage usage;
+    struct stat st;
+    bool device;
+    int status = 0;
+    size_t i;
+    int fd;
+
+    if (argc > 2)
+    {
+        fprintf(stderr, "Usage: %s [device, default %s]\n", argv[0], READ_BENCH_DEVICE);
+        return 2;
+    }
+    fd = open(path, O_RDWR | O_APPEND);
+    if (fd == -1)
+    {
+        fprintf(stderr, "Skipping, %s is not available (aesdchar not loaded?): %s\n", path, strerror(errno));
+        return 0;
+    }
+    device = fstat(fd, &st) == 0 && S_ISCHR(st.st_mode);
+    // Evict by count only, so the commands written are the contents of the device
+    if (device &&
+        (ioctl(fd, AESDCHAR_IOCGETUSAGE, &usage) != 0 || ioctl(fd, AESDCHAR_IOCSETRETENTION, &retention) != 0))
+    {
+        fprintf(stderr, "Skipping, %s is not an aesdchar device: %s\n", path, strerror(errno));
+        close(fd);
+        return 0;
+    }
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]) && status == 0; i++)
+    {
+        status |= read_bench_entries(fd, device, cases[i].entries, cases[i].entry_size);
+    }
+
+    if (device)
+    {
+        retention.policy = usage.policy;
+        retention.byte_budget = usage.byte_budget;
+        if (ioctl(fd, AESDCHAR_IOCSETCAPACITY, &usage.capacity) != 0 ||
+            ioctl(fd, AESDCHAR_IOCSETRETENTION, &retention) != 0)
+        {
+            fprintf(stderr, "Failed to restore the capacity and retention policy: %s\n", strerror(errno));
+            status = 1;
+        }
+    }
+    close(fd);
+    return status;
+}
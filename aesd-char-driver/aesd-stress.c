@@ -0,0 +1,460 @@
+/**
+ * @file aesd-stress.c
+ * @brief Read/write stress test of the aesdchar device, scaling readers from 1 to N cores
+ *
+ * Runs one writer against a growing number of readers on /dev/aesdchar, from 1 to the number of online
+ * cores. The writer adds numbered write commands of a fixed size, some in two writes, and switches the
+ * capacity between 64 and 128 commands every few thousand writes. Each reader has its own descriptor and
+ * reads the device from the start to the end, from a command found with AESDCHAR_IOCSEEKTO, or from a
+ * position set with lseek, in reads of various sizes.
+ *
+ * Commands only ever leave the device whole and from the oldest, so with commands of one size every read
+ * starting at a command boundary returns whole commands, after the rest of the command it started in
+ * otherwise. Each read is checked for that, and for command numbers increasing within each pass.
+ * Reports reads, MB and writes per second for each number of readers, and exits with 1 if a read failed
+ * or returned anything else. Restores the device's capacity and retention policy when done. Skips when
+ * the device is absent. Built with "make stress".
+ *
+ * Usage: aesd-stress [seconds per run] [most readers] [device, default /dev/aesdchar]. Any other file
+ * is truncated and appended to instead, to check the test itself.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "aesd_ioctl.h"
+
+#define STRESS_DEVICE "/dev/aesdchar"
+#define STRESS_DEFAULT_SECONDS 1.0
+#define STRESS_MAX_READERS 256
+#define STRESS_SMALL_CAPACITY 64
+#define STRESS_LARGE_CAPACITY 128
+#define STRESS_RESIZE_INTERVAL 5000
+/**
+ * Every write command is its number in STRESS_NUMBER_DIGITS digits, a space, one repeated letter and a
+ * newline, STRESS_COMMAND_SIZE bytes in all
+ */
+#define STRESS_COMMAND_SIZE 64
+#define STRESS_NUMBER_DIGITS 16
+#define STRESS_MAX_READ (STRESS_LARGE_CAPACITY * STRESS_COMMAND_SIZE)
+#define STRESS_ERROR_SIZE 160
+
+struct stress_reader
+{
+    pthread_t thread;
+    int fd;
+    unsigned int random;
+    long reads;
+    long bytes;
+    char error[STRESS_ERROR_SIZE];
+};
+
+static const char *stress_path;
+static bool stress_device;
+static atomic_int stress_stop;
+// Number of the last write command written, only touched by the writer once the readers start
+static uint64_t stress_number;
+
+static double stress_now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Fills @param command with write command @param number
+ */
+static void stress_command(char *command, uint64_t number)
+{
+    memset(command, 'a' + number % 26, STRESS_COMMAND_SIZE - 1);
+    snprintf(command, STRESS_NUMBER_DIGITS + 1, "%0*llu", STRESS_NUMBER_DIGITS, (unsigned long long)number);
+    command[STRESS_NUMBER_DIGITS] = ' ';
+    command[STRESS_COMMAND_SIZE - 1] = '\n';
+}
+
+/**
+ * Checks the @param size bytes at @param data, starting at @param offset within a write command: the
+ * rest of that command, then whole commands numbered above @param last_number and each other, the last
+ * of which may be cut short. @param last_number is updated with the last command number read.
+ * @return true if the bytes are what the writer wrote, false with the reason in the reader's error
+ */
+static bool stress_check(struct stress_reader *reader, const char *data, size_t size, size_t offset,
+                         uint64_t *last_number)
+{
+    uint64_t number = 0;
+    char letter = 0;
+    size_t i;
+
+    for (i = 0; i < size; i++, offset = (offset + 1) % STRESS_COMMAND_SIZE)
+    {
+        char expected;
+        if (offset < STRESS_NUMBER_DIGITS)
+        {
+            if (data[i] < '0' || data[i] > '9')
+            {
+                break;
+            }
+            number = offset == 0 ? 0 : number;
+            number = number * 10 + (data[i] - '0');
+            continue;
+        }
+        if (offset == STRESS_NUMBER_DIGITS)
+        {
+            // Only a whole number is known, commands started in are checked by their letter alone
+            if (i >= STRESS_NUMBER_DIGITS)
+            {
+                if (number <= *last_number)
+                {
+                    snprintf(reader->error, sizeof(reader->error), "command %llu read after command %llu",
+                             (unsigned long long)number, (unsigned long long)*last_number);
+                    return false;
+                }
+                *last_number = number;
+                letter = 'a' + number % 26;
+            }
+            else
+            {
+                letter = 0;
+            }
+            expected = ' ';
+        }
+        else if (offset == STRESS_COMMAND_SIZE - 1)
+        {
+            expected = '\n';
+        }
+        else
+        {
+            letter = letter == 0 ? data[i] : letter;
+            expected = letter;
+        }
+        if (data[i] != expected)
+        {
+            break;
+        }
+    }
+    if (i < size)
+    {
+        snprintf(reader->error, sizeof(reader->error), "byte %zu of a %zu byte read is '%c', %zu bytes into a command",
+                 i, size, data[i], offset);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Reads once into @param buf, @param offset bytes into a write command, and checks the data
+ * @return the number of bytes read, or -1 on failure with the reason in the reader's error
+ */
+static ssize_t stress_read(struct stress_reader *reader, char *buf, size_t count, size_t offset,
+                           uint64_t *last_number)
+{
+    ssize_t result = read(reader->fd, buf, count);
+    if (result < 0)
+    {
+        snprintf(reader->error, sizeof(reader->error), "read() failed: %s", strerror(errno));
+        return -1;
+    }
+    reader->reads++;
+    reader->bytes += result;
+    if (!stress_check(reader, buf, result, offset, last_number))
+    {
+        return -1;
+    }
+    return result;
+}
+
+/**
+ * @return the size of the next read, a whole number of commands or not
+ */
+static size_t stress_read_size(struct stress_reader *reader)
+{
+    static const size_t sizes[] = {1, STRESS_COMMAND_SIZE - 1, STRESS_COMMAND_SIZE, 7 * STRESS_COMMAND_SIZE, 1000,
+                                   STRESS_MAX_READ};
+    return sizes[rand_r(&reader->random) % (sizeof(sizes) / sizeof(sizes[0]))];
+}
+
+static void *stress_reader_thread(void *arg)
+{
+    struct stress_reader *reader = arg;
+    char buf[STRESS_MAX_READ];
+    struct aesd_seekto seekto;
+    uint64_t last_number;
+    size_t count;
+    ssize_t result;
+    off_t pos;
+
+    while (!atomic_load_explicit(&stress_stop, memory_order_relaxed))
+    {
+        last_number = 0;
+        result = 0;
+        count = stress_read_size(reader);
+        switch (rand_r(&reader->random) % 3)
+        {
+        case 0:
+            // The whole device, in reads of one size
+            if (lseek(reader->fd, 0, SEEK_SET) != 0)
+            {
+                snprintf(reader->error, sizeof(reader->error), "lseek() to the start failed: %s", strerror(errno));
+                return NULL;
+            }
+            pos = 0;
+            do
+            {
+                result = stress_read(reader, buf, count, pos % STRESS_COMMAND_SIZE, &last_number);
+                pos += result;
+            } while (result > 0 && !atomic_load_explicit(&stress_stop, memory_order_relaxed));
+            break;
+        case 1:
+            // From a command and offset, which may have left the device
+            seekto.write_cmd = rand_r(&reader->random) % STRESS_LARGE_CAPACITY;
+            seekto.write_cmd_offset = rand_r(&reader->random) % STRESS_COMMAND_SIZE;
+            if (!stress_device)
+            {
+                pos = lseek(reader->fd, (off_t)seekto.write_cmd * STRESS_COMMAND_SIZE + seekto.write_cmd_offset,
+                            SEEK_SET);
+            }
+            else if (ioctl(reader->fd, AESDCHAR_IOCSEEKTO, &seekto) != 0)
+            {
+                if (errno != EINVAL)
+                {
+                    snprintf(reader->error, sizeof(reader->error), "AESDCHAR_IOCSEEKTO failed: %s", strerror(errno));
+                    return NULL;
+                }
+                break;
+            }
+            result = stress_read(reader, buf, count, seekto.write_cmd_offset, &last_number);
+            break;
+        default:
+            // From a position, which may be past the end
+            pos = rand_r(&reader->random) % (STRESS_LARGE_CAPACITY * STRESS_COMMAND_SIZE);
+            if (lseek(reader->fd, pos, SEEK_SET) != pos)
+            {
+                if (errno != EINVAL)
+                {
+                    snprintf(reader->error, sizeof(reader->error), "lseek() failed: %s", strerror(errno));
+                    return NULL;
+                }
+                break;
+            }
+            result = stress_read(reader, buf, count, pos % STRESS_COMMAND_SIZE, &last_number);
+            break;
+        }
+        if (result < 0)
+        {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+static void *stress_writer_thread(void *arg)
+{
+    long *writes = arg;
+    char command[STRESS_COMMAND_SIZE];
+    unsigned int random = 1;
+    uint32_t capacity = STRESS_SMALL_CAPACITY;
+    size_t split;
+    int fd;
+
+    fd = open(stress_path, O_WRONLY | O_APPEND);
+    if (fd == -1)
+    {
+        fprintf(stderr, "Failed to open %s: %s\n", stress_path, strerror(errno));
+        return NULL;
+    }
+    while (!atomic_load_explicit(&stress_stop, memory_order_relaxed))
+    {
+        stress_command(command, ++stress_number);
+        // Some commands arrive in two writes, joined by the driver
+        split = rand_r(&random) % 4 == 0 ? 1 + rand_r(&random) % (STRESS_COMMAND_SIZE - 1) : STRESS_COMMAND_SIZE;
+        if (write(fd, command, split) != (ssize_t)split ||
+            (split < STRESS_COMMAND_SIZE &&
+             write(fd, command + split, STRESS_COMMAND_SIZE - split) != (ssize_t)(STRESS_COMMAND_SIZE - split)))
+        {
+            fprintf(stderr, "Failed to write command %llu: %s\n", (unsigned long long)stress_number,
+                    strerror(errno));
+            break;
+        }
+        (*writes)++;
+        if (stress_device && *writes % STRESS_RESIZE_INTERVAL == 0)
+        {
+            capacity = capacity == STRESS_SMALL_CAPACITY ? STRESS_LARGE_CAPACITY : STRESS_SMALL_CAPACITY;
+            if (ioctl(fd, AESDCHAR_IOCSETCAPACITY, &capacity) != 0)
+            {
+                fprintf(stderr, "Failed to set the capacity to %u: %s\n", capacity, strerror(errno));
+                break;
+            }
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+/**
+ * Runs @param count readers against the writer for @param seconds
+ * @return 0, or -1 if a reader failed or a thread could not be started
+ */
+static int stress_run(struct stress_reader *readers, int count, double seconds)
+{
+    struct timespec duration;
+    pthread_t writer;
+    long writes = 0;
+    long reads = 0;
+    long bytes = 0;
+    double start;
+    int started;
+    int status = 0;
+
+    atomic_store(&stress_stop, 0);
+    start = stress_now_seconds();
+    if (pthread_create(&writer, NULL, stress_writer_thread, &writes) != 0)
+    {
+        fprintf(stderr, "Failed to start the writer\n");
+        return -1;
+    }
+    for (started = 0; started < count; started++)
+    {
+        memset(&readers[started], 0, sizeof(readers[started]));
+        readers[started].random = started + 1;
+        readers[started].fd = open(stress_path, O_RDONLY);
+        if (readers[started].fd == -1)
+        {
+            fprintf(stderr, "Failed to open %s: %s\n", stress_path, strerror(errno));
+            break;
+        }
+        if (pthread_create(&readers[started].thread, NULL, stress_reader_thread, &readers[started]) != 0)
+        {
+            fprintf(stderr, "Failed to start reader %d\n", started);
+            close(readers[started].fd);
+            break;
+        }
+    }
+    if (started == count)
+    {
+        duration.tv_sec = (time_t)seconds;
+        duration.tv_nsec = (long)((seconds - duration.tv_sec) * 1e9);
+        nanosleep(&duration, NULL);
+    }
+    else
+    {
+        status = -1;
+    }
+    atomic_store(&stress_stop, 1);
+    pthread_join(writer, NULL);
+    while (started > 0)
+    {
+        started--;
+        pthread_join(readers[started].thread, NULL);
+        close(readers[started].fd);
+        reads += readers[started].reads;
+        bytes += readers[started].bytes;
+        if (readers[started].error[0] != '\0')
+        {
+            fprintf(stderr, "Reader %d of %d: %s\n", started, count, readers[started].error);
+            status = -1;
+        }
+    }
+    seconds = stress_now_seconds() - start;
+    printf("%3d readers: %10.0f reads/s %9.1f MB/s %9.0f writes/s\n", count, reads / seconds,
+           bytes / seconds / 1e6, writes / seconds);
+    return status;
+}
+
+int main(int argc, char **argv)
+{
+    double seconds = argc > 1 ? atof(argv[1]) : STRESS_DEFAULT_SECONDS;
+    long max_readers = argc > 2 ? atol(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+    struct aesd_retention retention = {AESDCHAR_RETAIN_COUNT, 0, 0};
+    uint32_t capacity = STRESS_SMALL_CAPACITY;
+    char command[STRESS_COMMAND_SIZE];
+    struct stress_reader *readers;
+    struct aesd_usage usage;
+    struct stat st;
+    int status = 0;
+    int count;
+    int fd;
+
+    stress_path = argc > 3 ? argv[3] : STRESS_DEVICE;
+    if (argc > 4 || seconds <= 0 || max_readers <= 0 || max_readers > STRESS_MAX_READERS)
+    {
+        fprintf(stderr, "Usage: %s [seconds per run, default %.0f] [most readers, 1 to %d, default the online "
+                "cores] [device, default %s]\n", argv[0], STRESS_DEFAULT_SECONDS, STRESS_MAX_READERS, STRESS_DEVICE);
+        return 2;
+    }
+    fd = open(stress_path, O_RDWR | O_APPEND);
+    if (fd == -1)
+    {
+        fprintf(stderr, "Skipping, %s is not available (aesdchar not loaded?): %s\n", stress_path, strerror(errno));
+        return 0;
+    }
+    stress_device = fstat(fd, &st) == 0 && S_ISCHR(st.st_mode);
+    // Evict by count only, so the device holds whole commands of the writer
+    if (stress_device &&
+        (ioctl(fd, AESDCHAR_IOCGETUSAGE, &usage) != 0 || ioctl(fd, AESDCHAR_IOCSETRETENTION, &retention) != 0 ||
+         ioctl(fd, AESDCHAR_IOCSETCAPACITY, &capacity) != 0))
+    {
+        fprintf(stderr, "Skipping, %s is not an aesdchar device: %s\n", stress_path, strerror(errno));
+        close(fd);
+        return 0;
+    }
+    if (!stress_device && ftruncate(fd, 0) != 0)
+    {
+        fprintf(stderr, "Failed to truncate %s: %s\n", stress_path, strerror(errno));
+        close(fd);
+        return 1;
+    }
+    // Push out the commands held before
+    for (count = 0; count < STRESS_LARGE_CAPACITY && status == 0; count++)
+    {
+        stress_command(command, ++stress_number);
+        if (write(fd, command, sizeof(command)) != sizeof(command))
+        {
+            fprintf(stderr, "Failed to write: %s\n", strerror(errno));
+            status = 1;
+        }
+    }
+    readers = calloc(STRESS_MAX_READERS, sizeof(*readers));
+    if (readers == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        status = 1;
+    }
+
+    // Doubling the readers up to the online cores, and the online cores themselves
+    for (count = 1; status == 0; count = count * 2 < max_readers ? count * 2 : max_readers)
+    {
+        if (stress_run(readers, count, seconds) != 0)
+        {
+            status = 1;
+        }
+        if (count == max_readers)
+        {
+            break;
+        }
+    }
+
+    free(readers);
+    if (stress_device)
+    {
+        retention.policy = usage.policy;
+        retention.byte_budget = usage.byte_budget;
+        if (ioctl(fd, AESDCHAR_IOCSETCAPACITY, &usage.capacity) != 0 ||
+            ioctl(fd, AESDCHAR_IOCSETRETENTION, &retention) != 0)
+        {
+            fprintf(stderr, "Failed to restore the capacity and retention policy: %s\n", strerror(errno));
+            status = 1;
+        }
+    }
+    close(fd);
+    return status;
+}
@@ -33,14 +33,66 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * Retention policies: evict the oldest write command once the buffer holds its capacity of commands
+ * (the default), once it holds more than its byte budget, or on whichever comes first. With the byte
+ * budget alone the capacity grows as needed, up to AESDCHAR_CAPACITY_MAX. The newest command is
+ * always kept, even when larger than the budget.
+ */
+#define AESDCHAR_RETAIN_COUNT 0
+#define AESDCHAR_RETAIN_BYTES 1
+#define AESDCHAR_RETAIN_COUNT_AND_BYTES 2
+
+/**
+ * Retention policy of an aesdchar device, passed with AESDCHAR_IOCSETRETENTION
+ */
+struct aesd_retention {
+    /**
+     * One of AESDCHAR_RETAIN_*
+     */
+    uint32_t policy;
+    uint32_t reserved;
+    /**
+     * Bytes kept at most, not 0 unless the policy is AESDCHAR_RETAIN_COUNT
+     */
+    uint64_t byte_budget;
+};
+
+/**
+ * Current usage of an aesdchar device, returned by AESDCHAR_IOCGETUSAGE
+ */
+struct aesd_usage {
+    uint32_t policy;
+    /**
+     * Write commands held, and held at most
+     */
+    uint32_t entries;
+    uint32_t capacity;
+    uint32_t reserved;
+    /**
+     * Bytes held, and the byte budget
+     */
+    uint64_t bytes;
+    uint64_t byte_budget;
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Set the number of write commands kept, from 1 to AESDCHAR_CAPACITY_MAX; the oldest commands that no
+// longer fit are dropped
+#define AESDCHAR_IOCSETCAPACITY _IOW(AESD_IOC_MAGIC, 2, uint32_t)
+// Get the number of write commands kept
+#define AESDCHAR_IOCGETCAPACITY _IOR(AESD_IOC_MAGIC, 3, uint32_t)
+// Set the retention policy, the oldest commands over the new limits are dropped
+#define AESDCHAR_IOCSETRETENTION _IOW(AESD_IOC_MAGIC, 4, struct aesd_retention)
+// Get the retention policy and how much of the buffer is in use
+#define AESDCHAR_IOCGETUSAGE _IOR(AESD_IOC_MAGIC, 5, struct aesd_usage)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 5
 
 #endif /* AESD_IOCTL_H */
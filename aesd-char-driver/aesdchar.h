@@ -10,6 +10,8 @@
 
 #include "aesd-circular-buffer.h"
 #include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/srcu.h>
 
 #define AESD_DEBUG 1  //Remove comment on this line to enable debug
 
@@ -34,6 +36,18 @@ struct aesd_dev
     struct mutex buffer_mutex;
     struct mutex input_buffer_mutex;
     struct aesd_circular_buffer buffer;
+    /**
+     * Writers change buffer with buffer_mutex held and inside buffer_seq. Readers take neither:
+     * they copy the indices of buffer under buffer_seq and the data inside srcu, which keeps
+     * dropped write commands and replaced arrays alive until they are done.
+     */
+    seqcount_mutex_t buffer_seq;
+    struct srcu_struct srcu;
+    /**
+     * AESDCHAR_RETAIN_* policy and byte budget applied to buffer, under buffer_mutex
+     */
+    uint32_t retention;
+    size_t byte_budget;
     char * input_buffer;
     size_t input_buffer_length;
     size_t input_buffer_capacity;
@@ -12,17 +12,31 @@
  */
 
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/init.h>
 #include <linux/printk.h>
 #include <linux/types.h>
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
+#include <linux/uio.h> // iov_iter
 #include "aesdchar.h"
 #include <linux/slab.h>
+#include <linux/overflow.h> // struct_size
 #include "aesd_ioctl.h"
 
 int aesd_major = 0; // use dynamic major
 int aesd_minor = 0;
+// Number of write commands kept, changed at runtime with AESDCHAR_IOCSETCAPACITY
+static uint aesd_capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(aesd_capacity, uint, S_IRUGO);
+MODULE_PARM_DESC(aesd_capacity, "Number of write commands kept, from 1 to 1048576");
+// Retention policy and byte budget, changed at runtime with AESDCHAR_IOCSETRETENTION
+static uint aesd_retention = AESDCHAR_RETAIN_COUNT;
+module_param(aesd_retention, uint, S_IRUGO);
+MODULE_PARM_DESC(aesd_retention, "0 to evict by write commands, 1 by bytes, 2 by both");
+static ulong aesd_byte_budget = 0;
+module_param(aesd_byte_budget, ulong, S_IRUGO);
+MODULE_PARM_DESC(aesd_byte_budget, "Bytes kept at most when evicting by bytes");
 
 MODULE_AUTHOR("Christopher Kappelmann"); /** TODO: fill in your name **/
 MODULE_LICENSE("Dual BSD/GPL");
@@ -51,45 +65,200 @@ int aesd_release(struct inode *inode, struct file *filp)
     return 0;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                  loff_t *f_pos)
+/**
+ * A write command, with what call_srcu needs to free it once no reader can see it
+ */
+struct aesd_record
+{
+    struct rcu_head rcu;
+    char data[];
+};
+
+static void aesd_record_free(struct rcu_head *head)
+{
+    kfree(container_of(head, struct aesd_record, rcu));
+}
+
+/**
+ * Frees the write command at @param buffptr once the readers of @param dev that may still copy it are done
+ */
+static void aesd_record_release(struct aesd_dev *dev, const char *buffptr)
+{
+    struct aesd_record *record;
+
+    record = (struct aesd_record *)(buffptr - offsetof(struct aesd_record, data));
+    call_srcu(&dev->srcu, &record->rcu, aesd_record_free);
+}
+
+/**
+ * Copies the entry of @param dev holding byte @param pos to @param entry, without waiting for writers.
+ * Must be called inside an srcu read section, which keeps the arrays searched and the entry data alive.
+ * @return false if @param pos is past the data
+ */
+static bool aesd_find_entry(struct aesd_dev *dev, loff_t pos, struct aesd_buffer_entry *entry,
+                            size_t *entry_offset)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry *found;
+    unsigned int seq;
+
+    do
+    {
+        found = NULL;
+        seq = read_seqcount_begin(&dev->buffer_seq);
+        // A writer may change the arrays under the search, but the indices of a checked copy keep it in bounds
+        buffer = dev->buffer;
+        if (read_seqcount_retry(&dev->buffer_seq, seq))
+        {
+            continue;
+        }
+        found = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, pos, entry_offset);
+        if (found != NULL)
+        {
+            *entry = *found;
+        }
+    } while (read_seqcount_retry(&dev->buffer_seq, seq));
+    return found != NULL;
+}
+
+/**
+ * aesd_circular_buffer_get_absolute_offset on the buffer of @param dev, without waiting for writers.
+ * Must be called inside an srcu read section.
+ */
+static ssize_t aesd_absolute_offset(struct aesd_dev *dev, uint32_t write_cmd, uint32_t write_cmd_offset)
+{
+    struct aesd_circular_buffer buffer;
+    ssize_t result;
+    unsigned int seq;
+
+    do
+    {
+        result = -1;
+        seq = read_seqcount_begin(&dev->buffer_seq);
+        buffer = dev->buffer;
+        if (read_seqcount_retry(&dev->buffer_seq, seq))
+        {
+            continue;
+        }
+        result = aesd_circular_buffer_get_absolute_offset(&buffer, write_cmd, write_cmd_offset);
+    } while (read_seqcount_retry(&dev->buffer_seq, seq));
+    return result;
+}
+
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
     ssize_t retval = 0;
-    int ret;
+    int srcu_index;
     struct aesd_dev *dev;
     size_t entry_offset;
-    struct aesd_buffer_entry *entry;
+    struct aesd_buffer_entry entry;
     size_t bytes_to_copy;
+    size_t copied;
 
-    PDEBUG("read %zu bytes with offset %lld", count, *f_pos);
+    PDEBUG("read %zu bytes with offset %lld", iov_iter_count(to), iocb->ki_pos);
     /**
      * TODO: handle read
      */
-    dev = filp->private_data;
-    ret = mutex_lock_interruptible(&dev->buffer_mutex);
-    if (ret != 0)
+    dev = iocb->ki_filp->private_data;
+    srcu_index = srcu_read_lock(&dev->srcu);
+    // Carry on across entries until the user buffer is full, finding each by its position
+    while (iov_iter_count(to) > 0 && aesd_find_entry(dev, iocb->ki_pos + retval, &entry, &entry_offset))
     {
-        return -ERESTART;
+        bytes_to_copy = entry.size - entry_offset;
+        copied = copy_to_iter(entry.buffptr + entry_offset, bytes_to_copy, to);
+        retval += copied;
+        if (copied < bytes_to_copy)
+        {
+            // Either the user buffer is full or it faulted, report the fault only if nothing was read
+            if (retval == 0 && iov_iter_count(to) > 0)
+            {
+                retval = -EFAULT;
+            }
+            break;
+        }
     }
-    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->buffer, *f_pos, &entry_offset);
-    if (entry == NULL)
+    srcu_read_unlock(&dev->srcu, srcu_index);
+    if (retval > 0)
     {
-        retval = 0;
-        goto cleanup;
+        iocb->ki_pos += retval;
     }
-    bytes_to_copy = entry->size - entry_offset;
-    bytes_to_copy = count < bytes_to_copy ? count : bytes_to_copy;
-    if (copy_to_user(buf, entry->buffptr + entry_offset, bytes_to_copy))
+    return retval;
+}
+
+/**
+ * Frees the write commands left in @param evicted, and its arrays once the readers of @param dev that
+ * may still search them are done
+ */
+static void aesd_free_entries(struct aesd_dev *dev, struct aesd_circular_buffer *evicted)
+{
+    struct aesd_buffer_entry entry;
+
+    entry = aesd_circular_buffer_remove_entry(evicted);
+    while (entry.buffptr != NULL)
     {
-        retval = -EFAULT;
-        goto cleanup;
+        aesd_record_release(dev, entry.buffptr);
+        entry = aesd_circular_buffer_remove_entry(evicted);
+    }
+    synchronize_srcu(&dev->srcu);
+    aesd_circular_buffer_free(evicted);
+}
+
+/**
+ * Drops the oldest write commands of @param dev until it is within its byte budget, keeping the newest.
+ * Must be called with buffer_mutex held, inside buffer_seq.
+ */
+static void aesd_enforce_byte_budget(struct aesd_dev *dev)
+{
+    struct aesd_buffer_entry entry;
+
+    if (dev->retention == AESDCHAR_RETAIN_COUNT)
+    {
+        return;
+    }
+    while (aesd_circular_buffer_get_count(&dev->buffer) > dev->byte_budget &&
+           aesd_circular_buffer_get_entries(&dev->buffer) > 1)
+    {
+        entry = aesd_circular_buffer_remove_entry(&dev->buffer);
+        aesd_record_release(dev, entry.buffptr);
     }
-    retval = bytes_to_copy;
-    *f_pos += bytes_to_copy;
+}
 
-cleanup:
-    mutex_unlock(&dev->buffer_mutex);
-    return retval;
+/**
+ * @return the capacity the full buffer of @param dev grows to, double its own, when only the byte budget
+ * limits it, so adding a write command does not evict by count, or 0 if it is not to grow. Must be
+ * called with buffer_mutex held or inside buffer_seq.
+ */
+static uint32_t aesd_byte_budget_capacity(struct aesd_dev *dev)
+{
+    if (dev->retention != AESDCHAR_RETAIN_BYTES || !dev->buffer.full ||
+        dev->buffer.capacity >= AESDCHAR_CAPACITY_MAX)
+    {
+        return 0;
+    }
+    return dev->buffer.capacity < AESDCHAR_CAPACITY_MAX / 2 ? dev->buffer.capacity * 2 : AESDCHAR_CAPACITY_MAX;
+}
+
+/**
+ * Allocates @param grown for the capacity the buffer of @param dev grows to before adding a write command,
+ * before taking buffer_mutex since the arrays may be large enough to need vmalloc
+ * @return the capacity of @param grown, or 0 if the buffer is not to grow or the allocation failed
+ */
+static uint32_t aesd_grow_allocate(struct aesd_dev *dev, struct aesd_circular_buffer *grown)
+{
+    uint32_t capacity;
+    unsigned int seq;
+
+    do
+    {
+        seq = read_seqcount_begin(&dev->buffer_seq);
+        capacity = aesd_byte_budget_capacity(dev);
+    } while (read_seqcount_retry(&dev->buffer_seq, seq));
+    // On failure the oldest command is evicted by count instead
+    if (capacity != 0 && aesd_circular_buffer_init_capacity(grown, capacity) != 0)
+    {
+        capacity = 0;
+    }
+    return capacity;
 }
 
 ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
@@ -158,39 +327,67 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
         }
         if (i < dev->input_buffer_length)
         {
-            char *entry_buffer;
+            struct aesd_record *record;
             size_t packet_length;
             struct aesd_buffer_entry new_entry;
             struct aesd_buffer_entry removed_entry;
+            struct aesd_circular_buffer grown_buffer;
+            struct aesd_circular_buffer evicted;
+            uint32_t grown_capacity;
+            bool grown;
 
-            // Write a full packet into the circular buffer
+            // Write a full packet into the circular buffer, allocated before taking buffer_mutex
             packet_length = i + 1;
+            record = kmalloc(struct_size(record, data, packet_length), GFP_KERNEL);
+            if (record == NULL)
+            {
+                retval = -ENOMEM;
+                goto cleanup;
+            }
+            memcpy(record->data, dev->input_buffer, packet_length);
+            grown_capacity = aesd_grow_allocate(dev, &grown_buffer);
 
             ret = mutex_lock_interruptible(&dev->buffer_mutex);
             if (ret != 0)
             {
+                kfree(record);
+                if (grown_capacity != 0)
+                {
+                    aesd_circular_buffer_free(&grown_buffer);
+                }
                 retval = -ERESTART;
                 goto cleanup;
             }
-            entry_buffer = kmalloc(packet_length, GFP_KERNEL);
-            if (entry_buffer == NULL)
-            {
-                retval = -ENOMEM;
-                mutex_unlock(&dev->buffer_mutex);
-                goto cleanup;
-            }
-            memcpy(entry_buffer, dev->input_buffer, packet_length);
             memmove(dev->input_buffer, dev->input_buffer + packet_length, dev->input_buffer_length - packet_length);
             dev->input_buffer_length -= packet_length;
-            new_entry.buffptr = entry_buffer;
+            new_entry.buffptr = record->data;
             new_entry.size = packet_length;
+            // The buffer may have been resized or the retention changed since the allocation
+            grown = grown_capacity != 0 && aesd_byte_budget_capacity(dev) == grown_capacity;
+            if (grown)
+            {
+                aesd_circular_buffer_move(&dev->buffer, &grown_buffer, &evicted);
+            }
+            write_seqcount_begin(&dev->buffer_seq);
+            if (grown)
+            {
+                dev->buffer = grown_buffer;
+            }
             removed_entry = aesd_circular_buffer_add_entry(&dev->buffer, &new_entry);
+            aesd_enforce_byte_budget(dev);
+            write_seqcount_end(&dev->buffer_seq);
             mutex_unlock(&dev->buffer_mutex);
             if (removed_entry.buffptr != NULL)
             {
-                kfree(removed_entry.buffptr);
-                removed_entry.buffptr = NULL;
-                removed_entry.size = 0;
+                aesd_record_release(dev, removed_entry.buffptr);
+            }
+            if (grown)
+            {
+                aesd_free_entries(dev, &evicted);
+            }
+            else if (grown_capacity != 0)
+            {
+                aesd_circular_buffer_free(&grown_buffer);
             }
         }
         else
@@ -209,11 +406,14 @@ loff_t aesd_llseek(struct file *filp, loff_t offset, int whence)
 {
     struct aesd_dev *dev;
     size_t total_count;
+    unsigned int seq;
 
     dev = filp->private_data;
-    mutex_lock(&dev->buffer_mutex);
-    total_count = aesd_circular_buffer_get_count(&dev->buffer);
-    mutex_unlock(&dev->buffer_mutex);
+    do
+    {
+        seq = read_seqcount_begin(&dev->buffer_seq);
+        total_count = aesd_circular_buffer_get_count(&dev->buffer);
+    } while (read_seqcount_retry(&dev->buffer_seq, seq));
 
     return fixed_size_llseek(filp, offset, whence, total_count);
 }
@@ -221,7 +421,13 @@ loff_t aesd_llseek(struct file *filp, loff_t offset, int whence)
 long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
     struct aesd_seekto data;
+    struct aesd_circular_buffer resized;
+    struct aesd_circular_buffer evicted;
+    struct aesd_retention retention;
+    struct aesd_usage usage;
+    uint32_t capacity;
     ssize_t result;
+    int srcu_index;
     struct aesd_dev *dev;
     dev = filp->private_data;
 
@@ -232,15 +438,74 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
         {
             return -EFAULT;
         }
-        mutex_lock(&dev->buffer_mutex);
-        result = aesd_circular_buffer_get_absolute_offset(&dev->buffer, data.write_cmd, data.write_cmd_offset);
-        mutex_unlock(&dev->buffer_mutex);
+        srcu_index = srcu_read_lock(&dev->srcu);
+        result = aesd_absolute_offset(dev, data.write_cmd, data.write_cmd_offset);
+        srcu_read_unlock(&dev->srcu, srcu_index);
         if (result < 0)
         {
             return -EINVAL;
         }
         filp->f_pos = result;
         break;
+    case AESDCHAR_IOCSETCAPACITY:
+        if (copy_from_user(&capacity, (void __user *)arg, sizeof(capacity)))
+        {
+            return -EFAULT;
+        }
+        result = aesd_circular_buffer_init_capacity(&resized, capacity);
+        if (result < 0)
+        {
+            return result;
+        }
+        mutex_lock(&dev->buffer_mutex);
+        aesd_circular_buffer_move(&dev->buffer, &resized, &evicted);
+        write_seqcount_begin(&dev->buffer_seq);
+        dev->buffer = resized;
+        write_seqcount_end(&dev->buffer_seq);
+        mutex_unlock(&dev->buffer_mutex);
+        aesd_free_entries(dev, &evicted);
+        break;
+    case AESDCHAR_IOCGETCAPACITY:
+        mutex_lock(&dev->buffer_mutex);
+        capacity = dev->buffer.capacity;
+        mutex_unlock(&dev->buffer_mutex);
+        if (copy_to_user((void __user *)arg, &capacity, sizeof(capacity)))
+        {
+            return -EFAULT;
+        }
+        break;
+    case AESDCHAR_IOCSETRETENTION:
+        if (copy_from_user(&retention, (void __user *)arg, sizeof(retention)))
+        {
+            return -EFAULT;
+        }
+        if (retention.policy > AESDCHAR_RETAIN_COUNT_AND_BYTES ||
+            (retention.policy != AESDCHAR_RETAIN_COUNT && retention.byte_budget == 0))
+        {
+            return -EINVAL;
+        }
+        mutex_lock(&dev->buffer_mutex);
+        write_seqcount_begin(&dev->buffer_seq);
+        dev->retention = retention.policy;
+        dev->byte_budget = retention.byte_budget;
+        aesd_enforce_byte_budget(dev);
+        write_seqcount_end(&dev->buffer_seq);
+        mutex_unlock(&dev->buffer_mutex);
+        break;
+    case AESDCHAR_IOCGETUSAGE:
+        memset(&usage, 0, sizeof(usage));
+        mutex_lock(&dev->buffer_mutex);
+        usage.policy = dev->retention;
+        usage.entries = aesd_circular_buffer_get_entries(&dev->buffer);
+        usage.capacity = dev->buffer.capacity;
+        usage.bytes = aesd_circular_buffer_get_count(&dev->buffer);
+        usage.byte_budget = dev->byte_budget;
+        mutex_unlock(&dev->buffer_mutex);
+        if (copy_to_user((void __user *)arg, &usage, sizeof(usage)))
+        {
+            return -EFAULT;
+        }
+        break;
     default:
         return -ENOTTY;
     }
@@ -250,7 +515,7 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
 struct file_operations aesd_fops = {
     .owner = THIS_MODULE,
-    .read = aesd_read,
+    .read_iter = aesd_read_iter,
     .write = aesd_write,
     .open = aesd_open,
     .release = aesd_release,
@@ -292,7 +557,31 @@ int aesd_init_module(void)
      */
     mutex_init(&aesd_device.buffer_mutex);
     mutex_init(&aesd_device.input_buffer_mutex);
-    aesd_circular_buffer_init(&aesd_device.buffer);
+    seqcount_mutex_init(&aesd_device.buffer_seq, &aesd_device.buffer_mutex);
+    if (aesd_retention > AESDCHAR_RETAIN_COUNT_AND_BYTES ||
+        (aesd_retention != AESDCHAR_RETAIN_COUNT && aesd_byte_budget == 0))
+    {
+        printk(KERN_WARNING "Invalid retention policy %u with a byte budget of %lu\n", aesd_retention,
+               aesd_byte_budget);
+        unregister_chrdev_region(dev, 1);
+        return -EINVAL;
+    }
+    aesd_device.retention = aesd_retention;
+    aesd_device.byte_budget = aesd_byte_budget;
+    result = init_srcu_struct(&aesd_device.srcu);
+    if (result)
+    {
+        unregister_chrdev_region(dev, 1);
+        return result;
+    }
+    result = aesd_circular_buffer_init_capacity(&aesd_device.buffer, aesd_capacity);
+    if (result)
+    {
+        printk(KERN_WARNING "Can't keep %u write commands\n", aesd_capacity);
+        cleanup_srcu_struct(&aesd_device.srcu);
+        unregister_chrdev_region(dev, 1);
+        return result;
+    }
     aesd_device.input_buffer = NULL;
     aesd_device.input_buffer_length = 0;
     aesd_device.input_buffer_capacity = 0;
@@ -301,6 +590,8 @@ int aesd_init_module(void)
 
     if (result)
     {
+        aesd_circular_buffer_free(&aesd_device.buffer);
+        cleanup_srcu_struct(&aesd_device.srcu);
         unregister_chrdev_region(dev, 1);
     }
     return result;
@@ -308,8 +599,6 @@ int aesd_init_module(void)
 
 void aesd_cleanup_module(void)
 {
-    struct aesd_buffer_entry entry;
-    int i;
     dev_t devno = MKDEV(aesd_major, aesd_minor);
 
     cdev_del(&aesd_device.cdev);
@@ -318,20 +607,10 @@ void aesd_cleanup_module(void)
      * TODO: cleanup AESD specific poritions here as necessary
      */
 
-    // Fill the buffer up with NULL entries
-    entry.buffptr = NULL;
-    entry.size = 0;
-    for (i = 0; i < sizeof(aesd_device.buffer.entry) / sizeof(aesd_device.buffer.entry[0]); i++)
-    {
-        struct aesd_buffer_entry old_entry;
-        old_entry = aesd_circular_buffer_add_entry(&aesd_device.buffer, &entry);
-        if (old_entry.buffptr != NULL)
-        {
-            kfree(old_entry.buffptr);
-            old_entry.buffptr = NULL;
-            old_entry.size = 0;
-        }
-    }
+    // Wait for the write commands dropped by aesd_free_entries before tearing srcu down
+    aesd_free_entries(&aesd_device, &aesd_device.buffer);
+    srcu_barrier(&aesd_device.srcu);
+    cleanup_srcu_struct(&aesd_device.srcu);
 
     // Free the input buffer
     if (aesd_device.input_buffer != NULL)
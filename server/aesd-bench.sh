@@ -0,0 +1,52 @@
+#!/bin/sh
+# Sweeps aesdloadgen over connection counts, starting a fresh ./aesdsocket for each
+# one so every run begins with an empty data file, and reports the server's CPU time
+# per MB of responses. Works with either build of the server; the
+# USE_AESD_CHAR_DEVICE build needs the aesdchar driver loaded.
+#
+# Environment:
+#   BENCH_CONNECTIONS  connection counts to sweep (default: 1 8 64 512)
+#   BENCH_REQUESTS     requests per run, split across the connections (default: 4000)
+#   BENCH_SERVER_ARGS  extra aesdsocket arguments, e.g. "-m epoll -i"
+#   BENCH_LOADGEN_ARGS extra aesdloadgen arguments, e.g. "-s 64-1024 -k 10"
+#   BENCH_OUTPUT       directory for the .hgrm latency distributions (default: none)
+
+BENCH_CONNECTIONS=${BENCH_CONNECTIONS:-"1 8 64 512"}
+BENCH_REQUESTS=${BENCH_REQUESTS:-4000}
+
+cd "$(dirname "$0")" || exit 1
+
+status=0
+for connections in $BENCH_CONNECTIONS; do
+    requests=$((BENCH_REQUESTS / connections))
+    [ "$requests" -lt 4 ] && requests=4
+
+    # shellcheck disable=SC2086
+    ./aesdsocket $BENCH_SERVER_ARGS &
+    server=$!
+    # Wait for the listening socket
+    tries=0
+    until ./aesdloadgen -c 1 -n 1 -s 8 >/dev/null 2>&1; do
+        tries=$((tries + 1))
+        if [ "$tries" -gt 50 ] || ! kill -0 "$server" 2>/dev/null; then
+            echo "aesdsocket did not start" >&2
+            kill "$server" 2>/dev/null
+            exit 1
+        fi
+        sleep 0.1
+    done
+
+    output=""
+    if [ -n "$BENCH_OUTPUT" ]; then
+        mkdir -p "$BENCH_OUTPUT"
+        output="-o $BENCH_OUTPUT/connections-$connections.hgrm"
+    fi
+    echo "== $connections connections, $requests requests each"
+    # shellcheck disable=SC2086
+    ./aesdloadgen -c "$connections" -n "$requests" -P "$server" $output $BENCH_LOADGEN_ARGS || status=1
+
+    kill -TERM "$server"
+    wait "$server"
+done
+
+exit $status
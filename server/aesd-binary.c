@@ -0,0 +1,384 @@
+/**
+ * @file aesd-binary.c
+ * @brief Length-prefixed binary protocol of aesdsocket
+ *
+ * A client that opens with the magic bytes exchanges frames instead of newline
+ * terminated packets. The header gives the size of every frame, so a request is
+ * found without scanning its payload, payloads may hold newlines, and one record is
+ * appended per APPEND whatever it contains. READ answers with a byte range rather
+ * than the whole data, queued as a range of the data file or the log behind the
+ * header so nothing is copied. Bad requests get an error response and the
+ * connection carries on; only a frame too large to buffer closes it.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <syslog.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+
+#include "aesdsocket.h"
+#include "aesd-binary.h"
+#include "aesd-metrics.h"
+#include "aesd-logger.h"
+
+enum binary_protocol_e binary_detect(const char *data, size_t length)
+{
+    size_t compared = length < BINARY_MAGIC_SIZE ? length : BINARY_MAGIC_SIZE;
+    if (memcmp(data, BINARY_MAGIC, compared) != 0)
+    {
+        return BINARY_PROTOCOL_TEXT;
+    }
+    return compared == BINARY_MAGIC_SIZE ? BINARY_PROTOCOL_BINARY : BINARY_PROTOCOL_UNKNOWN;
+}
+
+int binary_start(struct send_queue_s *queue)
+{
+    queue->framed = true;
+    if (send_queue_sink(queue, BINARY_MAGIC, BINARY_MAGIC_SIZE) != 0)
+    {
+        return -1;
+    }
+    return send_queue_commit(queue, metrics_now());
+}
+
+static void binary_header(char *buffer, uint8_t opcode, uint8_t status, uint32_t length)
+{
+    struct binary_header_s header = {opcode | BINARY_OP_REPLY, status, 0, htonl(length)};
+    memcpy(buffer, &header, BINARY_HEADER_SIZE);
+}
+
+static uint64_t binary_get_u64(const char *data)
+{
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    return be64toh(value);
+}
+
+static void binary_put_u64(char *data, uint64_t value)
+{
+    value = htobe64(value);
+    memcpy(data, &value, sizeof(value));
+}
+
+/**
+ * Queues a response frame with @param length bytes of @param payload
+ * @return as send_queue_commit
+ */
+static int binary_reply(struct send_queue_s *queue, uint8_t opcode, uint8_t status, const char *payload,
+                        uint32_t length, uint64_t started)
+{
+    char header[BINARY_HEADER_SIZE];
+    binary_header(header, opcode, status, length);
+    if (send_queue_sink(queue, header, sizeof(header)) != 0 ||
+        (length > 0 && send_queue_sink(queue, payload, length) != 0))
+    {
+        send_queue_discard(queue);
+        return -1;
+    }
+    return send_queue_commit(queue, started);
+}
+
+/**
+ * Reads the end of the data file or device open on @param fd into @param length.
+ * The caller must hold the data file mutex for the device.
+ * @return 0 on success, -1 on error (already logged)
+ */
+static int binary_storage_length(int fd, off_t *length)
+{
+#ifdef USE_AESD_CHAR_DEVICE
+    // The shared position is only ever read back under the mutex, right after it is set
+    *length = lseek(fd, 0, SEEK_END);
+#else
+    struct stat st;
+    *length = fstat(fd, &st) == 0 ? st.st_size : -1;
+#endif
+    if (*length < 0)
+    {
+        logger_log(LOG_ERR, "Failed to get data length: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Reads the first retained offset and the end of the data into @param start and
+ * @param end
+ * @return an enum binary_status_e, or -1 if the connection must be closed
+ */
+static int binary_extent(int fd, pthread_mutex_t *mutex, struct segment_index_s *index, off_t *start, off_t *end)
+{
+    if (index != NULL)
+    {
+        *end = segment_index_length(index);
+        *start = segment_index_start(index);
+        *start = *start < *end ? *start : *end;
+        return BINARY_STATUS_OK;
+    }
+
+    *start = 0;
+#ifdef USE_AESD_CHAR_DEVICE
+    uint64_t locked_at;
+    if (0 != data_file_lock(mutex, &locked_at))
+    {
+        return -1;
+    }
+    int status = binary_storage_length(fd, end) == 0 ? BINARY_STATUS_OK : BINARY_STATUS_ERROR;
+    if (0 != data_file_unlock(mutex, locked_at))
+    {
+        return -1;
+    }
+    return status;
+#else
+    // Only appends follow, so no lock is needed for the length
+    return binary_storage_length(fd, end) == 0 ? BINARY_STATUS_OK : BINARY_STATUS_ERROR;
+#endif
+}
+
+/**
+ * Checks that @param offset lies in [@param start, @param end] and shortens
+ * @param length to what is there and fits a frame
+ * @return an enum binary_status_e
+ */
+static int binary_clamp(uint64_t offset, uint64_t *length, off_t start, off_t end)
+{
+    if (offset < (uint64_t)start || offset > (uint64_t)end)
+    {
+        return BINARY_STATUS_RANGE;
+    }
+    if (*length > (uint64_t)end - offset)
+    {
+        *length = end - offset;
+    }
+    if (*length > UINT32_MAX)
+    {
+        *length = UINT32_MAX;
+    }
+    return BINARY_STATUS_OK;
+}
+
+/**
+ * Appends @param size bytes of @param payload as one record and sets [@param start,
+ * @param end) to where it went. The char device still splits records at newlines,
+ * and may drop older ones.
+ * @return an enum binary_status_e, or -1 if the connection must be closed
+ */
+static int binary_append(int fd, pthread_mutex_t *mutex, struct segment_index_s *index, const char *payload,
+                         size_t size, off_t *start, off_t *end)
+{
+    if (index != NULL)
+    {
+        if (segment_index_append(index, payload, size, end) != 0 ||
+            durability_sync(index->fd, *end - size, *end) != 0)
+        {
+            return BINARY_STATUS_ERROR;
+        }
+        *start = *end - size;
+        return BINARY_STATUS_OK;
+    }
+
+    uint64_t locked_at;
+    if (0 != data_file_lock(mutex, &locked_at))
+    {
+        return -1;
+    }
+    struct iovec iov = {(void *)payload, size};
+    int ret = apply_packet_batch(fd, &iov, 1);
+    if (ret == 0)
+    {
+        ret = binary_storage_length(fd, end);
+    }
+    if (0 != data_file_unlock(mutex, locked_at))
+    {
+        return -1;
+    }
+    if (ret != 0 || durability_sync(fd, *end - size, *end) != 0)
+    {
+        return BINARY_STATUS_ERROR;
+    }
+    *start = *end >= (off_t)size ? *end - (off_t)size : 0;
+    return BINARY_STATUS_OK;
+}
+
+/**
+ * Sets @param offset to byte @param write_cmd_offset of record @param write_cmd
+ * @return an enum binary_status_e, or -1 if the connection must be closed
+ */
+static int binary_seek(int fd, pthread_mutex_t *mutex, struct segment_index_s *index, uint32_t write_cmd,
+                       uint32_t write_cmd_offset, off_t *offset)
+{
+    if (index != NULL)
+    {
+        return segment_index_seek(index, write_cmd, write_cmd_offset, offset) == 0 ? BINARY_STATUS_OK
+                                                                                   : BINARY_STATUS_RANGE;
+    }
+#ifdef USE_AESD_CHAR_DEVICE
+    struct aesd_seekto seekto = {write_cmd, write_cmd_offset};
+    uint64_t locked_at;
+    if (0 != data_file_lock(mutex, &locked_at))
+    {
+        return -1;
+    }
+    int status = BINARY_STATUS_OK;
+    if (ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto) < 0)
+    {
+        status = errno == EINVAL ? BINARY_STATUS_RANGE : BINARY_STATUS_ERROR;
+    }
+    else if ((*offset = lseek(fd, 0, SEEK_CUR)) < 0)
+    {
+        logger_log(LOG_ERR, "Failed to get file position: %s", strerror(errno));
+        status = BINARY_STATUS_ERROR;
+    }
+    if (0 != data_file_unlock(mutex, locked_at))
+    {
+        return -1;
+    }
+    return status;
+#else
+    // Record boundaries are only known to the index
+    return BINARY_STATUS_UNSUPPORTED;
+#endif
+}
+
+/**
+ * Queues the response to a READ of @param length bytes from @param offset: a range
+ * of the data file or log behind its header, or a copy of the char device
+ * @return 0 once the response is queued, an enum binary_status_e for an error
+ * response, or -1 if the connection must be closed
+ */
+static int binary_read(int fd, pthread_mutex_t *mutex, struct segment_index_s *index, struct send_queue_s *queue,
+                       uint64_t offset, uint64_t length, uint64_t started)
+{
+    char header[BINARY_HEADER_SIZE];
+    off_t end;
+
+#ifdef USE_AESD_CHAR_DEVICE
+    // The driver drops its oldest writes, so the range is copied while it is there
+    uint64_t locked_at;
+    if (0 != data_file_lock(mutex, &locked_at))
+    {
+        return -1;
+    }
+    int ret = binary_storage_length(fd, &end) == 0 ? binary_clamp(offset, &length, 0, end) : BINARY_STATUS_ERROR;
+    if (ret == 0)
+    {
+        binary_header(header, BINARY_OP_READ, BINARY_STATUS_OK, length);
+        if (send_queue_sink(queue, header, sizeof(header)) != 0 ||
+            replay_file(fd, offset, offset + length, send_queue_sink, queue) != 0 ||
+            queue->open->end != (off_t)(BINARY_HEADER_SIZE + length))
+        {
+            ret = BINARY_STATUS_ERROR;
+        }
+    }
+    if (0 != data_file_unlock(mutex, locked_at))
+    {
+        ret = -1;
+    }
+    if (ret != 0)
+    {
+        send_queue_discard(queue);
+        return ret;
+    }
+    return send_queue_commit(queue, started);
+#else
+    off_t start;
+    int status = binary_extent(fd, mutex, index, &start, &end);
+    if (status == BINARY_STATUS_OK)
+    {
+        status = binary_clamp(offset, &length, start, end);
+    }
+    if (status != BINARY_STATUS_OK)
+    {
+        return status;
+    }
+    binary_header(header, BINARY_OP_READ, BINARY_STATUS_OK, length);
+    int ret = send_queue_framed_range(queue, index, fd, offset, offset + length, header, sizeof(header), started);
+    return ret > 0 ? BINARY_STATUS_RANGE : ret;
+#endif
+}
+
+ssize_t binary_handle_frame(int fd, pthread_mutex_t *mutex, struct segment_index_s *index,
+                            struct send_queue_s *queue, const char *data, size_t length)
+{
+    struct binary_header_s header;
+    if (length < BINARY_HEADER_SIZE)
+    {
+        return 0;
+    }
+    memcpy(&header, data, BINARY_HEADER_SIZE);
+    size_t size = ntohl(header.length);
+    if (size > BINARY_FRAME_MAX)
+    {
+        logger_log(LOG_ERR, "Frame of %zu bytes exceeds the limit of %d", size, BINARY_FRAME_MAX);
+        return -1;
+    }
+    if (length - BINARY_HEADER_SIZE < size)
+    {
+        return 0;
+    }
+
+    uint64_t started = metrics_now();
+    const char *payload = data + BINARY_HEADER_SIZE;
+    char reply[16];
+    uint32_t reply_length = 0;
+    off_t start, end;
+    int status;
+    metrics_add(METRICS_PACKETS, 1);
+
+    switch (header.opcode)
+    {
+    case BINARY_OP_APPEND:
+        status = size == 0 ? BINARY_STATUS_INVALID : binary_append(fd, mutex, index, payload, size, &start, &end);
+        if (status == BINARY_STATUS_OK)
+        {
+            binary_put_u64(reply, start);
+            binary_put_u64(reply + 8, end);
+            reply_length = 16;
+        }
+        break;
+    case BINARY_OP_SEEK:
+        status = BINARY_STATUS_INVALID;
+        if (size == 8)
+        {
+            uint32_t seekto[2];
+            memcpy(seekto, payload, sizeof(seekto));
+            status = binary_seek(fd, mutex, index, ntohl(seekto[0]), ntohl(seekto[1]), &start);
+        }
+        if (status == BINARY_STATUS_OK)
+        {
+            binary_put_u64(reply, start);
+            reply_length = 8;
+        }
+        break;
+    case BINARY_OP_READ:
+        status = size != 16 ? BINARY_STATUS_INVALID
+                            : binary_read(fd, mutex, index, queue, binary_get_u64(payload), binary_get_u64(payload + 8),
+                                          started);
+        if (status == 0)
+        {
+            return BINARY_HEADER_SIZE + size;
+        }
+        break;
+    case BINARY_OP_STATS:
+        status = size != 0 ? BINARY_STATUS_INVALID : binary_extent(fd, mutex, index, &start, &end);
+        if (status == BINARY_STATUS_OK)
+        {
+            binary_put_u64(reply, start);
+            binary_put_u64(reply + 8, end);
+            reply_length = 16;
+        }
+        break;
+    default:
+        status = BINARY_STATUS_INVALID;
+        break;
+    }
+
+    if (status < 0 || binary_reply(queue, header.opcode, status, reply, reply_length, started) != 0)
+    {
+        return -1;
+    }
+    return BINARY_HEADER_SIZE + size;
+}
@@ -0,0 +1,128 @@
+/*
+ * aesd-binary.h
+ *
+ *  Length-prefixed binary protocol of aesdsocket, chosen per connection by magic
+ *  bytes and served next to the newline protocol
+ */
+
+#ifndef AESD_BINARY_H
+#define AESD_BINARY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "aesd-index.h"
+#include "aesd-sendqueue.h"
+
+/**
+ * Sent by a client as its first bytes and echoed by the server once it has switched.
+ * No text packet starts with a NUL byte.
+ */
+#define BINARY_MAGIC "\0AB1"
+#define BINARY_MAGIC_SIZE 4
+#define BINARY_HEADER_SIZE 8
+// Largest payload accepted in a request frame
+#define BINARY_FRAME_MAX (16 * 1024 * 1024)
+
+/**
+ * Request opcodes. A response carries the opcode of its request with BINARY_OP_REPLY
+ * set, and comes in the order of the requests.
+ */
+enum binary_opcode_e
+{
+    /**
+     * Payload: the bytes to append as one record, newlines included.
+     * Reply: u64 start and u64 end offset of the record.
+     */
+    BINARY_OP_APPEND = 1,
+    /**
+     * Payload: u32 write_cmd and u32 write_cmd_offset, as struct aesd_seekto.
+     * Reply: u64 offset of that byte.
+     */
+    BINARY_OP_SEEK = 2,
+    /**
+     * Payload: u64 offset and u64 length.
+     * Reply: the stored bytes from offset, at most length of them.
+     */
+    BINARY_OP_READ = 3,
+    /**
+     * Empty payload.
+     * Reply: u64 offset of the first retained byte and u64 end of the data.
+     */
+    BINARY_OP_STATS = 4,
+    BINARY_OP_REPLY = 0x80,
+};
+
+enum binary_status_e
+{
+    BINARY_STATUS_OK = 0,
+    /**
+     * Unknown opcode or payload of the wrong size
+     */
+    BINARY_STATUS_INVALID = 1,
+    /**
+     * The record, byte or offset does not exist, or is no longer retained
+     */
+    BINARY_STATUS_RANGE = 2,
+    /**
+     * The storage cannot serve the request, seeking the data file without an index
+     */
+    BINARY_STATUS_UNSUPPORTED = 3,
+    /**
+     * The storage failed, the request may or may not have been applied
+     */
+    BINARY_STATUS_ERROR = 4,
+};
+
+/**
+ * Header of every frame, followed by length payload bytes. Integers in frames are
+ * in network byte order.
+ */
+struct binary_header_s
+{
+    uint8_t opcode;
+    /**
+     * enum binary_status_e in responses, 0 in requests
+     */
+    uint8_t status;
+    uint16_t reserved;
+    uint32_t length;
+};
+
+/**
+ * Protocol of a connection, known from its first bytes
+ */
+enum binary_protocol_e
+{
+    BINARY_PROTOCOL_UNKNOWN,
+    BINARY_PROTOCOL_TEXT,
+    BINARY_PROTOCOL_BINARY,
+};
+
+/**
+ * @return the protocol of a connection whose first received bytes are the
+ * @param length bytes at @param data, BINARY_PROTOCOL_UNKNOWN until enough arrived
+ */
+enum binary_protocol_e binary_detect(const char *data, size_t length);
+
+/**
+ * Switches the connection of @param queue to frames and queues the magic echo. The
+ * caller consumes the BINARY_MAGIC_SIZE bytes of the magic.
+ * @return as send_queue_commit
+ */
+int binary_start(struct send_queue_s *queue);
+
+/**
+ * Handles the request frame at the start of the @param length bytes at @param data
+ * once all of it has arrived, against the data file or device open on @param fd and
+ * guarded by @param mutex, or against @param index when set, and queues the response
+ * frame on @param queue
+ * @return the size of the frame once handled, 0 while it is incomplete, -1 if the
+ * connection must be closed (already logged)
+ */
+ssize_t binary_handle_frame(int fd, pthread_mutex_t *mutex, struct segment_index_s *index,
+                            struct send_queue_s *queue, const char *data, size_t length);
+
+#endif /* AESD_BINARY_H */
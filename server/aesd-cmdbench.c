@@ -0,0 +1,105 @@
+/**
+ * @file aesd-cmdbench.c
+ * @brief Microbenchmark of command packet recognition
+ *
+ * Runs a data packet, a data packet that starts like a command and a seek command
+ * through the sscanf check every packet used to pay for and through command_parse.
+ * Reports ns per packet for both and checks that they agree on what each packet is.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "aesd-command.h"
+
+#define CMDBENCH_DEFAULT_ITERATIONS 5000000
+
+static volatile unsigned int cmdbench_sink;
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Recognizes a seek command the way connection_thread did before the command table,
+ * copying the packet to terminate it and running sscanf over it
+ * @return true if @param packet is a seek command, with its arguments in @param seekto
+ */
+static bool cmdbench_sscanf(const char *packet, size_t packet_size, struct aesd_seekto *seekto)
+{
+    char command[64];
+    unsigned int write_cmd, write_cmd_offset;
+
+    if (packet_size >= sizeof(command))
+    {
+        return false;
+    }
+    memcpy(command, packet, packet_size);
+    command[packet_size] = '\0';
+    if (sscanf(command, "AESDCHAR_IOCSEEKTO:%u,%u", &write_cmd, &write_cmd_offset) != 2)
+    {
+        return false;
+    }
+    seekto->write_cmd = write_cmd;
+    seekto->write_cmd_offset = write_cmd_offset;
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct
+    {
+        const char *name;
+        const char *packet;
+    } cases[] = {
+        {"data packet", "The quick brown fox jumps over the lazy dog, sixty-odd bytes..\n"},
+        {"data with command prefix", "AESDCHAR is the name of the driver\n"},
+        {"seek command", "AESDCHAR_IOCSEEKTO:12,345\n"},
+    };
+    long iterations = argc > 1 ? atol(argv[1]) : CMDBENCH_DEFAULT_ITERATIONS;
+    if (argc > 2 || iterations <= 0)
+    {
+        fprintf(stderr, "Usage: %s [packets per case, default %d]\n", argv[0], CMDBENCH_DEFAULT_ITERATIONS);
+        return 2;
+    }
+
+    int status = 0;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        const char *packet = cases[i].packet;
+        size_t packet_size = strlen(packet);
+        struct aesd_seekto seekto = {0};
+        struct command_s command;
+
+        double start = now_seconds();
+        for (long n = 0; n < iterations; n++)
+        {
+            cmdbench_sink += cmdbench_sscanf(packet, packet_size, &seekto);
+        }
+        double middle = now_seconds();
+        for (long n = 0; n < iterations; n++)
+        {
+            cmdbench_sink += command_parse(packet, packet_size, &command);
+        }
+        double end = now_seconds();
+
+        printf("%-26s sscanf %7.1f ns/packet, command_parse %7.1f ns/packet\n", cases[i].name,
+               (middle - start) / iterations * 1e9, (end - middle) / iterations * 1e9);
+
+        bool is_seek = cmdbench_sscanf(packet, packet_size, &seekto);
+        if (is_seek != (command_parse(packet, packet_size, &command) == COMMAND_SEEKTO) ||
+            (is_seek && (seekto.write_cmd != command.seekto.write_cmd ||
+                         seekto.write_cmd_offset != command.seekto.write_cmd_offset)))
+        {
+            fprintf(stderr, "Parsers disagree on the %s\n", cases[i].name);
+            status = 1;
+        }
+    }
+    return status;
+}
@@ -0,0 +1,52 @@
+/*
+ * aesd-command.h
+ *
+ *  Recognition of command packets for aesdsocket: a prefix check that rejects data
+ *  packets with a single comparison, and a table of verbs with their argument parsers
+ */
+
+#ifndef AESD_COMMAND_H
+#define AESD_COMMAND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../aesd-char-driver/aesd_ioctl.h"
+
+/**
+ * Every command packet starts with this, compared as one 8 byte word
+ */
+#define COMMAND_PREFIX "AESDCHAR"
+#define COMMAND_PREFIX_SIZE 8
+
+enum command_verb_e
+{
+    /**
+     * Not a command, the packet is data to append
+     */
+    COMMAND_NONE,
+    /**
+     * AESDCHAR_IOCSEEKTO:write_cmd,write_cmd_offset
+     */
+    COMMAND_SEEKTO,
+};
+
+struct command_s
+{
+    enum command_verb_e verb;
+    union
+    {
+        struct aesd_seekto seekto;
+    };
+};
+
+/**
+ * Recognizes the command in the @param packet_size bytes at @param packet, which
+ * need not be NUL terminated, and fills in @param command. A packet that looks like
+ * a command but does not parse, including numbers that do not fit 32 bits or
+ * anything but the newline after the arguments, is data.
+ * @return the verb of the command, COMMAND_NONE for data
+ */
+enum command_verb_e command_parse(const char *packet, size_t packet_size, struct command_s *command);
+
+#endif /* AESD_COMMAND_H */
@@ -0,0 +1,156 @@
+/**
+ * @file aesd-control.c
+ * @brief Signal and shutdown handling for aesdsocket without periodic wakeups
+ *
+ * Every thread used to wake every 1.1 s from a select(), epoll_wait() or timed
+ * condition wait just to check exit_flag. Instead each blocking wait includes the
+ * shutdown eventfd, which is written once and never read, so it wakes every
+ * waiter at once and an idle server does not wake at all. Signals are blocked and
+ * read from a signalfd by the main thread, which then starts the shutdown.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+
+#include "aesdsocket.h"
+#include "aesd-control.h"
+#include "aesd-logger.h"
+
+static int control_signal_fd = -1;
+static int control_event_fd = -1;
+
+int control_init(void)
+{
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+
+    int ret = pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    if (ret != 0)
+    {
+        logger_log(LOG_ERR, "Failed to block signals: %s", strerror(ret));
+        return -1;
+    }
+    // A client closing early shows up as EPIPE from send() instead
+    signal(SIGPIPE, SIG_IGN);
+
+    control_signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+    if (control_signal_fd == -1)
+    {
+        logger_log(LOG_ERR, "Failed to create signalfd: %s", strerror(errno));
+        return -1;
+    }
+    control_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (control_event_fd == -1)
+    {
+        logger_log(LOG_ERR, "Failed to create shutdown eventfd: %s", strerror(errno));
+        close(control_signal_fd);
+        control_signal_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int control_shutdown_fd(void)
+{
+    return control_event_fd;
+}
+
+void control_shutdown(void)
+{
+    exit_flag = true;
+    uint64_t one = 1;
+    if (write(control_event_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+    {
+        logger_log(LOG_ERR, "Failed to signal shutdown: %s", strerror(errno));
+    }
+}
+
+void control_wait(void)
+{
+    struct pollfd fds[2] = {
+        {control_signal_fd, POLLIN, 0},
+        {control_event_fd, POLLIN, 0},
+    };
+
+    while (!exit_flag)
+    {
+        if (poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            logger_log(LOG_ERR, "Failed to wait for signals: %s", strerror(errno));
+            break;
+        }
+        if (fds[0].revents & POLLIN)
+        {
+            struct signalfd_siginfo info;
+            if (read(control_signal_fd, &info, sizeof(info)) == sizeof(info))
+            {
+                logger_log(LOG_INFO, "Caught signal, exiting");
+                break;
+            }
+        }
+        if (fds[1].revents & POLLIN)
+        {
+            break;
+        }
+    }
+    control_shutdown();
+}
+
+int control_wait_readable(int fd)
+{
+    struct pollfd fds[2] = {
+        {fd, POLLIN, 0},
+        {control_event_fd, POLLIN, 0},
+    };
+
+    while (!exit_flag)
+    {
+        if (poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            logger_log(LOG_ERR, "poll() failed: %s", strerror(errno));
+            return -1;
+        }
+        if (fds[1].revents & POLLIN)
+        {
+            break;
+        }
+        if (fds[0].revents != 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void control_destroy(void)
+{
+    if (control_signal_fd != -1)
+    {
+        close(control_signal_fd);
+        control_signal_fd = -1;
+    }
+    if (control_event_fd != -1)
+    {
+        close(control_event_fd);
+        control_event_fd = -1;
+    }
+}
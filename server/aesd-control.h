@@ -0,0 +1,48 @@
+/*
+ * aesd-control.h
+ *
+ *  Event driven shutdown for aesdsocket: SIGINT and SIGTERM arrive through a
+ *  signalfd, and an eventfd that becomes readable at shutdown wakes every thread
+ *  blocked waiting for work
+ */
+
+#ifndef AESD_CONTROL_H
+#define AESD_CONTROL_H
+
+/**
+ * Blocks SIGINT and SIGTERM for the calling thread and every thread it starts
+ * afterwards, so they are only received through control_wait, and creates the
+ * shutdown eventfd. Must be called before any other thread is started.
+ * @return 0 on success, -1 on error (already logged)
+ */
+int control_init(void);
+
+/**
+ * @return the eventfd that becomes readable, and stays readable, once shutdown
+ * has started, for waits that cannot use control_wait_readable such as epoll
+ */
+int control_shutdown_fd(void);
+
+/**
+ * Sleeps until SIGINT or SIGTERM arrives or control_shutdown is called, then
+ * starts shutdown
+ */
+void control_wait(void);
+
+/**
+ * Sets exit_flag and wakes every thread waiting on the shutdown eventfd
+ */
+void control_shutdown(void);
+
+/**
+ * Waits without a timeout until @param fd is readable or shutdown starts
+ * @return 1 if @param fd is readable, 0 on shutdown, -1 on error (already logged)
+ */
+int control_wait_readable(int fd);
+
+/**
+ * Closes the signalfd and the shutdown eventfd once every thread has exited
+ */
+void control_destroy(void);
+
+#endif /* AESD_CONTROL_H */
@@ -0,0 +1,403 @@
+/**
+ * @file aesd-durability.c
+ * @brief Durable acknowledgements for aesdsocket, per packet or by group commit
+ *
+ * In group mode every responder takes a ticket after its write and sleeps until the
+ * flusher has synced past it. The flusher waits for the first write of a group,
+ * lets more writes join it until the interval passes or enough bytes are pending,
+ * then makes a single fdatasync, or msync of the new log range, and wakes every
+ * responder of the group together. Once a sync fails nothing is acknowledged any
+ * more, as the kernel may already have dropped the unwritten pages.
+ *
+ * An event loop thread cannot sleep in a responder. It defers the wait instead,
+ * keeps the ticket with the queued response and learns about every sync from an
+ * eventfd it watches.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "aesd-durability.h"
+#include "aesd-metrics.h"
+#include "aesd-logger.h"
+
+static enum durability_mode_e durability_mode = DURABILITY_NONE;
+static struct segment_index_s *durability_index;
+/**
+ * Shared data file, the flusher holds a reference to the descriptor it synced last.
+ * Neither is used with an index.
+ */
+static struct storage_s *durability_storage;
+static struct storage_file_s *durability_file;
+static uint64_t durability_interval_ns;
+static size_t durability_bytes;
+
+static pthread_t durability_flusher_thread;
+static pthread_mutex_t durability_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t durability_written_cond;
+static pthread_cond_t durability_synced_cond = PTHREAD_COND_INITIALIZER;
+/**
+ * Tickets handed out to responders and synced so far, guarded by durability_mutex
+ */
+static uint64_t durability_written;
+static uint64_t durability_synced;
+/**
+ * Bytes written since the last sync and metrics_now() of the first of them
+ */
+static size_t durability_pending_bytes;
+static uint64_t durability_pending_since;
+/**
+ * Log offset synced up to
+ */
+static off_t durability_synced_offset;
+static bool durability_failed;
+static bool durability_stopping;
+/**
+ * Eventfds written after every sync, guarded by durability_mutex
+ */
+static int *durability_watchers;
+static size_t durability_watcher_count;
+
+/**
+ * Set between durability_defer_begin and durability_defer_end, with the last ticket
+ * taken meanwhile
+ */
+static __thread bool durability_deferring;
+static __thread uint64_t durability_deferred_ticket;
+
+int durability_parse_mode(const char *name, enum durability_mode_e *mode)
+{
+    if (strcmp(name, "none") == 0)
+    {
+        *mode = DURABILITY_NONE;
+    }
+    else if (strcmp(name, "packet") == 0)
+    {
+        *mode = DURABILITY_PACKET;
+    }
+    else if (strcmp(name, "group") == 0)
+    {
+        *mode = DURABILITY_GROUP;
+    }
+    else
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Syncs [@param start, @param end) of the log, or skips what retention has dropped
+ * @return 0 on success, -1 on error (already logged)
+ */
+static int durability_sync_log(off_t start, off_t end)
+{
+    segment_index_pin(durability_index, &start, end);
+    int ret = segment_log_sync(durability_index->log, start, end);
+    segment_index_unpin(durability_index, start, end);
+    return ret;
+}
+
+/**
+ * Syncs the data file open on @param fd
+ * @return 0 on success, -1 on error (already logged)
+ */
+static int durability_sync_file(int fd)
+{
+    if (fdatasync(fd) == -1)
+    {
+        logger_log(LOG_ERR, "Failed to sync data file: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Syncs the shared data file. Writes of the group may have gone to the descriptor
+ * synced last or, when the path was rotated since, to the current one, so both are
+ * synced then and the flusher moves on to the current one.
+ * @return 0 on success, -1 on error (already logged)
+ */
+static int durability_sync_storage(void)
+{
+    struct storage_file_s *current = storage_acquire(durability_storage);
+    int ret = durability_sync_file(durability_file->fd);
+    if (current != durability_file)
+    {
+        storage_release(durability_storage, durability_file);
+        durability_file = current;
+        if (ret == 0)
+        {
+            ret = durability_sync_file(current->fd);
+        }
+    }
+    else
+    {
+        storage_release(durability_storage, current);
+    }
+    return ret;
+}
+
+/**
+ * Wakes every watcher to check its tickets.
+ * The caller must hold durability_mutex.
+ */
+static void durability_notify(void)
+{
+    uint64_t one = 1;
+    for (size_t i = 0; i < durability_watcher_count; i++)
+    {
+        if (write(durability_watchers[i], &one, sizeof(one)) == -1 && errno != EAGAIN)
+        {
+            logger_log(LOG_ERR, "Failed to notify durability watcher: %s", strerror(errno));
+        }
+    }
+}
+
+/**
+ * Flusher thread of the group mode, runs until durability_stop once nothing is pending
+ */
+static void *durability_flusher(void *arg)
+{
+    pthread_mutex_lock(&durability_mutex);
+    while (!durability_failed)
+    {
+        while (!durability_stopping && durability_written == durability_synced)
+        {
+            pthread_cond_wait(&durability_written_cond, &durability_mutex);
+        }
+        if (durability_written == durability_synced)
+        {
+            break;
+        }
+
+        // Let the writes of other connections join the group
+        uint64_t deadline_ns = durability_pending_since + durability_interval_ns;
+        struct timespec deadline = {deadline_ns / 1000000000ULL, deadline_ns % 1000000000ULL};
+        while (!durability_stopping && durability_pending_bytes < durability_bytes &&
+               pthread_cond_timedwait(&durability_written_cond, &durability_mutex, &deadline) != ETIMEDOUT)
+        {
+        }
+
+        // Every write with a ticket up to target has finished, so it lies below the
+        // committed log length read after it
+        uint64_t target = durability_written;
+        durability_pending_bytes = 0;
+        pthread_mutex_unlock(&durability_mutex);
+
+        int ret;
+        if (durability_index != NULL && durability_index->log != NULL)
+        {
+            off_t end = segment_index_length(durability_index);
+            ret = durability_sync_log(durability_synced_offset, end);
+            durability_synced_offset = end;
+        }
+        else if (durability_index != NULL)
+        {
+            ret = durability_sync_file(durability_index->fd);
+        }
+        else
+        {
+            ret = durability_sync_storage();
+        }
+        metrics_add(METRICS_SYNCS, 1);
+
+        pthread_mutex_lock(&durability_mutex);
+        if (ret == 0)
+        {
+            durability_synced = target;
+        }
+        else
+        {
+            durability_failed = true;
+        }
+        pthread_cond_broadcast(&durability_synced_cond);
+        durability_notify();
+    }
+    pthread_mutex_unlock(&durability_mutex);
+    return NULL;
+}
+
+int durability_start(enum durability_mode_e mode, struct storage_s *storage, struct segment_index_s *index,
+                     unsigned int interval_us, size_t bytes)
+{
+    durability_mode = mode;
+    durability_index = index;
+    durability_storage = storage;
+    durability_interval_ns = (uint64_t)interval_us * 1000;
+    durability_bytes = bytes;
+    if (mode != DURABILITY_GROUP)
+    {
+        return 0;
+    }
+
+    if (index == NULL)
+    {
+        durability_file = storage_acquire(storage);
+    }
+    // The deadline is in metrics_now() time
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&durability_written_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (0 != pthread_create(&durability_flusher_thread, 0, durability_flusher, NULL))
+    {
+        logger_log(LOG_ERR, "Failed to create flusher thread");
+        if (durability_file != NULL)
+        {
+            storage_release(storage, durability_file);
+            durability_file = NULL;
+        }
+        pthread_cond_destroy(&durability_written_cond);
+        durability_mode = DURABILITY_NONE;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Waits until the flusher has synced @param size bytes just written, or only takes
+ * the ticket for them while deferring
+ * @return 0 on success, -1 if a sync failed
+ */
+static int durability_group_wait(size_t size)
+{
+    pthread_mutex_lock(&durability_mutex);
+    if (durability_pending_bytes == 0)
+    {
+        durability_pending_since = metrics_now();
+    }
+    durability_pending_bytes += size;
+    uint64_t ticket = ++durability_written;
+    // Wake the flusher for a new group, or early for a full one
+    if (durability_pending_bytes == size || durability_pending_bytes >= durability_bytes)
+    {
+        pthread_cond_signal(&durability_written_cond);
+    }
+    if (durability_deferring)
+    {
+        durability_deferred_ticket = ticket;
+        int ret = durability_failed ? -1 : 0;
+        pthread_mutex_unlock(&durability_mutex);
+        return ret;
+    }
+    while (!durability_failed && durability_synced < ticket)
+    {
+        pthread_cond_wait(&durability_synced_cond, &durability_mutex);
+    }
+    int ret = durability_synced >= ticket ? 0 : -1;
+    pthread_mutex_unlock(&durability_mutex);
+    return ret;
+}
+
+int durability_sync(int fd, off_t start, off_t end)
+{
+    if (durability_mode == DURABILITY_NONE || start >= end)
+    {
+        return 0;
+    }
+
+    uint64_t started = metrics_now();
+    int ret;
+    if (durability_mode == DURABILITY_GROUP)
+    {
+        ret = durability_group_wait(end - start);
+    }
+    else
+    {
+        ret = fd < 0 ? durability_sync_log(start, end) : durability_sync_file(fd);
+        metrics_add(METRICS_SYNCS, 1);
+    }
+    metrics_observe(METRICS_SYNC_WAIT, metrics_now() - started);
+    return ret;
+}
+
+void durability_defer_begin(void)
+{
+    durability_deferring = true;
+    durability_deferred_ticket = 0;
+}
+
+uint64_t durability_defer_end(void)
+{
+    durability_deferring = false;
+    return durability_deferred_ticket;
+}
+
+int durability_ticket_synced(uint64_t ticket)
+{
+    pthread_mutex_lock(&durability_mutex);
+    int ret = durability_synced >= ticket ? 1 : durability_failed ? -1 : 0;
+    pthread_mutex_unlock(&durability_mutex);
+    return ret;
+}
+
+int durability_watch(int event_fd)
+{
+    pthread_mutex_lock(&durability_mutex);
+    int *watchers = realloc(durability_watchers, (durability_watcher_count + 1) * sizeof(int));
+    if (watchers == NULL)
+    {
+        pthread_mutex_unlock(&durability_mutex);
+        logger_log(LOG_ERR, "Failed to allocate memory for durability watcher");
+        return -1;
+    }
+    durability_watchers = watchers;
+    durability_watchers[durability_watcher_count++] = event_fd;
+    pthread_mutex_unlock(&durability_mutex);
+    return 0;
+}
+
+void durability_unwatch(int event_fd)
+{
+    pthread_mutex_lock(&durability_mutex);
+    for (size_t i = 0; i < durability_watcher_count; i++)
+    {
+        if (durability_watchers[i] == event_fd)
+        {
+            durability_watchers[i] = durability_watchers[--durability_watcher_count];
+            break;
+        }
+    }
+    if (durability_watcher_count == 0)
+    {
+        free(durability_watchers);
+        durability_watchers = NULL;
+    }
+    pthread_mutex_unlock(&durability_mutex);
+}
+
+bool durability_enabled(void)
+{
+    return durability_mode != DURABILITY_NONE;
+}
+
+void durability_stop(void)
+{
+    if (durability_mode != DURABILITY_GROUP)
+    {
+        return;
+    }
+    pthread_mutex_lock(&durability_mutex);
+    durability_stopping = true;
+    pthread_cond_signal(&durability_written_cond);
+    pthread_mutex_unlock(&durability_mutex);
+    pthread_join(durability_flusher_thread, NULL);
+
+    if (durability_file != NULL)
+    {
+        storage_release(durability_storage, durability_file);
+        durability_file = NULL;
+    }
+    pthread_cond_destroy(&durability_written_cond);
+    durability_mode = DURABILITY_NONE;
+}
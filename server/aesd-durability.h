@@ -0,0 +1,108 @@
+/*
+ * aesd-durability.h
+ *
+ *  Durable acknowledgements for aesdsocket: a response is only queued once its
+ *  packet has reached stable storage, synced per packet or in groups by a flusher
+ *  thread
+ */
+
+#ifndef AESD_DURABILITY_H
+#define AESD_DURABILITY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "aesd-index.h"
+#include "aesd-storage.h"
+
+#define DURABILITY_DEFAULT_INTERVAL_US 1000
+#define DURABILITY_DEFAULT_BYTES (256 * 1024)
+
+/**
+ * When a packet is durable, selected with -D on the command line
+ */
+enum durability_mode_e
+{
+    /**
+     * Leave the data to the page cache
+     */
+    DURABILITY_NONE,
+    /**
+     * Sync every packet before its response
+     */
+    DURABILITY_PACKET,
+    /**
+     * Responders wait for the flusher thread, which syncs the writes of every
+     * connection at once and then releases all of them together
+     */
+    DURABILITY_GROUP,
+};
+
+/**
+ * Parses a mode name: none, packet or group
+ * @return 0 on success, -1 if @param name is not a mode
+ */
+int durability_parse_mode(const char *name, enum durability_mode_e *mode);
+
+/**
+ * Selects @param mode for the data file shared through @param storage, or for the
+ * data file or log of @param index when there is one. DURABILITY_GROUP starts the
+ * flusher, which syncs once @param interval_us have passed since the oldest unsynced
+ * write or once @param bytes are unsynced, whichever comes first.
+ * @return 0 on success, -1 on error (already logged)
+ */
+int durability_start(enum durability_mode_e mode, struct storage_s *storage, struct segment_index_s *index,
+                     unsigned int interval_us, size_t bytes);
+
+/**
+ * Returns once bytes [@param start, @param end) just written to the data file open
+ * on @param fd, or appended to the log, are durable, or once their ticket is taken
+ * while deferring
+ * @return 0 on success, -1 if they could not be synced (already logged)
+ */
+int durability_sync(int fd, off_t start, off_t end);
+
+/**
+ * Makes durability_sync on the calling thread take a ticket for the group commit and
+ * return without waiting, until durability_defer_end. Has no effect outside
+ * DURABILITY_GROUP. An event loop queues the response meanwhile and holds it back
+ * until durability_ticket_synced.
+ */
+void durability_defer_begin(void);
+
+/**
+ * @return the last ticket taken since durability_defer_begin, 0 if none
+ */
+uint64_t durability_defer_end(void);
+
+/**
+ * @return 1 once the writes of @param ticket are durable, 0 while they are not yet
+ * and -1 if they never will be
+ */
+int durability_ticket_synced(uint64_t ticket);
+
+/**
+ * Has the flusher write to the eventfd @param event_fd after every sync, so an
+ * event loop learns when to check its tickets again
+ * @return 0 on success, -1 on error (already logged)
+ */
+int durability_watch(int event_fd);
+
+/**
+ * Stops the writes to @param event_fd
+ */
+void durability_unwatch(int event_fd);
+
+/**
+ * @return true unless the mode is DURABILITY_NONE
+ */
+bool durability_enabled(void);
+
+/**
+ * Syncs anything still pending and stops the flusher once every connection is closed
+ */
+void durability_stop(void);
+
+#endif /* AESD_DURABILITY_H */
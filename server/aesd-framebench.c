@@ -0,0 +1,161 @@
+/**
+ * @file aesd-framebench.c
+ * @brief Microbenchmark of newline packet framing
+ *
+ * Feeds a stream of equally sized packets, from 16 B to 1 MB, through the framing
+ * connection_thread used before the packet ring, memchr for the newline and memmove
+ * of the rest of a doubling receive buffer after every packet, and through
+ * packet_ring_s, in receives of the same size. Reports MB/s for both and checks
+ * that they find the same number of packets.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+
+#include "aesdsocket.h"
+#include "aesd-framing.h"
+
+#define FRAMEBENCH_DEFAULT_MB 64
+#define FRAMEBENCH_RECV_SIZE (64 * 1024)
+#define FRAMEBENCH_MIN_PACKET 16
+#define FRAMEBENCH_MAX_PACKET (1024 * 1024)
+
+// The framing layer links against the server's control module
+volatile sig_atomic_t exit_flag = false;
+
+static volatile size_t framebench_sink;
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Frames @param length bytes of @param stream the way connection_thread did before
+ * the packet ring
+ * @return the number of packets found
+ */
+static size_t framebench_memmove(const char *stream, size_t length)
+{
+    size_t capacity = BUFFER_SIZE;
+    char *buffer = malloc(capacity);
+    size_t buffered = 0;
+    size_t packets = 0;
+
+    for (size_t offset = 0; buffer != NULL && offset < length;)
+    {
+        if (buffered == capacity)
+        {
+            char *new_buffer = realloc(buffer, capacity * 2);
+            if (new_buffer == NULL)
+            {
+                break;
+            }
+            buffer = new_buffer;
+            capacity *= 2;
+        }
+        size_t count = capacity - buffered;
+        count = count < FRAMEBENCH_RECV_SIZE ? count : FRAMEBENCH_RECV_SIZE;
+        count = count < length - offset ? count : length - offset;
+        memcpy(buffer + buffered, stream + offset, count);
+        offset += count;
+        buffered += count;
+
+        char *end_of_packet;
+        while ((end_of_packet = memchr(buffer, '\n', buffered)) != NULL)
+        {
+            size_t packet_size = end_of_packet - buffer + 1;
+            framebench_sink += buffer[0];
+            packets++;
+            memmove(buffer, buffer + packet_size, buffered - packet_size);
+            buffered -= packet_size;
+        }
+    }
+    free(buffer);
+    return packets;
+}
+
+/**
+ * Frames @param length bytes of @param stream through a packet ring
+ * @return the number of packets found
+ */
+static size_t framebench_ring(const char *stream, size_t length)
+{
+    struct packet_ring_s ring;
+    size_t packets = 0;
+
+    if (packet_ring_init(&ring, BUFFER_SIZE) != 0)
+    {
+        return 0;
+    }
+    for (size_t offset = 0; offset < length;)
+    {
+        size_t space;
+        char *write_space = packet_ring_write_space(&ring, &space);
+        if (write_space == NULL)
+        {
+            break;
+        }
+        size_t count = space < FRAMEBENCH_RECV_SIZE ? space : FRAMEBENCH_RECV_SIZE;
+        count = count < length - offset ? count : length - offset;
+        memcpy(write_space, stream + offset, count);
+        offset += count;
+        packet_ring_commit(&ring, count);
+
+        const char *packet;
+        size_t packet_size;
+        while (packet_ring_next(&ring, &packet, &packet_size))
+        {
+            framebench_sink += packet[0];
+            packets++;
+        }
+    }
+    packet_ring_destroy(&ring);
+    return packets;
+}
+
+int main(int argc, char **argv)
+{
+    size_t length = (size_t)(argc > 1 ? atoi(argv[1]) : FRAMEBENCH_DEFAULT_MB) << 20;
+    if (argc > 2 || length == 0)
+    {
+        fprintf(stderr, "Usage: %s [megabytes per packet size, default %d]\n", argv[0], FRAMEBENCH_DEFAULT_MB);
+        return 2;
+    }
+    char *stream = malloc(length);
+    if (stream == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    int status = 0;
+    for (size_t packet_size = FRAMEBENCH_MIN_PACKET; packet_size <= FRAMEBENCH_MAX_PACKET; packet_size *= 4)
+    {
+        for (size_t i = 0; i < length; i++)
+        {
+            stream[i] = (i + 1) % packet_size == 0 ? '\n' : 'a';
+        }
+
+        double start = now_seconds();
+        size_t moved = framebench_memmove(stream, length);
+        double middle = now_seconds();
+        size_t ringed = framebench_ring(stream, length);
+        double end = now_seconds();
+
+        printf("%8zu B packets: memchr+memmove %9.1f MB/s, packet ring %9.1f MB/s\n", packet_size,
+               length / 1e6 / (middle - start), length / 1e6 / (end - middle));
+        if (moved != ringed || moved != length / packet_size)
+        {
+            fprintf(stderr, "Packet counts differ: %zu and %zu, expected %zu\n", moved, ringed, length / packet_size);
+            status = 1;
+        }
+    }
+    free(stream);
+    return status;
+}
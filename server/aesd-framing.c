@@ -0,0 +1,311 @@
+/**
+ * @file aesd-framing.c
+ * @brief Newline packet framing for aesdsocket connections
+ *
+ * The scanner compares 32 (AVX2) or 16 (SSE2) bytes at a time against '\n' and
+ * walks the resulting bit mask, so a block holding many short packets yields all
+ * of their boundaries from one compare. The ring remembers a batch of those
+ * boundaries and where scanning stopped, so no byte is scanned twice however the
+ * packets are split across receives.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/mman.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FRAMING_HAVE_AVX2
+#endif
+
+#include "aesd-framing.h"
+#include "aesd-pool.h"
+#include "aesd-logger.h"
+
+static size_t framing_scan_scalar(const char *data, size_t length, size_t *offsets, size_t max, size_t *scanned)
+{
+    size_t count = 0;
+    const char *p = data;
+    const char *end = data + length;
+
+    while (count < max && (p = memchr(p, '\n', end - p)) != NULL)
+    {
+        offsets[count++] = p - data;
+        p++;
+    }
+    *scanned = p != NULL ? (size_t)(p - data) : length;
+    return count;
+}
+
+/**
+ * Records the newlines flagged in @param mask for the block at @param base
+ * @return true if @param max was reached, with @param scanned set past the last one
+ */
+static inline bool framing_take_mask(uint32_t mask, size_t base, size_t *offsets, size_t max, size_t *count,
+                                     size_t *scanned)
+{
+    while (mask != 0)
+    {
+        size_t offset = base + __builtin_ctz(mask);
+        offsets[(*count)++] = offset;
+        if (*count == max)
+        {
+            *scanned = offset + 1;
+            return true;
+        }
+        mask &= mask - 1;
+    }
+    return false;
+}
+
+#ifdef __SSE2__
+static size_t framing_scan_sse2(const char *data, size_t length, size_t *offsets, size_t max, size_t *scanned)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t count = 0;
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+        if (framing_take_mask(mask, i, offsets, max, &count, scanned))
+        {
+            return count;
+        }
+    }
+
+    size_t tail_count, tail_scanned;
+    tail_count = framing_scan_scalar(data + i, length - i, offsets + count, max - count, &tail_scanned);
+    for (size_t j = count; j < count + tail_count; j++)
+    {
+        offsets[j] += i;
+    }
+    *scanned = i + tail_scanned;
+    return count + tail_count;
+}
+#endif
+
+#ifdef FRAMING_HAVE_AVX2
+__attribute__((target("avx2"))) static size_t framing_scan_avx2(const char *data, size_t length, size_t *offsets,
+                                                                size_t max, size_t *scanned)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t count = 0;
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(data + i));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline));
+        if (framing_take_mask(mask, i, offsets, max, &count, scanned))
+        {
+            return count;
+        }
+    }
+
+    size_t tail_count, tail_scanned;
+    tail_count = framing_scan_scalar(data + i, length - i, offsets + count, max - count, &tail_scanned);
+    for (size_t j = count; j < count + tail_count; j++)
+    {
+        offsets[j] += i;
+    }
+    *scanned = i + tail_scanned;
+    return count + tail_count;
+}
+#endif
+
+size_t framing_scan_newlines(const char *data, size_t length, size_t *offsets, size_t max, size_t *scanned)
+{
+    if (max == 0)
+    {
+        *scanned = 0;
+        return 0;
+    }
+#ifdef FRAMING_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return framing_scan_avx2(data, length, offsets, max, scanned);
+    }
+#endif
+#ifdef __SSE2__
+    return framing_scan_sse2(data, length, offsets, max, scanned);
+#else
+    return framing_scan_scalar(data, length, offsets, max, scanned);
+#endif
+}
+
+void *packet_ring_map(size_t capacity)
+{
+    int fd = memfd_create("aesdsocket-ring", MFD_CLOEXEC);
+    if (fd == -1)
+    {
+        logger_log(LOG_ERR, "Failed to create receive ring: %s", strerror(errno));
+        return NULL;
+    }
+    if (ftruncate(fd, capacity) == -1)
+    {
+        logger_log(LOG_ERR, "Failed to size receive ring: %s", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    // Reserve both halves first so the second mapping cannot land elsewhere
+    char *buffer = mmap(NULL, 2 * capacity, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED)
+    {
+        logger_log(LOG_ERR, "Failed to map receive ring: %s", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    if (mmap(buffer, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(buffer + capacity, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        logger_log(LOG_ERR, "Failed to map receive ring: %s", strerror(errno));
+        munmap(buffer, 2 * capacity);
+        close(fd);
+        return NULL;
+    }
+    // The mappings keep the memory alive
+    close(fd);
+    return buffer;
+}
+
+void packet_ring_unmap(void *buffer, size_t capacity)
+{
+    munmap(buffer, 2 * capacity);
+}
+
+/**
+ * Moves the buffered data into a new mapping of @param capacity bytes
+ * @return 0 on success, -1 on error (already logged)
+ */
+static int packet_ring_resize(struct packet_ring_s *ring, size_t capacity)
+{
+    char *buffer = mem_pool_alloc(&ring_pool, capacity);
+    if (buffer == NULL)
+    {
+        return -1;
+    }
+    size_t length = ring->write_pos - ring->read_pos;
+    if (length > 0)
+    {
+        memcpy(buffer + ring->read_pos % capacity, ring->buffer + ring->read_pos % ring->capacity, length);
+    }
+    mem_pool_free(&ring_pool, ring->buffer, ring->capacity);
+    ring->buffer = buffer;
+    ring->capacity = capacity;
+    return 0;
+}
+
+int packet_ring_init(struct packet_ring_s *ring, size_t capacity)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+
+    memset(ring, 0, sizeof(struct packet_ring_s));
+    // Size classes are powers of two, so every class from the page size up is whole pages
+    capacity = mem_pool_class_size(capacity < page_size ? page_size : capacity);
+    ring->buffer = mem_pool_alloc(&ring_pool, capacity);
+    if (ring->buffer == NULL)
+    {
+        return -1;
+    }
+    ring->capacity = capacity;
+    ring->min_capacity = capacity;
+    return 0;
+}
+
+char *packet_ring_write_space(struct packet_ring_s *ring, size_t *space)
+{
+    size_t length = ring->write_pos - ring->read_pos;
+
+    if (length == 0)
+    {
+        // Give the memory back once packets are small again, but not between large ones
+        if (ring->capacity > ring->min_capacity && ring->peak_packet <= ring->capacity / 4 &&
+            packet_ring_resize(ring, ring->min_capacity) != 0)
+        {
+            return NULL;
+        }
+        ring->peak_packet = 0;
+    }
+    else if (length == ring->capacity)
+    {
+        if (packet_ring_resize(ring, ring->capacity * 2) != 0)
+        {
+            return NULL;
+        }
+    }
+
+    *space = ring->capacity - length;
+    return ring->buffer + ring->write_pos % ring->capacity;
+}
+
+void packet_ring_commit(struct packet_ring_s *ring, size_t count)
+{
+    ring->write_pos += count;
+}
+
+bool packet_ring_next(struct packet_ring_s *ring, const char **packet, size_t *packet_size)
+{
+    if (ring->newline_next == ring->newline_count)
+    {
+        size_t offsets[PACKET_RING_BATCH];
+        size_t scanned;
+        size_t count = framing_scan_newlines(ring->buffer + ring->scan_pos % ring->capacity,
+                                             ring->write_pos - ring->scan_pos, offsets, PACKET_RING_BATCH, &scanned);
+        for (size_t i = 0; i < count; i++)
+        {
+            ring->newlines[i] = ring->scan_pos + offsets[i];
+        }
+        ring->newline_next = 0;
+        ring->newline_count = count;
+        ring->scan_pos += scanned;
+        if (count == 0)
+        {
+            return false;
+        }
+    }
+
+    uint64_t end = ring->newlines[ring->newline_next++] + 1;
+    *packet = ring->buffer + ring->read_pos % ring->capacity;
+    *packet_size = end - ring->read_pos;
+    if (*packet_size > ring->peak_packet)
+    {
+        ring->peak_packet = *packet_size;
+    }
+    ring->read_pos = end;
+    return true;
+}
+
+const char *packet_ring_peek(struct packet_ring_s *ring, size_t *length)
+{
+    *length = ring->write_pos - ring->read_pos;
+    return ring->buffer + ring->read_pos % ring->capacity;
+}
+
+void packet_ring_consume(struct packet_ring_s *ring, size_t count)
+{
+    if (count > ring->peak_packet)
+    {
+        ring->peak_packet = count;
+    }
+    ring->read_pos += count;
+    // Newlines found so far may lie in the consumed bytes
+    if (ring->scan_pos < ring->read_pos)
+    {
+        ring->scan_pos = ring->read_pos;
+    }
+    ring->newline_next = 0;
+    ring->newline_count = 0;
+}
+
+void packet_ring_destroy(struct packet_ring_s *ring)
+{
+    mem_pool_free(&ring_pool, ring->buffer, ring->capacity);
+    memset(ring, 0, sizeof(struct packet_ring_s));
+}
@@ -0,0 +1,126 @@
+/*
+ * aesd-framing.h
+ *
+ *  Newline packet framing for aesdsocket connections: a vectorized newline
+ *  scanner and a receive ring buffer that hands out every complete packet
+ *  without moving the rest of the data.
+ */
+
+#ifndef AESD_FRAMING_H
+#define AESD_FRAMING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Newline positions remembered per scan of the ring, so each byte is scanned once
+ */
+#define PACKET_RING_BATCH 64
+
+/**
+ * Receive buffer mapped twice back to back, so any range of up to capacity bytes
+ * starting anywhere in the first mapping is contiguous in memory. Packets that
+ * wrap around the end of the ring are therefore still returned as one pointer,
+ * and consuming a packet only advances an offset.
+ *
+ * Positions are logical byte offsets in the connection's stream. The buffer index
+ * of a position is the position modulo the capacity.
+ */
+struct packet_ring_s
+{
+    char *buffer;
+    /**
+     * Size of one of the two mappings, a ring_pool size class
+     */
+    size_t capacity;
+    /**
+     * Capacity the ring shrinks back to once a large packet has been consumed
+     */
+    size_t min_capacity;
+    /**
+     * Largest packet consumed since the ring was last empty
+     */
+    size_t peak_packet;
+    /**
+     * Start of the first unconsumed byte
+     */
+    uint64_t read_pos;
+    /**
+     * End of the received data
+     */
+    uint64_t write_pos;
+    /**
+     * Every newline before this position is in newlines[]
+     */
+    uint64_t scan_pos;
+    /**
+     * Positions of newlines found by the last scan and not yet returned
+     */
+    uint64_t newlines[PACKET_RING_BATCH];
+    size_t newline_next;
+    size_t newline_count;
+};
+
+/**
+ * Stores the offsets of up to @param max newlines in @param data into @param offsets,
+ * using AVX2 or SSE2 when the CPU has them and a scalar scan otherwise.
+ * @param scanned set to the number of bytes examined, which is less than
+ * @param length only when @param max newlines were found
+ * @return the number of newlines stored
+ */
+size_t framing_scan_newlines(const char *data, size_t length, size_t *offsets, size_t max, size_t *scanned);
+
+/**
+ * Maps @param capacity bytes of anonymous shared memory twice, back to back.
+ * @param capacity must be a multiple of the page size.
+ * Used as the ring_pool backend, rings take their buffers from ring_pool.
+ * @return the first mapping, or NULL on error (already logged)
+ */
+void *packet_ring_map(size_t capacity);
+
+void packet_ring_unmap(void *buffer, size_t capacity);
+
+/**
+ * Takes a ring of at least @param capacity bytes, rounded up to a ring_pool size
+ * class of whole pages, from ring_pool
+ * @return 0 on success, -1 on error (already logged)
+ */
+int packet_ring_init(struct packet_ring_s *ring, size_t capacity);
+
+/**
+ * Returns the free space after the received data, growing the ring if it is full
+ * and shrinking it back if it grew earlier and is now empty.
+ * @param space set to the number of bytes that may be written
+ * @return the start of the free space, or NULL on allocation failure (already logged)
+ */
+char *packet_ring_write_space(struct packet_ring_s *ring, size_t *space);
+
+/**
+ * Records @param count bytes written to the space returned by packet_ring_write_space
+ */
+void packet_ring_commit(struct packet_ring_s *ring, size_t count);
+
+/**
+ * Removes the next complete newline terminated packet from the ring.
+ * The packet stays valid until the next call to packet_ring_write_space.
+ * @return true and sets @param packet and @param packet_size if a packet is complete
+ */
+bool packet_ring_next(struct packet_ring_s *ring, const char **packet, size_t *packet_size);
+
+/**
+ * Returns every unconsumed byte, contiguous however the ring wraps, for framings
+ * other than newlines. The bytes stay valid until the next call to
+ * packet_ring_write_space.
+ * @param length set to the number of bytes
+ */
+const char *packet_ring_peek(struct packet_ring_s *ring, size_t *length);
+
+/**
+ * Removes @param count bytes returned by packet_ring_peek as one packet
+ */
+void packet_ring_consume(struct packet_ring_s *ring, size_t count);
+
+void packet_ring_destroy(struct packet_ring_s *ring);
+
+#endif /* AESD_FRAMING_H */
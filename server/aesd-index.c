@@ -0,0 +1,454 @@
+/**
+ * @file aesd-index.c
+ * @brief In-memory index of the records appended to the aesdsocket data file or
+ * segmented log
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/stat.h>
+
+#include "aesd-index.h"
+#include "aesd-logger.h"
+
+/**
+ * Chunks are reused round robin, which only matters once retention frees old ones
+ */
+static off_t **segment_index_chunk(struct segment_index_s *index, size_t chunk)
+{
+    return &index->chunks[chunk & (SEGMENT_INDEX_MAX_CHUNKS - 1)];
+}
+
+static off_t *segment_index_offset(struct segment_index_s *index, size_t record)
+{
+    off_t *offsets = *segment_index_chunk(index, record >> SEGMENT_INDEX_CHUNK_SHIFT);
+    return &offsets[record & (SEGMENT_INDEX_CHUNK_RECORDS - 1)];
+}
+
+/**
+ * Drops the records that start before @param retained_from, the first offset the
+ * log keeps, and the chunks holding only dropped records.
+ * The caller must hold reserve_mutex.
+ */
+static void segment_index_retain(struct segment_index_s *index, off_t retained_from)
+{
+    size_t first = index->first_record;
+    off_t start = index->start;
+
+    if (start >= retained_from)
+    {
+        return;
+    }
+    while (first < index->reserved_count && *segment_index_offset(index, first) < retained_from)
+    {
+        first++;
+    }
+    start = first < index->reserved_count ? *segment_index_offset(index, first) : index->reserved_length;
+
+    for (size_t chunk = index->first_record >> SEGMENT_INDEX_CHUNK_SHIFT; chunk < first >> SEGMENT_INDEX_CHUNK_SHIFT;
+         chunk++)
+    {
+        free(*segment_index_chunk(index, chunk));
+        *segment_index_chunk(index, chunk) = NULL;
+    }
+    index->first_record = first;
+    // Published before the log drops the segments, so a reader whose pin fails
+    // finds the new start when it retries
+    __atomic_store_n(&index->start, start, __ATOMIC_RELEASE);
+}
+
+/**
+ * Reserves the next @param count record numbers and the bytes for the records in
+ * @param iov at the end of the file.
+ * @return 0 on success, -1 if the index is full or out of memory (already logged)
+ */
+static int segment_index_reserve(struct segment_index_s *index, const struct iovec *iov, int count, size_t *record,
+                                 off_t *offset)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&index->reserve_mutex);
+    size_t last_chunk = (index->reserved_count + count - 1) >> SEGMENT_INDEX_CHUNK_SHIFT;
+    if (last_chunk - (index->first_record >> SEGMENT_INDEX_CHUNK_SHIFT) >= SEGMENT_INDEX_MAX_CHUNKS)
+    {
+        logger_log(LOG_ERR, "Segment index is full");
+        ret = -1;
+    }
+    for (size_t chunk = index->reserved_count >> SEGMENT_INDEX_CHUNK_SHIFT; ret == 0 && chunk <= last_chunk; chunk++)
+    {
+        off_t **offsets = segment_index_chunk(index, chunk);
+        if (*offsets == NULL)
+        {
+            *offsets = malloc(SEGMENT_INDEX_CHUNK_RECORDS * sizeof(off_t));
+            if (*offsets == NULL)
+            {
+                logger_log(LOG_ERR, "Failed to allocate memory for segment index");
+                ret = -1;
+            }
+        }
+    }
+    if (ret == 0 && index->log != NULL)
+    {
+        off_t end = index->reserved_length;
+        for (int i = 0; i < count; i++)
+        {
+            end += iov[i].iov_len;
+        }
+        off_t retained_from = segment_log_retained_from(index->log, end);
+        if (end > index->reserved_length && index->reserved_length < retained_from)
+        {
+            // Checked before anything is dropped, the records would be lost for nothing
+            logger_log(LOG_ERR, "Record of %lld bytes does not fit in the retained log",
+                   (long long)(end - index->reserved_length));
+            ret = -1;
+        }
+        else
+        {
+            segment_index_retain(index, retained_from);
+            // Pins the new records until they are committed
+            ret = segment_log_extend(index->log, index->reserved_length, end);
+        }
+    }
+    if (ret == 0)
+    {
+        *record = index->reserved_count;
+        *offset = index->reserved_length;
+        for (int i = 0; i < count; i++)
+        {
+            *segment_index_offset(index, index->reserved_count) = index->reserved_length;
+            index->reserved_count++;
+            index->reserved_length += iov[i].iov_len;
+        }
+    }
+    pthread_mutex_unlock(&index->reserve_mutex);
+    return ret;
+}
+
+/**
+ * Publishes @param count reserved records starting at @param record, ending at file
+ * offset @param end, once every record before them has been published
+ */
+static void segment_index_commit(struct segment_index_s *index, size_t record, int count, off_t end)
+{
+    pthread_mutex_lock(&index->commit_mutex);
+    while (__atomic_load_n(&index->count, __ATOMIC_RELAXED) != record)
+    {
+        pthread_cond_wait(&index->commit_cond, &index->commit_mutex);
+    }
+    // Commits are serialized by commit_mutex, the sequence only guards readers
+    __atomic_store_n(&index->sequence, index->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&index->length, end, __ATOMIC_RELAXED);
+    __atomic_store_n(&index->count, record + count, __ATOMIC_RELAXED);
+    __atomic_store_n(&index->sequence, index->sequence + 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&index->commit_cond);
+    pthread_mutex_unlock(&index->commit_mutex);
+}
+
+/**
+ * Publishes [@param start, @param end) as a tombstone, before the records in it are
+ * committed
+ */
+static void segment_index_bury(struct segment_index_s *index, off_t start, off_t end)
+{
+    struct segment_index_hole_s *hole = malloc(sizeof(struct segment_index_hole_s));
+    if (hole == NULL)
+    {
+        logger_log(LOG_ERR, "Failed to allocate memory for tombstone, replays will contain its bytes");
+        return;
+    }
+    hole->start = start;
+    hole->end = end;
+    hole->next = __atomic_load_n(&index->holes, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&index->holes, &hole->next, hole, false, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED))
+    {
+    }
+}
+
+int segment_index_init(struct segment_index_s *index, const char *path)
+{
+    struct stat st;
+
+    memset(index, 0, sizeof(struct segment_index_s));
+    index->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (index->fd < 0)
+    {
+        logger_log(LOG_ERR, "Failed to open file: %s, %s", path, strerror(errno));
+        return -1;
+    }
+    if (fstat(index->fd, &st) == -1)
+    {
+        logger_log(LOG_ERR, "Failed to stat data file: %s", strerror(errno));
+        close(index->fd);
+        return -1;
+    }
+    index->chunks = calloc(SEGMENT_INDEX_MAX_CHUNKS, sizeof(off_t *));
+    if (index->chunks == NULL)
+    {
+        logger_log(LOG_ERR, "Failed to allocate memory for segment index");
+        close(index->fd);
+        return -1;
+    }
+    pthread_mutex_init(&index->reserve_mutex, NULL);
+    pthread_mutex_init(&index->commit_mutex, NULL);
+    pthread_cond_init(&index->commit_cond, NULL);
+
+    if (st.st_size > 0)
+    {
+        struct iovec existing = {NULL, st.st_size};
+        size_t record;
+        off_t offset;
+        if (segment_index_reserve(index, &existing, 1, &record, &offset) != 0)
+        {
+            segment_index_destroy(index);
+            return -1;
+        }
+        segment_index_commit(index, record, 1, offset + st.st_size);
+    }
+    return 0;
+}
+
+int segment_index_init_log(struct segment_index_s *index, const char *path, size_t segment_size,
+                           size_t retain_segments)
+{
+    memset(index, 0, sizeof(struct segment_index_s));
+    index->fd = -1;
+    index->log = malloc(sizeof(struct segment_log_s));
+    index->chunks = calloc(SEGMENT_INDEX_MAX_CHUNKS, sizeof(off_t *));
+    if (index->log == NULL || index->chunks == NULL)
+    {
+        logger_log(LOG_ERR, "Failed to allocate memory for segment index");
+        free(index->log);
+        free(index->chunks);
+        return -1;
+    }
+    if (segment_log_init(index->log, path, segment_size, retain_segments) != 0)
+    {
+        free(index->log);
+        free(index->chunks);
+        return -1;
+    }
+    pthread_mutex_init(&index->reserve_mutex, NULL);
+    pthread_mutex_init(&index->commit_mutex, NULL);
+    pthread_cond_init(&index->commit_cond, NULL);
+    return 0;
+}
+
+int segment_index_append(struct segment_index_s *index, const char *data, size_t size, off_t *end)
+{
+    struct iovec iov = {(void *)data, size};
+    return segment_index_appendv(index, &iov, 1, end);
+}
+
+int segment_index_appendv(struct segment_index_s *index, const struct iovec *iov, int count, off_t *end)
+{
+    int ret = 0;
+    size_t record;
+    off_t offset;
+
+    if (segment_index_reserve(index, iov, count, &record, &offset) != 0)
+    {
+        return -1;
+    }
+
+    if (index->log != NULL)
+    {
+        off_t record_end = offset;
+        for (int i = 0; i < count; i++)
+        {
+            record_end += iov[i].iov_len;
+        }
+        segment_log_write(index->log, offset, iov, count);
+        segment_index_commit(index, record, count, record_end);
+        segment_log_unpin(index->log, offset, record_end);
+        if (end != NULL)
+        {
+            *end = record_end;
+        }
+        return 0;
+    }
+
+    // pwritev may stop short, so work on a copy that can be advanced
+    struct iovec remaining[count];
+    memcpy(remaining, iov, count * sizeof(struct iovec));
+    struct iovec *next = remaining;
+    int left = count;
+    off_t position = offset;
+    off_t record_end = offset;
+    for (int i = 0; i < count; i++)
+    {
+        record_end += iov[i].iov_len;
+    }
+    while (position < record_end)
+    {
+        ssize_t written = pwritev(index->fd, next, left, position);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            logger_log(LOG_ERR, "Failed to write data to file: %s", strerror(errno));
+            ret = -1;
+            break;
+        }
+        position += written;
+        while (left > 0 && (size_t)written >= next->iov_len)
+        {
+            written -= next->iov_len;
+            next++;
+            left--;
+        }
+        if (left > 0)
+        {
+            next->iov_base = (char *)next->iov_base + written;
+            next->iov_len -= written;
+        }
+    }
+
+    if (ret != 0)
+    {
+        // The reservation still has to be committed so later records are not held up,
+        // the records not completely written are buried
+        off_t hole_start = offset;
+        for (int i = 0; i < count && hole_start + (off_t)iov[i].iov_len <= position; i++)
+        {
+            hole_start += iov[i].iov_len;
+        }
+        segment_index_bury(index, hole_start, record_end);
+    }
+    segment_index_commit(index, record, count, record_end);
+    if (end != NULL)
+    {
+        *end = record_end;
+    }
+    return ret;
+}
+
+off_t segment_index_length(struct segment_index_s *index)
+{
+    return __atomic_load_n(&index->length, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Reads a consistent committed record count and length
+ */
+static void segment_index_snapshot(struct segment_index_s *index, size_t *count, off_t *length)
+{
+    unsigned int sequence;
+    do
+    {
+        sequence = __atomic_load_n(&index->sequence, __ATOMIC_ACQUIRE);
+        *count = __atomic_load_n(&index->count, __ATOMIC_RELAXED);
+        *length = __atomic_load_n(&index->length, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((sequence & 1) || sequence != __atomic_load_n(&index->sequence, __ATOMIC_RELAXED));
+}
+
+off_t segment_index_start(struct segment_index_s *index)
+{
+    return __atomic_load_n(&index->start, __ATOMIC_ACQUIRE);
+}
+
+bool segment_index_next_hole(struct segment_index_s *index, off_t start, off_t end, off_t *hole_start,
+                             off_t *hole_end)
+{
+    bool found = false;
+    for (struct segment_index_hole_s *hole = __atomic_load_n(&index->holes, __ATOMIC_ACQUIRE); hole != NULL;
+         hole = hole->next)
+    {
+        if (hole->start < end && hole->end > start && (!found || hole->start < *hole_start))
+        {
+            *hole_start = hole->start;
+            *hole_end = hole->end;
+            found = true;
+        }
+    }
+    return found;
+}
+
+int segment_index_seek(struct segment_index_s *index, uint32_t write_cmd, uint32_t write_cmd_offset, off_t *offset)
+{
+    size_t count;
+    off_t length;
+    int ret = 0;
+
+    // Retention frees the offsets of dropped records under reserve_mutex, and seeks
+    // are rare enough to take it too
+    pthread_mutex_lock(&index->reserve_mutex);
+    segment_index_snapshot(index, &count, &length);
+    size_t record = index->first_record + write_cmd;
+    if (record >= count)
+    {
+        ret = -1;
+    }
+    else
+    {
+        off_t start = *segment_index_offset(index, record);
+        off_t end = record + 1 < count ? *segment_index_offset(index, record + 1) : length;
+        if (start + write_cmd_offset >= end)
+        {
+            ret = -1;
+        }
+        *offset = start + write_cmd_offset;
+    }
+    pthread_mutex_unlock(&index->reserve_mutex);
+    return ret;
+}
+
+void segment_index_pin(struct segment_index_s *index, off_t *start, off_t end)
+{
+    if (index->log == NULL)
+    {
+        return;
+    }
+    do
+    {
+        off_t first = segment_index_start(index);
+        if (*start < first)
+        {
+            *start = first < end ? first : end;
+        }
+    } while (segment_log_pin(index->log, *start, end) != 0);
+}
+
+void segment_index_unpin(struct segment_index_s *index, off_t start, off_t end)
+{
+    if (index->log != NULL)
+    {
+        segment_log_unpin(index->log, start, end);
+    }
+}
+
+void segment_index_destroy(struct segment_index_s *index)
+{
+    while (index->holes != NULL)
+    {
+        struct segment_index_hole_s *hole = index->holes;
+        index->holes = hole->next;
+        free(hole);
+    }
+    for (size_t i = 0; i < SEGMENT_INDEX_MAX_CHUNKS; i++)
+    {
+        free(index->chunks[i]);
+    }
+    free(index->chunks);
+    pthread_cond_destroy(&index->commit_cond);
+    pthread_mutex_destroy(&index->commit_mutex);
+    pthread_mutex_destroy(&index->reserve_mutex);
+    if (index->log != NULL)
+    {
+        segment_log_destroy(index->log);
+        free(index->log);
+    }
+    else
+    {
+        close(index->fd);
+    }
+    memset(index, 0, sizeof(struct segment_index_s));
+}
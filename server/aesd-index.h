@@ -0,0 +1,163 @@
+/*
+ * aesd-index.h
+ *
+ *  In-memory index of the records appended to the aesdsocket data file, with
+ *  concurrent appends and lock-free readers
+ */
+
+#ifndef AESD_INDEX_H
+#define AESD_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "aesd-log.h"
+
+#define SEGMENT_INDEX_CHUNK_SHIFT 14
+#define SEGMENT_INDEX_CHUNK_RECORDS (1 << SEGMENT_INDEX_CHUNK_SHIFT)
+#define SEGMENT_INDEX_MAX_CHUNKS 16384
+
+/**
+ * Tracks the start offset of every record appended to the data file so the current
+ * length and the position of any record are known without touching the file.
+ *
+ * Appending is split in three steps. Space and a record number are reserved under a
+ * short mutex. The bytes are written with pwrite outside of any lock, so appends from
+ * many connections proceed in parallel. The record is then committed, in reservation
+ * order, by publishing the new length and count with release semantics.
+ *
+ * Readers never take a lock. The length alone is loaded with acquire semantics, and
+ * the count and length together are read under a seqlock. Record offsets live in
+ * fixed size chunks that never move once allocated, and the file only grows, so
+ * everything below the published length stays valid.
+ *
+ * Backed by a segmented log instead of the data file, the bytes are copied into the
+ * mapped segments and old segments are dropped past the retention limit. The records
+ * before the first one wholly in a kept segment are dropped with them, so offsets
+ * then start at the first retained record rather than 0, and ranges must be pinned
+ * to be read after the record they were taken for.
+ *
+ * A reservation is committed even if writing it fails, so later records are not held
+ * up. The records that were not completely written become a tombstone, a hole in the
+ * file that readers skip.
+ */
+struct segment_index_hole_s
+{
+    struct segment_index_hole_s *next;
+    off_t start;
+    off_t end;
+};
+
+struct segment_index_s
+{
+    /**
+     * The data file, opened without O_APPEND so records can be written at their
+     * reserved offsets, or -1 when the records are stored in log
+     */
+    int fd;
+    struct segment_log_s *log;
+    /**
+     * Chunks of SEGMENT_INDEX_CHUNK_RECORDS record start offsets
+     */
+    off_t **chunks;
+    pthread_mutex_t reserve_mutex;
+    size_t reserved_count;
+    off_t reserved_length;
+    pthread_mutex_t commit_mutex;
+    pthread_cond_t commit_cond;
+    /**
+     * Seqlock sequence, odd while a commit is updating count and length
+     */
+    unsigned int sequence;
+    /**
+     * Number of committed records, accessed atomically
+     */
+    size_t count;
+    /**
+     * Number of committed bytes in the data file, accessed atomically
+     */
+    off_t length;
+    /**
+     * First retained record, changed under reserve_mutex, and its offset, accessed
+     * atomically. Both stay 0 without a log.
+     */
+    size_t first_record;
+    off_t start;
+    /**
+     * Tombstones, newest first, pushed before the commit that covers them and
+     * accessed atomically
+     */
+    struct segment_index_hole_s *holes;
+};
+
+/**
+ * Opens the data file at @param path and initializes @param index for it. Any
+ * existing contents are recorded as a single record.
+ * @return 0 on success, -1 on error (already logged)
+ */
+int segment_index_init(struct segment_index_s *index, const char *path);
+
+/**
+ * Initializes @param index for records stored in a segmented log of
+ * @param segment_size byte segments named after @param path, keeping at most
+ * @param retain_segments of them (0 for no limit)
+ * @return 0 on success, -1 on error (already logged)
+ */
+int segment_index_init_log(struct segment_index_s *index, const char *path, size_t segment_size,
+                           size_t retain_segments);
+
+/**
+ * Appends @param size bytes from @param data to the data file as a new record and
+ * waits until every earlier record is committed.
+ * @param end if not NULL, set to the end of the new record
+ * @return 0 on success, -1 on error (already logged)
+ */
+int segment_index_append(struct segment_index_s *index, const char *data, size_t size, off_t *end);
+
+/**
+ * Appends each of the @param count buffers in @param iov as a record, with a single
+ * reservation, pwritev and commit, and waits until every earlier record is committed.
+ * @param end if not NULL, set to the end of the last new record
+ * @return 0 on success, -1 on error (already logged)
+ */
+int segment_index_appendv(struct segment_index_s *index, const struct iovec *iov, int count, off_t *end);
+
+/**
+ * @return the number of bytes of the data file committed so far
+ */
+off_t segment_index_length(struct segment_index_s *index);
+
+/**
+ * @return the offset of the first retained record
+ */
+off_t segment_index_start(struct segment_index_s *index);
+
+/**
+ * Finds the first tombstone that overlaps [@param start, @param end)
+ * @return true and sets @param hole_start and @param hole_end if there is one
+ */
+bool segment_index_next_hole(struct segment_index_s *index, off_t start, off_t end, off_t *hole_start,
+                             off_t *hole_end);
+
+/**
+ * Finds the offset of byte @param write_cmd_offset in retained record @param write_cmd,
+ * with the same zero referenced meaning as struct aesd_seekto.
+ * @return 0 and sets @param offset on success, -1 if the position does not exist
+ */
+int segment_index_seek(struct segment_index_s *index, uint32_t write_cmd, uint32_t write_cmd_offset, off_t *offset);
+
+/**
+ * Keeps [@param start, @param end) of a log readable until segment_index_unpin,
+ * advancing @param start past anything retention has already dropped
+ */
+void segment_index_pin(struct segment_index_s *index, off_t *start, off_t end);
+
+void segment_index_unpin(struct segment_index_s *index, off_t start, off_t end);
+
+void segment_index_destroy(struct segment_index_s *index);
+
+#endif /* AESD_INDEX_H */
@@ -0,0 +1,105 @@
+/**
+ * @file aesd-listener.c
+ * @brief Listening sockets and CPU pinning for aesdsocket accept loops
+ *
+ * A single listening socket funnels every connection through one accept queue and
+ * whichever thread drains it. With SO_REUSEPORT each accept loop gets a socket of
+ * its own and the kernel hashes new connections across them, so accepts proceed
+ * on all cores at once and a burst is spread over several backlogs.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "aesd-listener.h"
+#include "aesd-logger.h"
+
+int listener_bind(int port, bool reuse_port)
+{
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock == -1)
+    {
+        logger_log(LOG_ERR, "Failed to create socket: %s", strerror(errno));
+        return -1;
+    }
+
+    // Set socket options to allow reuse of address
+    int opt = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1 ||
+        (reuse_port && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1))
+    {
+        logger_log(LOG_ERR, "Failed to set socket options: %s", strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    // Accepted sockets inherit it: a response flushed in parts as the send queue
+    // drains must not have its tail held back waiting for a delayed ACK
+    if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt)) == -1)
+    {
+        logger_log(LOG_ERR, "Failed to set TCP_NODELAY: %s", strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        logger_log(LOG_ERR, "Failed to bind to port %d: %s", port, strerror(errno));
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+void listener_close_all(const int *socks, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (socks[i] != -1)
+        {
+            close(socks[i]);
+        }
+    }
+}
+
+int listener_pin_thread(int index)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+    {
+        logger_log(LOG_ERR, "Failed to get CPU affinity: %s", strerror(errno));
+        return -1;
+    }
+
+    int target = index % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &allowed) && target-- == 0)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            if (ret != 0)
+            {
+                logger_log(LOG_ERR, "Failed to pin thread to CPU %d: %s", cpu, strerror(ret));
+                return -1;
+            }
+            return 0;
+        }
+    }
+    return -1;
+}
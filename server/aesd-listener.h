@@ -0,0 +1,34 @@
+/*
+ * aesd-listener.h
+ *
+ *  Listening sockets for aesdsocket, optionally several sharing the port through
+ *  SO_REUSEPORT so each accept loop has its own queue, and CPU pinning for the
+ *  threads serving them
+ */
+
+#ifndef AESD_LISTENER_H
+#define AESD_LISTENER_H
+
+#include <stdbool.h>
+
+/**
+ * Creates a nonblocking TCP socket bound to @param port on all addresses. With
+ * @param reuse_port several such sockets share the port and the kernel spreads
+ * incoming connections across them.
+ * @return the socket, or -1 on error (already logged)
+ */
+int listener_bind(int port, bool reuse_port);
+
+/**
+ * Closes the first @param count sockets of @param socks, skipping any that are -1
+ */
+void listener_close_all(const int *socks, int count);
+
+/**
+ * Pins the calling thread to the @param index-th CPU it is allowed to run on,
+ * wrapping around when there are fewer CPUs
+ * @return 0 on success, -1 on error (already logged)
+ */
+int listener_pin_thread(int index);
+
+#endif /* AESD_LISTENER_H */
@@ -0,0 +1,740 @@
+/**
+ * @file aesd-loadgen.c
+ * @brief Load generator and latency benchmark for the aesdsocket protocol
+ *
+ * Opens a number of concurrent connections to a running aesdsocket, one thread
+ * each, and sends newline terminated packets of configurable sizes, optionally at
+ * a fixed rate and mixed with AESDCHAR_IOCSEEKTO:x,y commands. Every packet
+ * carries a unique token, and its response is complete when the received stream
+ * ends with that packet, which also verifies that the server appended it. The
+ * latencies go into an HDR histogram with three significant digits, reported as
+ * percentiles and optionally written as a percentile distribution file.
+ *
+ * Given the server's pid, the CPU time it spends during the run is read from
+ * /proc/<pid>/stat and reported per MB of responses, next to the load generator's own.
+ *
+ * The checks only rely on the response ending with the packet just sent, so the
+ * same run works against the /var/tmp/aesdsocketdata build, with or without
+ * snapshot replay, and against the USE_AESD_CHAR_DEVICE build.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+
+#define LOADGEN_DEFAULT_PORT "9000"
+#define LOADGEN_RECV_SIZE (64 * 1024)
+#define LOADGEN_MAX_PACKET (16 * 1024 * 1024)
+
+/**
+ * HDR histogram of values in ns. Values below 2^HDR_SUB_BITS are counted exactly,
+ * larger ones in buckets whose width is 2^-(HDR_SUB_BITS - 1) of their magnitude,
+ * which keeps three significant digits up to 2^HDR_MAX_BITS ns (about 4.6 hours).
+ */
+#define HDR_SUB_BITS 11
+#define HDR_HALF_COUNT (1 << (HDR_SUB_BITS - 1))
+#define HDR_MAX_BITS 44
+#define HDR_COUNTS ((1 << HDR_SUB_BITS) + (HDR_MAX_BITS - HDR_SUB_BITS) * HDR_HALF_COUNT)
+
+struct hdr_histogram_s
+{
+    uint64_t counts[HDR_COUNTS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+    double sum_squares;
+};
+
+struct loadgen_config_s
+{
+    const char *host;
+    const char *port;
+    int connections;
+    /**
+     * Requests per connection, or 0 to run for duration seconds
+     */
+    long requests;
+    double duration;
+    size_t min_size;
+    size_t max_size;
+    /**
+     * Requests per second per connection, or 0 to send each request as soon as the
+     * previous response arrived
+     */
+    double rate;
+    /**
+     * Every seek_every-th request is an AESDCHAR_IOCSEEKTO:seek_cmd,seek_offset
+     * command, 0 for none
+     */
+    long seek_every;
+    unsigned int seek_cmd;
+    unsigned int seek_offset;
+    const char *distribution_file;
+    /**
+     * Process whose CPU time is reported, or 0
+     */
+    pid_t server_pid;
+};
+
+struct loadgen_thread_s
+{
+    pthread_t thread;
+    int id;
+    int sock;
+    const struct loadgen_config_s *config;
+    struct hdr_histogram_s *histogram;
+    uint64_t requests;
+    uint64_t seeks;
+    uint64_t errors;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    const char *error;
+};
+
+static pthread_barrier_t start_barrier;
+static uint64_t start_time;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t deadline)
+{
+    struct timespec ts = {deadline / 1000000000ull, deadline % 1000000000ull};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    {
+    }
+}
+
+/**
+ * Reads the user plus system CPU time of process @param pid from /proc
+ * @return the time in seconds, or -1 if it could not be read
+ */
+static double process_cpu_seconds(pid_t pid)
+{
+    char path[64];
+    char stat[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return -1;
+    }
+    size_t length = fread(stat, 1, sizeof(stat) - 1, file);
+    fclose(file);
+    stat[length] = '\0';
+
+    // The command name may contain spaces, the fields after it start at the state
+    char *fields = strrchr(stat, ')');
+    unsigned long long utime, stime;
+    if (fields == NULL ||
+        sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2)
+    {
+        return -1;
+    }
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static double self_cpu_seconds(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static int hdr_index(uint64_t value)
+{
+    if (value < (1u << HDR_SUB_BITS))
+    {
+        return (int)value;
+    }
+    int shift = 63 - __builtin_clzll(value) - (HDR_SUB_BITS - 1);
+    if (shift > HDR_MAX_BITS - HDR_SUB_BITS)
+    {
+        return HDR_COUNTS - 1;
+    }
+    return (1 << HDR_SUB_BITS) + (shift - 1) * HDR_HALF_COUNT + (int)((value >> shift) - HDR_HALF_COUNT);
+}
+
+/**
+ * @return the highest value counted in bucket @param index
+ */
+static uint64_t hdr_bucket_value(int index)
+{
+    if (index < (1 << HDR_SUB_BITS))
+    {
+        return index;
+    }
+    int shift = (index - (1 << HDR_SUB_BITS)) / HDR_HALF_COUNT + 1;
+    uint64_t sub = (index - (1 << HDR_SUB_BITS)) % HDR_HALF_COUNT + HDR_HALF_COUNT;
+    return ((sub + 1) << shift) - 1;
+}
+
+static void hdr_record(struct hdr_histogram_s *h, uint64_t value)
+{
+    h->counts[hdr_index(value)]++;
+    if (h->total == 0 || value < h->min)
+    {
+        h->min = value;
+    }
+    if (value > h->max)
+    {
+        h->max = value;
+    }
+    h->total++;
+    h->sum += value;
+    h->sum_squares += (double)value * value;
+}
+
+static void hdr_merge(struct hdr_histogram_s *into, const struct hdr_histogram_s *from)
+{
+    if (from->total == 0)
+    {
+        return;
+    }
+    for (int i = 0; i < HDR_COUNTS; i++)
+    {
+        into->counts[i] += from->counts[i];
+    }
+    if (into->total == 0 || from->min < into->min)
+    {
+        into->min = from->min;
+    }
+    if (from->max > into->max)
+    {
+        into->max = from->max;
+    }
+    into->total += from->total;
+    into->sum += from->sum;
+    into->sum_squares += from->sum_squares;
+}
+
+/**
+ * @return the value at @param percentile (0-100), capped at the recorded maximum
+ */
+static uint64_t hdr_percentile(const struct hdr_histogram_s *h, double percentile)
+{
+    uint64_t target = (uint64_t)(percentile / 100.0 * h->total + 0.5);
+    uint64_t seen = 0;
+
+    if (target == 0)
+    {
+        target = 1;
+    }
+    for (int i = 0; i < HDR_COUNTS; i++)
+    {
+        seen += h->counts[i];
+        if (seen >= target)
+        {
+            uint64_t value = hdr_bucket_value(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+/**
+ * Writes the percentile distribution in the HdrHistogram .hgrm text format, in us
+ * @return 0 on success, -1 on error
+ */
+static int hdr_write_distribution(const struct hdr_histogram_s *h, const char *path)
+{
+    FILE *out = fopen(path, "w");
+    if (out == NULL)
+    {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    fprintf(out, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+    uint64_t seen = 0;
+    for (int i = 0; i < HDR_COUNTS && seen < h->total; i++)
+    {
+        if (h->counts[i] == 0)
+        {
+            continue;
+        }
+        seen += h->counts[i];
+        double fraction = (double)seen / h->total;
+        uint64_t value = hdr_bucket_value(i) < h->max ? hdr_bucket_value(i) : h->max;
+        if (seen < h->total)
+        {
+            fprintf(out, "%12.3f %2.12f %10llu %14.2f\n", value / 1000.0, fraction, (unsigned long long)seen,
+                    1.0 / (1.0 - fraction));
+        }
+        else
+        {
+            fprintf(out, "%12.3f %2.12f %10llu\n", value / 1000.0, fraction, (unsigned long long)seen);
+        }
+    }
+    double mean = h->total ? h->sum / h->total : 0.0;
+    double variance = h->total ? h->sum_squares / h->total - mean * mean : 0.0;
+    fprintf(out, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean / 1000.0,
+            variance > 0 ? sqrt(variance) / 1000.0 : 0.0);
+    fprintf(out, "#[Max     = %12.3f, Total count    = %12llu]\n", h->max / 1000.0, (unsigned long long)h->total);
+
+    if (fclose(out) != 0)
+    {
+        fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int loadgen_connect(const struct loadgen_config_s *config)
+{
+    struct addrinfo hints = {0};
+    struct addrinfo *result;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int ret = getaddrinfo(config->host, config->port, &hints, &result);
+    if (ret != 0)
+    {
+        fprintf(stderr, "Failed to resolve %s: %s\n", config->host, gai_strerror(ret));
+        return -1;
+    }
+
+    int sock = -1;
+    for (struct addrinfo *ai = result; ai != NULL; ai = ai->ai_next)
+    {
+        sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sock == -1)
+        {
+            continue;
+        }
+        if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0)
+        {
+            break;
+        }
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(result);
+
+    if (sock == -1)
+    {
+        fprintf(stderr, "Failed to connect to %s:%s: %s\n", config->host, config->port, strerror(errno));
+        return -1;
+    }
+    int opt = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    return sock;
+}
+
+static int send_all(int sock, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t sent = send(sock, data, length, MSG_NOSIGNAL);
+        if (sent == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+/**
+ * Receives until the stream ends with @param packet, keeping only the last
+ * @param length bytes in @param tail
+ * @return the bytes received, or -1 if the connection failed or closed first
+ */
+static ssize_t receive_response(int sock, const char *packet, size_t length, char *tail, char *buffer)
+{
+    size_t tail_length = 0;
+    size_t total = 0;
+
+    for (;;)
+    {
+        ssize_t count = recv(sock, buffer, LOADGEN_RECV_SIZE, 0);
+        if (count == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            return -1;
+        }
+        total += count;
+
+        // Slide the window of the last length bytes over the new data
+        if ((size_t)count >= length)
+        {
+            memcpy(tail, buffer + count - length, length);
+            tail_length = length;
+        }
+        else
+        {
+            size_t keep = tail_length + count > length ? length - count : tail_length;
+            memmove(tail, tail + tail_length - keep, keep);
+            memcpy(tail + keep, buffer, count);
+            tail_length = keep + count;
+        }
+
+        if (tail_length == length && memcmp(tail, packet, length) == 0)
+        {
+            return total;
+        }
+    }
+}
+
+/**
+ * Fills @param packet with @param size bytes: a token unique to this connection and
+ * request, padding and a newline
+ */
+static void build_packet(char *packet, size_t size, int id, uint64_t request)
+{
+    int length = snprintf(packet, size, "loadgen-%d-%llu-", id, (unsigned long long)request);
+    if ((size_t)length >= size)
+    {
+        length = size - 1;
+    }
+    memset(packet + length, 'x', size - 1 - length);
+    packet[size - 1] = '\n';
+}
+
+static uint64_t xorshift64(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static void *loadgen_thread(void *data)
+{
+    struct loadgen_thread_s *thread = (struct loadgen_thread_s *)data;
+    const struct loadgen_config_s *config = thread->config;
+    char *packet = malloc(config->max_size);
+    char *tail = malloc(config->max_size);
+    char *buffer = malloc(LOADGEN_RECV_SIZE);
+    char seek[64];
+    int seek_length = snprintf(seek, sizeof(seek), "AESDCHAR_IOCSEEKTO:%u,%u\n", config->seek_cmd, config->seek_offset);
+    uint64_t random_state = 0x9e3779b97f4a7c15ull * (thread->id + 1);
+
+    pthread_barrier_wait(&start_barrier);
+    if (packet == NULL || tail == NULL || buffer == NULL)
+    {
+        thread->error = "out of memory";
+        thread->errors++;
+        goto out;
+    }
+
+    uint64_t end_time = config->requests == 0 ? start_time + (uint64_t)(config->duration * 1e9) : UINT64_MAX;
+    // Spread the connections over the first interval when running at a fixed rate
+    uint64_t interval = config->rate > 0 ? (uint64_t)(1e9 / config->rate) : 0;
+    uint64_t next_send = start_time + interval * thread->id / config->connections;
+
+    for (uint64_t request = 0; config->requests == 0 || request < (uint64_t)config->requests; request++)
+    {
+        size_t size = config->min_size;
+        if (config->max_size > config->min_size)
+        {
+            size += xorshift64(&random_state) % (config->max_size - config->min_size + 1);
+        }
+        build_packet(packet, size, thread->id, request);
+        bool seeking = config->seek_every > 0 && (request + 1) % config->seek_every == 0;
+
+        // At a fixed rate latency counts from the intended send time, so a slow
+        // response also charges the requests it delayed
+        uint64_t started;
+        if (interval > 0)
+        {
+            sleep_until_ns(next_send);
+            started = next_send;
+            next_send += interval;
+        }
+        else
+        {
+            started = now_ns();
+        }
+        if (started >= end_time)
+        {
+            break;
+        }
+
+        // A seek response has no end marker, so a regular packet follows it and the
+        // pair completes when that packet comes back
+        if ((seeking && send_all(thread->sock, seek, seek_length) != 0) ||
+            send_all(thread->sock, packet, size) != 0)
+        {
+            thread->error = "send failed";
+            thread->errors++;
+            break;
+        }
+        ssize_t received = receive_response(thread->sock, packet, size, tail, buffer);
+        if (received < 0)
+        {
+            thread->error = "connection closed before the packet was echoed";
+            thread->errors++;
+            break;
+        }
+        hdr_record(thread->histogram, now_ns() - started);
+
+        thread->requests++;
+        thread->seeks += seeking;
+        thread->bytes_sent += size + (seeking ? seek_length : 0);
+        thread->bytes_received += received;
+    }
+
+out:
+    free(packet);
+    free(tail);
+    free(buffer);
+    return NULL;
+}
+
+/**
+ * Parses "min" or "min-max" packet sizes into @param config
+ * @return 0 on success, -1 if they are invalid
+ */
+static int parse_sizes(const char *arg, struct loadgen_config_s *config)
+{
+    char *end;
+    config->min_size = strtoul(arg, &end, 10);
+    config->max_size = config->min_size;
+    if (*end == '-')
+    {
+        config->max_size = strtoul(end + 1, &end, 10);
+    }
+    return *end == '\0' && config->min_size > 0 && config->max_size >= config->min_size &&
+                   config->max_size <= LOADGEN_MAX_PACKET
+               ? 0
+               : -1;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-h host] [-p port] [-c connections] [-n requests | -t seconds] [-s size[-max]]\n"
+                    "       [-r rate] [-k every] [-x cmd,offset] [-o file] [-P pid]\n", name);
+    fprintf(stderr, "  -h host        server to connect to (default: 127.0.0.1)\n");
+    fprintf(stderr, "  -p port        server port (default: " LOADGEN_DEFAULT_PORT ")\n");
+    fprintf(stderr, "  -c connections concurrent connections, one thread each (default: 1)\n");
+    fprintf(stderr, "  -n requests    requests per connection (default: 1000)\n");
+    fprintf(stderr, "  -t seconds     run for a duration instead of a request count\n");
+    fprintf(stderr, "  -s size[-max]  packet size in bytes including the newline, or a range to pick\n");
+    fprintf(stderr, "                 sizes uniformly from (default: 64)\n");
+    fprintf(stderr, "  -r rate        requests per second per connection (default: as fast as the\n");
+    fprintf(stderr, "                 responses arrive), latency then counts from the intended send time\n");
+    fprintf(stderr, "  -k every       precede every n-th packet with a seek command (default: never)\n");
+    fprintf(stderr, "  -x cmd,offset  arguments of the seek command (default: 0,0)\n");
+    fprintf(stderr, "  -o file        write the latency percentile distribution in HdrHistogram format\n");
+    fprintf(stderr, "  -P pid         report the CPU time of the server process pid per MB received\n");
+}
+
+static int parse_arguments(int argc, char **argv, struct loadgen_config_s *config)
+{
+    config->host = "127.0.0.1";
+    config->port = LOADGEN_DEFAULT_PORT;
+    config->connections = 1;
+    config->requests = 1000;
+    config->duration = 0;
+    config->min_size = 64;
+    config->max_size = 64;
+    config->rate = 0;
+    config->seek_every = 0;
+    config->seek_cmd = 0;
+    config->seek_offset = 0;
+    config->distribution_file = NULL;
+    config->server_pid = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:n:t:s:r:k:x:o:P:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'h':
+            config->host = optarg;
+            break;
+        case 'p':
+            config->port = optarg;
+            break;
+        case 'c':
+            config->connections = atoi(optarg);
+            if (config->connections <= 0)
+            {
+                return -1;
+            }
+            break;
+        case 'n':
+            config->requests = atol(optarg);
+            if (config->requests <= 0)
+            {
+                return -1;
+            }
+            break;
+        case 't':
+            config->duration = atof(optarg);
+            config->requests = 0;
+            if (config->duration <= 0)
+            {
+                return -1;
+            }
+            break;
+        case 's':
+            if (parse_sizes(optarg, config) != 0)
+            {
+                return -1;
+            }
+            break;
+        case 'r':
+            config->rate = atof(optarg);
+            if (config->rate < 0)
+            {
+                return -1;
+            }
+            break;
+        case 'k':
+            config->seek_every = atol(optarg);
+            if (config->seek_every < 0)
+            {
+                return -1;
+            }
+            break;
+        case 'x':
+            if (sscanf(optarg, "%u,%u", &config->seek_cmd, &config->seek_offset) != 2)
+            {
+                return -1;
+            }
+            break;
+        case 'o':
+            config->distribution_file = optarg;
+            break;
+        case 'P':
+            config->server_pid = atoi(optarg);
+            if (config->server_pid <= 0)
+            {
+                return -1;
+            }
+            break;
+        default:
+            return -1;
+        }
+    }
+    return optind == argc ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+    struct loadgen_config_s config;
+    if (parse_arguments(argc, argv, &config) != 0)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    struct loadgen_thread_s *threads = calloc(config.connections, sizeof(struct loadgen_thread_s));
+    // Zeroed pages are only touched for the buckets a thread records into
+    struct hdr_histogram_s *histograms = calloc(config.connections + 1, sizeof(struct hdr_histogram_s));
+    if (threads == NULL || histograms == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    // Connect everything first so connection setup is not measured
+    for (int i = 0; i < config.connections; i++)
+    {
+        threads[i].id = i;
+        threads[i].config = &config;
+        threads[i].histogram = &histograms[i + 1];
+        threads[i].sock = loadgen_connect(&config);
+        if (threads[i].sock == -1)
+        {
+            return 1;
+        }
+    }
+
+    pthread_barrier_init(&start_barrier, NULL, config.connections + 1);
+    for (int i = 0; i < config.connections; i++)
+    {
+        if (pthread_create(&threads[i].thread, NULL, loadgen_thread, &threads[i]) != 0)
+        {
+            fprintf(stderr, "Failed to create thread %d\n", i);
+            return 1;
+        }
+    }
+    double server_cpu_start = config.server_pid > 0 ? process_cpu_seconds(config.server_pid) : -1;
+    double self_cpu_start = self_cpu_seconds();
+    start_time = now_ns() + 1000000;
+    pthread_barrier_wait(&start_barrier);
+
+    struct hdr_histogram_s *total = &histograms[0];
+    uint64_t requests = 0, seeks = 0, errors = 0, bytes_sent = 0, bytes_received = 0;
+    for (int i = 0; i < config.connections; i++)
+    {
+        pthread_join(threads[i].thread, NULL);
+        close(threads[i].sock);
+        if (threads[i].error != NULL)
+        {
+            fprintf(stderr, "Connection %d: %s after %llu requests\n", i, threads[i].error,
+                    (unsigned long long)threads[i].requests);
+        }
+        hdr_merge(total, threads[i].histogram);
+        requests += threads[i].requests;
+        seeks += threads[i].seeks;
+        errors += threads[i].errors;
+        bytes_sent += threads[i].bytes_sent;
+        bytes_received += threads[i].bytes_received;
+    }
+    double elapsed = (now_ns() - start_time) / 1e9;
+    double server_cpu_end = config.server_pid > 0 ? process_cpu_seconds(config.server_pid) : -1;
+    double self_cpu = self_cpu_seconds() - self_cpu_start;
+
+    printf("connections %d, requests %llu (%llu with seek), errors %llu, elapsed %.3f s\n", config.connections,
+           (unsigned long long)requests, (unsigned long long)seeks, (unsigned long long)errors, elapsed);
+    printf("throughput %.0f req/s, sent %.2f MB/s, received %.2f MB/s\n", requests / elapsed,
+           bytes_sent / elapsed / 1e6, bytes_received / elapsed / 1e6);
+    if (total->total > 0)
+    {
+        printf("latency us: min %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f p99.99 %.1f max %.1f mean %.1f\n",
+               total->min / 1e3, hdr_percentile(total, 50) / 1e3, hdr_percentile(total, 90) / 1e3,
+               hdr_percentile(total, 99) / 1e3, hdr_percentile(total, 99.9) / 1e3,
+               hdr_percentile(total, 99.99) / 1e3, total->max / 1e3, total->sum / total->total / 1e3);
+    }
+    double megabytes = bytes_received / 1e6;
+    if (server_cpu_start >= 0 && server_cpu_end >= 0)
+    {
+        double server_cpu = server_cpu_end - server_cpu_start;
+        printf("cpu: server %.3f s (%.1f%%, %.3f ms/MB received), loadgen %.3f s\n", server_cpu,
+               server_cpu / elapsed * 100, megabytes > 0 ? server_cpu * 1e3 / megabytes : 0, self_cpu);
+    }
+    else if (config.server_pid > 0)
+    {
+        fprintf(stderr, "Failed to read the CPU time of process %d\n", (int)config.server_pid);
+    }
+    if (config.distribution_file != NULL && hdr_write_distribution(total, config.distribution_file) != 0)
+    {
+        errors++;
+    }
+
+    pthread_barrier_destroy(&start_barrier);
+    free(histograms);
+    free(threads);
+    return errors == 0 ? 0 : 1;
+}
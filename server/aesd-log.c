@@ -0,0 +1,330 @@
+/**
+ * @file aesd-log.c
+ * @brief Segmented, memory-mapped storage for the aesdsocket data
+ *
+ * One range of address space is reserved up front and every segment file is mapped
+ * into its slot of it, so appending is a memcpy into the mapped tail and a queued
+ * response is sent straight from the mapped pages, contiguous across segment
+ * boundaries. Nothing is read into intermediate buffers and no file descriptor is
+ * touched after a segment is created.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/mman.h>
+
+#include "aesd-log.h"
+#include "aesd-logger.h"
+
+static size_t segment_log_total(const struct segment_log_s *log)
+{
+    return log->slot_count * log->segment_size;
+}
+
+static void segment_log_segment_path(const struct segment_log_s *log, uint64_t segment, char *path, size_t size)
+{
+    snprintf(path, size, "%s.%llu", log->path, (unsigned long long)segment);
+}
+
+static char *segment_log_slot_address(const struct segment_log_s *log, uint64_t segment)
+{
+    return log->base + (segment % log->slot_count) * log->segment_size;
+}
+
+/**
+ * Replaces the mapping of the segment in @param slot with reserved address space
+ */
+static void segment_log_unmap(struct segment_log_s *log, struct segment_log_slot_s *slot)
+{
+    if (mmap(segment_log_slot_address(log, slot->segment), log->segment_size, PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED)
+    {
+        logger_log(LOG_ERR, "Failed to unmap log segment: %s", strerror(errno));
+    }
+    slot->mapped = false;
+}
+
+/**
+ * Creates segment @param segment and maps it into its slot. Its blocks are allocated
+ * before it is mapped, so a full disk fails here rather than with SIGBUS on a later
+ * store into the mapping.
+ * The caller must hold the log mutex.
+ * @return 0 on success, -1 on error (already logged)
+ */
+static int segment_log_map(struct segment_log_s *log, uint64_t segment)
+{
+    struct segment_log_slot_s *slot = &log->slots[segment % log->slot_count];
+    if (slot->mapped)
+    {
+        if (slot->pins > 0)
+        {
+            logger_log(LOG_ERR, "Log segment %llu is still in use, the log cannot wrap onto it",
+                   (unsigned long long)slot->segment);
+            return -1;
+        }
+        segment_log_unmap(log, slot);
+    }
+
+    char path[PATH_MAX];
+    segment_log_segment_path(log, segment, path, sizeof(path));
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        logger_log(LOG_ERR, "Failed to open log segment: %s, %s", path, strerror(errno));
+        return -1;
+    }
+    int error = posix_fallocate(fd, 0, log->segment_size);
+    if (error != 0)
+    {
+        logger_log(LOG_ERR, "Failed to allocate log segment: %s, %s", path, strerror(error));
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    if (mmap(segment_log_slot_address(log, segment), log->segment_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        logger_log(LOG_ERR, "Failed to map log segment: %s, %s", path, strerror(errno));
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    // The mapping keeps the file open
+    close(fd);
+
+    slot->segment = segment;
+    slot->pins = 0;
+    slot->mapped = true;
+    slot->retired = false;
+    return 0;
+}
+
+/**
+ * Deletes the oldest segment, unmapping it once nothing uses it.
+ * The caller must hold the log mutex.
+ */
+static void segment_log_retire(struct segment_log_s *log)
+{
+    struct segment_log_slot_s *slot = &log->slots[log->first_segment % log->slot_count];
+    char path[PATH_MAX];
+
+    segment_log_segment_path(log, log->first_segment, path, sizeof(path));
+    unlink(path);
+    slot->retired = true;
+    if (slot->pins == 0)
+    {
+        segment_log_unmap(log, slot);
+    }
+    log->first_segment++;
+}
+
+int segment_log_init(struct segment_log_s *log, const char *path, size_t segment_size, size_t retain_segments)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+
+    memset(log, 0, sizeof(struct segment_log_s));
+    if (segment_size == 0 || segment_size % page_size != 0 || segment_size > SEGMENT_LOG_RESERVATION / 2)
+    {
+        logger_log(LOG_ERR, "Log segment size must be a multiple of %zu bytes", page_size);
+        return -1;
+    }
+    log->path = path;
+    log->segment_size = segment_size;
+    log->slot_count = SEGMENT_LOG_RESERVATION / segment_size;
+    if (log->slot_count > SEGMENT_LOG_MAX_SLOTS)
+    {
+        log->slot_count = SEGMENT_LOG_MAX_SLOTS;
+    }
+    // A slot is only reused once the segment in it has been retired
+    log->retain_segments = log->slot_count - 1;
+    if (retain_segments > 0 && retain_segments < log->retain_segments)
+    {
+        log->retain_segments = retain_segments;
+    }
+
+    log->slots = calloc(log->slot_count, sizeof(struct segment_log_slot_s));
+    if (log->slots == NULL)
+    {
+        logger_log(LOG_ERR, "Failed to allocate memory for log segments");
+        return -1;
+    }
+    log->base = mmap(NULL, segment_log_total(log), PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (log->base == MAP_FAILED)
+    {
+        logger_log(LOG_ERR, "Failed to reserve log address space: %s", strerror(errno));
+        free(log->slots);
+        return -1;
+    }
+    pthread_mutex_init(&log->mutex, NULL);
+    return 0;
+}
+
+/**
+ * @return the first segment kept once the log reaches offset @param end.
+ * The caller must hold the log mutex.
+ */
+static uint64_t segment_log_first_kept(struct segment_log_s *log, off_t end)
+{
+    uint64_t end_segment = end > 0 ? (end - 1) / log->segment_size + 1 : 0;
+    if (end_segment < log->end_segment)
+    {
+        end_segment = log->end_segment;
+    }
+    uint64_t first = end_segment > log->retain_segments ? end_segment - log->retain_segments : 0;
+    return first > log->first_segment ? first : log->first_segment;
+}
+
+off_t segment_log_retained_from(struct segment_log_s *log, off_t end)
+{
+    pthread_mutex_lock(&log->mutex);
+    uint64_t first = segment_log_first_kept(log, end);
+    pthread_mutex_unlock(&log->mutex);
+    return first * log->segment_size;
+}
+
+/**
+ * Adds a pin to each segment holding [@param start, @param end).
+ * The caller must hold the log mutex.
+ */
+static void segment_log_pin_locked(struct segment_log_s *log, off_t start, off_t end)
+{
+    for (uint64_t segment = start / log->segment_size; start < end && segment <= (end - 1) / log->segment_size;
+         segment++)
+    {
+        log->slots[segment % log->slot_count].pins++;
+    }
+}
+
+int segment_log_extend(struct segment_log_s *log, off_t start, off_t end)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&log->mutex);
+    uint64_t first = segment_log_first_kept(log, end);
+    if (start < end && (uint64_t)start / log->segment_size < first)
+    {
+        logger_log(LOG_ERR, "Record of %lld bytes does not fit in the retained log", (long long)(end - start));
+        ret = -1;
+    }
+    // Retire first, a new segment may reuse the slot of the oldest one. The range
+    // starts in an existing segment or right after the newest, so no retired segment
+    // is one still to be created.
+    while (ret == 0 && log->first_segment < first)
+    {
+        segment_log_retire(log);
+    }
+    while (ret == 0 && (off_t)(log->end_segment * log->segment_size) < end)
+    {
+        ret = segment_log_map(log, log->end_segment);
+        if (ret == 0)
+        {
+            log->end_segment++;
+        }
+    }
+    if (ret == 0)
+    {
+        segment_log_pin_locked(log, start, end);
+    }
+    pthread_mutex_unlock(&log->mutex);
+    return ret;
+}
+
+int segment_log_pin(struct segment_log_s *log, off_t start, off_t end)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&log->mutex);
+    if (start < end && (uint64_t)start / log->segment_size < log->first_segment)
+    {
+        ret = -1;
+    }
+    else
+    {
+        segment_log_pin_locked(log, start, end);
+    }
+    pthread_mutex_unlock(&log->mutex);
+    return ret;
+}
+
+void segment_log_unpin(struct segment_log_s *log, off_t start, off_t end)
+{
+    pthread_mutex_lock(&log->mutex);
+    for (uint64_t segment = start / log->segment_size; start < end && segment <= (end - 1) / log->segment_size;
+         segment++)
+    {
+        struct segment_log_slot_s *slot = &log->slots[segment % log->slot_count];
+        slot->pins--;
+        if (slot->pins == 0 && slot->retired && slot->mapped)
+        {
+            segment_log_unmap(log, slot);
+        }
+    }
+    pthread_mutex_unlock(&log->mutex);
+}
+
+void segment_log_write(struct segment_log_s *log, off_t offset, const struct iovec *iov, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        const char *data = iov[i].iov_base;
+        size_t remaining = iov[i].iov_len;
+        while (remaining > 0)
+        {
+            size_t contiguous;
+            char *target = (char *)segment_log_data(log, offset, &contiguous);
+            size_t length = remaining < contiguous ? remaining : contiguous;
+            memcpy(target, data, length);
+            data += length;
+            offset += length;
+            remaining -= length;
+        }
+    }
+}
+
+const char *segment_log_data(struct segment_log_s *log, off_t offset, size_t *contiguous)
+{
+    size_t position = offset % segment_log_total(log);
+    *contiguous = segment_log_total(log) - position;
+    return log->base + position;
+}
+
+int segment_log_sync(struct segment_log_s *log, off_t start, off_t end)
+{
+    // Segments are page aligned, so rounding down stays in the pinned segment
+    start -= start % sysconf(_SC_PAGESIZE);
+    while (start < end)
+    {
+        size_t contiguous;
+        char *address = (char *)segment_log_data(log, start, &contiguous);
+        size_t length = (size_t)(end - start) < contiguous ? (size_t)(end - start) : contiguous;
+        if (msync(address, length, MS_SYNC) == -1)
+        {
+            logger_log(LOG_ERR, "Failed to sync log: %s", strerror(errno));
+            return -1;
+        }
+        start += length;
+    }
+    return 0;
+}
+
+void segment_log_destroy(struct segment_log_s *log)
+{
+    char path[PATH_MAX];
+
+    for (uint64_t segment = log->first_segment; segment < log->end_segment; segment++)
+    {
+        segment_log_segment_path(log, segment, path, sizeof(path));
+        unlink(path);
+    }
+    munmap(log->base, segment_log_total(log));
+    free(log->slots);
+    pthread_mutex_destroy(&log->mutex);
+    memset(log, 0, sizeof(struct segment_log_s));
+}
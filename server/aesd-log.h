@@ -0,0 +1,122 @@
+/*
+ * aesd-log.h
+ *
+ *  Segmented, memory-mapped storage for the aesdsocket data, with retention of a
+ *  bounded number of segments
+ */
+
+#ifndef AESD_LOG_H
+#define AESD_LOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * Address space reserved for the mapped segments, which the log wraps around.
+ * A 32-bit process has a few GB in all.
+ */
+#if UINTPTR_MAX > 0xffffffffUL
+#define SEGMENT_LOG_RESERVATION ((size_t)1 << 40)
+#else
+#define SEGMENT_LOG_RESERVATION ((size_t)1 << 30)
+#endif
+#define SEGMENT_LOG_MAX_SLOTS 65536
+
+struct segment_log_slot_s
+{
+    /**
+     * Segment number mapped in this slot
+     */
+    uint64_t segment;
+    /**
+     * Writers and queued responses using the segment, it stays mapped while any remain
+     */
+    unsigned int pins;
+    bool mapped;
+    bool retired;
+};
+
+/**
+ * Log offsets count every byte ever appended. Segment n holds offsets
+ * [n * segment_size, (n + 1) * segment_size) in the file <path>.<n>, mapped at
+ * base + (n % slot_count) * segment_size, so the mappings of consecutive segments
+ * are adjacent except where the reservation wraps around.
+ *
+ * Segments are created as appends reach them. Once more than retain_segments exist
+ * the oldest are retired: their files are unlinked at once and unmapped when the
+ * last pin is released.
+ */
+struct segment_log_s
+{
+    const char *path;
+    size_t segment_size;
+    size_t slot_count;
+    size_t retain_segments;
+    char *base;
+    pthread_mutex_t mutex;
+    struct segment_log_slot_s *slots;
+    /**
+     * Oldest segment not retired and one past the newest segment
+     */
+    uint64_t first_segment;
+    uint64_t end_segment;
+};
+
+/**
+ * Initializes @param log with segments of @param segment_size bytes, a multiple of
+ * the page size, in files named after @param path. At most @param retain_segments
+ * segments are kept, 0 for as many as the reservation holds.
+ * @return 0 on success, -1 on error (already logged)
+ */
+int segment_log_init(struct segment_log_s *log, const char *path, size_t segment_size, size_t retain_segments);
+
+/**
+ * @return the first offset still stored once the log is extended to @param end
+ */
+off_t segment_log_retained_from(struct segment_log_s *log, off_t end);
+
+/**
+ * Creates the segments up to offset @param end, retiring the oldest ones beyond the
+ * retention limit, and pins [@param start, @param end) for writing
+ * @return 0 on success, -1 on error (already logged)
+ */
+int segment_log_extend(struct segment_log_s *log, off_t start, off_t end);
+
+/**
+ * Pins the segments holding [@param start, @param end) so they stay mapped
+ * @return 0 on success, -1 if part of the range has been retired
+ */
+int segment_log_pin(struct segment_log_s *log, off_t start, off_t end);
+
+/**
+ * Releases a pin taken by segment_log_pin or segment_log_extend
+ */
+void segment_log_unpin(struct segment_log_s *log, off_t start, off_t end);
+
+/**
+ * Copies the @param count buffers in @param iov to the pinned log at @param offset
+ */
+void segment_log_write(struct segment_log_s *log, off_t offset, const struct iovec *iov, int count);
+
+/**
+ * @return the mapped address of pinned @param offset, with @param contiguous set to
+ * the number of bytes mapped contiguously from it
+ */
+const char *segment_log_data(struct segment_log_s *log, off_t offset, size_t *contiguous);
+
+/**
+ * Writes pinned [@param start, @param end) back to the segment files and waits for it
+ * @return 0 on success, -1 on error (already logged)
+ */
+int segment_log_sync(struct segment_log_s *log, off_t start, off_t end);
+
+/**
+ * Unmaps the log and deletes all its segment files
+ */
+void segment_log_destroy(struct segment_log_s *log);
+
+#endif /* AESD_LOG_H */
@@ -0,0 +1,297 @@
+/**
+ * @file aesd-logger.c
+ * @brief Asynchronous logging for aesdsocket
+ *
+ * syslog() formats and sends the record under a process-wide lock, on a socket
+ * that blocks when the log daemon falls behind, and it was called on accept,
+ * close and error paths, some with the data file mutex held. Records now go to a
+ * bounded multi-producer ring: a producer claims a slot with one compare-and-swap
+ * on the tail, formats its record into the slot and publishes it through the
+ * slot's sequence number. The single drainer writes published records in order,
+ * at most the configured rate per second, and reports what it had to drop. A
+ * producer finding the ring full drops its record instead of waiting, and only
+ * wakes the drainer through an eventfd when it sleeps.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "aesdsocket.h"
+#include "aesd-logger.h"
+#include "aesd-metrics.h"
+
+// How often the drainer reports dropped records, in ns
+#define LOGGER_REPORT_INTERVAL 1000000000ULL
+
+struct logger_record_s
+{
+    /**
+     * Position the slot is free for, or that position + 1 once its record is
+     * published, accessed atomically
+     */
+    size_t sequence;
+    int priority;
+    char text[LOGGER_RECORD_SIZE];
+};
+
+static struct logger_record_s logger_ring[LOGGER_RING_RECORDS];
+/**
+ * Next position to claim, accessed atomically, and next to drain, by the drainer only
+ */
+static size_t logger_tail;
+static size_t logger_head;
+/**
+ * Records dropped with the ring full, accessed atomically
+ */
+static uint64_t logger_dropped;
+
+static enum logger_target_e logger_target = LOGGER_SYSLOG;
+static unsigned int logger_rate = LOGGER_DEFAULT_RATE;
+static int logger_event_fd = -1;
+static pthread_t logger_thread;
+/**
+ * Records go through the ring, accessed atomically
+ */
+static bool logger_running;
+/**
+ * The drainer waits on the eventfd, accessed atomically
+ */
+static bool logger_sleeping;
+static bool logger_stopping;
+
+/**
+ * Writes @param text to the target
+ */
+static void logger_write(int priority, const char *text)
+{
+    if (logger_target == LOGGER_SYSLOG)
+    {
+        syslog(priority, "%s", text);
+        return;
+    }
+    char line[LOGGER_RECORD_SIZE + sizeof(TAG) + 4];
+    int length = snprintf(line, sizeof(line), TAG ": %s\n", text);
+    if (length > (int)sizeof(line) - 1)
+    {
+        length = sizeof(line) - 1;
+        line[length - 1] = '\n';
+    }
+    if (write(STDERR_FILENO, line, length) == -1)
+    {
+        // Nowhere left to report it
+    }
+}
+
+void logger_configure(enum logger_target_e target, unsigned int rate)
+{
+    logger_target = target;
+    logger_rate = rate;
+}
+
+/**
+ * Writes a summary of the records dropped since the last one, if any
+ */
+static void logger_report(uint64_t *reported_dropped, uint64_t suppressed)
+{
+    uint64_t dropped = __atomic_load_n(&logger_dropped, __ATOMIC_RELAXED);
+    if (dropped == *reported_dropped && suppressed == 0)
+    {
+        return;
+    }
+    char text[LOGGER_RECORD_SIZE];
+    snprintf(text, sizeof(text), "Dropped %llu log records with the ring full, %llu over the rate limit",
+             (unsigned long long)(dropped - *reported_dropped), (unsigned long long)suppressed);
+    logger_write(LOG_WARNING, text);
+    metrics_add(METRICS_LOG_DROPPED, dropped - *reported_dropped);
+    metrics_add(METRICS_LOG_SUPPRESSED, suppressed);
+    *reported_dropped = dropped;
+}
+
+/**
+ * Drainer thread, writes published records until logger_stop
+ */
+static void *logger_drainer(void *arg)
+{
+    uint64_t tokens = logger_rate;
+    uint64_t refilled = metrics_now();
+    uint64_t reported = refilled;
+    uint64_t reported_dropped = 0;
+    uint64_t suppressed = 0;
+
+    while (true)
+    {
+        struct logger_record_s *record = &logger_ring[logger_head & (LOGGER_RING_RECORDS - 1)];
+        uint64_t now;
+        if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) == logger_head + 1)
+        {
+            if (logger_rate != 0 && tokens == 0)
+            {
+                // Whole tokens only, the remainder of the interval carries over
+                now = metrics_now();
+                tokens = (now - refilled) * logger_rate / 1000000000ULL;
+                if (tokens > 0)
+                {
+                    tokens = tokens < logger_rate ? tokens : logger_rate;
+                    refilled = now;
+                }
+            }
+            if (logger_rate == 0 || tokens > 0)
+            {
+                logger_write(record->priority, record->text);
+                tokens -= logger_rate != 0;
+            }
+            else
+            {
+                suppressed++;
+            }
+            __atomic_store_n(&record->sequence, logger_head + LOGGER_RING_RECORDS, __ATOMIC_RELEASE);
+            logger_head++;
+            continue;
+        }
+
+        now = metrics_now();
+        bool stopping = __atomic_load_n(&logger_stopping, __ATOMIC_ACQUIRE);
+        if (now - reported >= LOGGER_REPORT_INTERVAL || stopping)
+        {
+            logger_report(&reported_dropped, suppressed);
+            suppressed = 0;
+            reported = now;
+        }
+        if (stopping)
+        {
+            break;
+        }
+
+        // Producers wake the drainer only once it has said it sleeps, so check again after
+        __atomic_store_n(&logger_sleeping, true, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&record->sequence, __ATOMIC_SEQ_CST) == logger_head + 1)
+        {
+            __atomic_store_n(&logger_sleeping, false, __ATOMIC_RELAXED);
+            continue;
+        }
+        bool pending = suppressed > 0 || __atomic_load_n(&logger_dropped, __ATOMIC_RELAXED) != reported_dropped;
+        struct pollfd poll_fd = {logger_event_fd, POLLIN, 0};
+        if (poll(&poll_fd, 1, pending ? LOGGER_REPORT_INTERVAL / 1000000 : -1) > 0)
+        {
+            uint64_t value;
+            if (read(logger_event_fd, &value, sizeof(value)) == -1)
+            {
+                // Already drained by an earlier wakeup
+            }
+        }
+        __atomic_store_n(&logger_sleeping, false, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+int logger_start(void)
+{
+    for (size_t i = 0; i < LOGGER_RING_RECORDS; i++)
+    {
+        logger_ring[i].sequence = i;
+    }
+    logger_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (logger_event_fd == -1)
+    {
+        logger_log(LOG_ERR, "Failed to create log eventfd: %s", strerror(errno));
+        return -1;
+    }
+    if (0 != pthread_create(&logger_thread, 0, logger_drainer, NULL))
+    {
+        close(logger_event_fd);
+        logger_event_fd = -1;
+        logger_log(LOG_ERR, "Failed to create log drainer thread");
+        return -1;
+    }
+    __atomic_store_n(&logger_running, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void logger_log(int priority, const char *format, ...)
+{
+    int saved_errno = errno;
+    va_list args;
+    va_start(args, format);
+
+    if (!__atomic_load_n(&logger_running, __ATOMIC_ACQUIRE))
+    {
+        char text[LOGGER_RECORD_SIZE];
+        vsnprintf(text, sizeof(text), format, args);
+        va_end(args);
+        logger_write(priority, text);
+        errno = saved_errno;
+        return;
+    }
+
+    size_t position = __atomic_load_n(&logger_tail, __ATOMIC_RELAXED);
+    struct logger_record_s *record;
+    while (true)
+    {
+        record = &logger_ring[position & (LOGGER_RING_RECORDS - 1)];
+        size_t sequence = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+        if (difference == 0)
+        {
+            if (__atomic_compare_exchange_n(&logger_tail, &position, position + 1, true, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (difference < 0)
+        {
+            // The drainer has not freed the slot from the previous lap
+            __atomic_add_fetch(&logger_dropped, 1, __ATOMIC_RELAXED);
+            va_end(args);
+            errno = saved_errno;
+            return;
+        }
+        else
+        {
+            position = __atomic_load_n(&logger_tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    record->priority = priority;
+    vsnprintf(record->text, sizeof(record->text), format, args);
+    va_end(args);
+    __atomic_store_n(&record->sequence, position + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&logger_sleeping, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&logger_sleeping, false, __ATOMIC_ACQ_REL))
+    {
+        uint64_t one = 1;
+        if (write(logger_event_fd, &one, sizeof(one)) == -1)
+        {
+            // The counter is already set, the drainer wakes anyway
+        }
+    }
+    errno = saved_errno;
+}
+
+void logger_stop(void)
+{
+    if (!__atomic_load_n(&logger_running, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+    __atomic_store_n(&logger_stopping, true, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    if (write(logger_event_fd, &one, sizeof(one)) == -1)
+    {
+        // The counter is already set, the drainer wakes anyway
+    }
+    pthread_join(logger_thread, NULL);
+    __atomic_store_n(&logger_running, false, __ATOMIC_RELEASE);
+    close(logger_event_fd);
+    logger_event_fd = -1;
+}
@@ -0,0 +1,52 @@
+/*
+ * aesd-logger.h
+ *
+ *  Asynchronous logging for aesdsocket: records are formatted by the calling thread
+ *  into a lock-free ring and written to syslog or stderr by a drainer thread, so a
+ *  connection never waits for the log
+ */
+
+#ifndef AESD_LOGGER_H
+#define AESD_LOGGER_H
+
+#include <syslog.h>
+
+// Records held by the ring, a power of two
+#define LOGGER_RING_RECORDS 1024
+// Longest record text, longer ones are truncated
+#define LOGGER_RECORD_SIZE 240
+#define LOGGER_DEFAULT_RATE 1000
+
+enum logger_target_e
+{
+    LOGGER_SYSLOG,
+    LOGGER_STDERR,
+};
+
+/**
+ * Selects where records go and how many records per second the drainer writes at
+ * most, 0 for no limit. Until logger_start, and again after logger_stop, records
+ * are written by the calling thread.
+ */
+void logger_configure(enum logger_target_e target, unsigned int rate);
+
+/**
+ * Starts the drainer thread. Must be called after control_init and after the
+ * process has daemonized.
+ * @return 0 on success, -1 on error (logged, records are then written directly)
+ */
+int logger_start(void);
+
+/**
+ * Logs a record with syslog @param priority. Never blocks once the drainer runs: a
+ * record that finds the ring full is dropped and counted. Keeps errno.
+ */
+void logger_log(int priority, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * Writes every record still in the ring and stops the drainer, once no other
+ * thread logs any more
+ */
+void logger_stop(void);
+
+#endif /* AESD_LOGGER_H */
@@ -0,0 +1,400 @@
+/**
+ * @file aesd-metrics.c
+ * @brief Per-thread metrics for aesdsocket and their Prometheus endpoint
+ *
+ * Every thread updates its own shard without locking. The shards are kept on a
+ * registry list that is only locked when a thread starts or exits and when the
+ * metrics are scraped. The exporter sums the shards of the live threads with the
+ * totals folded in from exited ones.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "aesdsocket.h"
+#include "aesd-metrics.h"
+#include "aesd-pool.h"
+#include "aesd-control.h"
+#include "aesd-logger.h"
+
+#define METRICS_PREFIX "aesdsocket_"
+
+struct metrics_counter_info_s
+{
+    const char *name;
+    const char *help;
+};
+
+struct metrics_histogram_info_s
+{
+    const char *name;
+    const char *help;
+    /**
+     * Upper bound of the first bucket, in the unit values are recorded in
+     */
+    uint64_t base;
+    /**
+     * Factor converting recorded values to the exported unit
+     */
+    double scale;
+};
+
+static const struct metrics_counter_info_s metrics_counters[METRICS_COUNTERS] = {
+    [METRICS_CONNECTIONS_ACCEPTED] = {"connections_accepted_total", "Connections accepted"},
+    [METRICS_CONNECTIONS_CLOSED] = {"connections_closed_total", "Connections closed"},
+    [METRICS_BYTES_IN] = {"received_bytes_total", "Bytes received from clients"},
+    [METRICS_BYTES_OUT] = {"sent_bytes_total", "Bytes sent to clients"},
+    [METRICS_PACKETS] = {"packets_total", "Packets handled"},
+    [METRICS_RESPONSES_DROPPED] = {"responses_dropped_total", "Responses dropped at the send queue high-water mark"},
+    [METRICS_SLOW_DISCONNECTS] = {"slow_disconnects_total", "Connections closed at the send queue high-water mark"},
+    [METRICS_READ_PAUSES] = {"read_pauses_total", "Times reading paused at the send queue high-water mark"},
+    [METRICS_SYNCS] = {"syncs_total", "Syncs of the data file or log to stable storage"},
+    [METRICS_LOG_DROPPED] = {"log_records_dropped_total", "Log records dropped with the log ring full"},
+    [METRICS_LOG_SUPPRESSED] = {"log_records_suppressed_total", "Log records dropped over the log rate limit"},
+};
+
+static const struct metrics_histogram_info_s metrics_histograms[METRICS_HISTOGRAMS] = {
+    [METRICS_LOCK_WAIT] = {"lock_wait_seconds", "Time spent waiting for the data file mutex", 1000, 1e-9},
+    [METRICS_LOCK_HOLD] = {"lock_hold_seconds", "Time the data file mutex was held", 1000, 1e-9},
+    [METRICS_RESPONSE_LATENCY] = {"response_latency_seconds", "Time from a complete packet to its response", 1000,
+                                  1e-9},
+    [METRICS_REPLAY_SIZE] = {"replay_bytes", "Bytes of the data file sent in one response", 64, 1},
+    [METRICS_SYNC_WAIT] = {"sync_wait_seconds", "Time a response waited for its packet to be durable", 1000, 1e-9},
+};
+
+__thread struct metrics_shard_s *metrics_current_shard;
+
+static pthread_mutex_t metrics_registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics_shard_s *metrics_registry;
+/**
+ * Totals of the threads that have exited, protected by metrics_registry_mutex
+ */
+static struct metrics_shard_s metrics_retired;
+/**
+ * Used by threads whose shard could not be allocated, never exported
+ */
+static struct metrics_shard_s metrics_discard;
+
+static pthread_key_t metrics_key;
+static pthread_once_t metrics_key_once = PTHREAD_ONCE_INIT;
+
+static pthread_t metrics_server_thread;
+static bool metrics_server_started;
+static int metrics_server_sock = -1;
+static char metrics_server_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+static void metrics_shard_fold(struct metrics_shard_s *total, const struct metrics_shard_s *shard)
+{
+    for (int i = 0; i < METRICS_COUNTERS; i++)
+    {
+        total->counters[i] += __atomic_load_n(&shard->counters[i], __ATOMIC_RELAXED);
+    }
+    for (int i = 0; i < METRICS_HISTOGRAMS; i++)
+    {
+        for (int j = 0; j < METRICS_BUCKETS; j++)
+        {
+            total->histograms[i].buckets[j] += __atomic_load_n(&shard->histograms[i].buckets[j], __ATOMIC_RELAXED);
+        }
+        total->histograms[i].count += __atomic_load_n(&shard->histograms[i].count, __ATOMIC_RELAXED);
+        total->histograms[i].sum += __atomic_load_n(&shard->histograms[i].sum, __ATOMIC_RELAXED);
+    }
+}
+
+static void metrics_thread_exit(void *data)
+{
+    struct metrics_shard_s *shard = (struct metrics_shard_s *)data;
+
+    pthread_mutex_lock(&metrics_registry_mutex);
+    struct metrics_shard_s **link = &metrics_registry;
+    while (*link != shard)
+    {
+        link = &(*link)->next;
+    }
+    *link = shard->next;
+    metrics_shard_fold(&metrics_retired, shard);
+    pthread_mutex_unlock(&metrics_registry_mutex);
+    free(shard);
+}
+
+static void metrics_key_create(void)
+{
+    pthread_key_create(&metrics_key, metrics_thread_exit);
+}
+
+struct metrics_shard_s *metrics_thread_shard(void)
+{
+    pthread_once(&metrics_key_once, metrics_key_create);
+
+    struct metrics_shard_s *shard = calloc(1, sizeof(struct metrics_shard_s));
+    if (shard == NULL)
+    {
+        logger_log(LOG_ERR, "Failed to allocate memory for thread metrics");
+        metrics_current_shard = &metrics_discard;
+        return metrics_current_shard;
+    }
+
+    pthread_mutex_lock(&metrics_registry_mutex);
+    shard->next = metrics_registry;
+    metrics_registry = shard;
+    pthread_mutex_unlock(&metrics_registry_mutex);
+    pthread_setspecific(metrics_key, shard);
+    metrics_current_shard = shard;
+    return shard;
+}
+
+uint64_t metrics_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void metrics_observe(enum metrics_histogram_e histogram, uint64_t value)
+{
+    struct metrics_histogram_s *h = &metrics_shard()->histograms[histogram];
+    uint64_t bound = metrics_histograms[histogram].base;
+    int bucket = 0;
+
+    while (bucket < METRICS_BUCKETS - 1 && value > bound)
+    {
+        bound *= 4;
+        bucket++;
+    }
+    metrics_increment(&h->buckets[bucket], 1);
+    metrics_increment(&h->count, 1);
+    metrics_increment(&h->sum, value);
+}
+
+/**
+ * Writes the current metrics of every thread and pool to @param out
+ */
+static void metrics_write(FILE *out)
+{
+    struct metrics_shard_s total;
+
+    pthread_mutex_lock(&metrics_registry_mutex);
+    total = metrics_retired;
+    for (struct metrics_shard_s *shard = metrics_registry; shard != NULL; shard = shard->next)
+    {
+        metrics_shard_fold(&total, shard);
+    }
+    pthread_mutex_unlock(&metrics_registry_mutex);
+
+    for (int i = 0; i < METRICS_COUNTERS; i++)
+    {
+        fprintf(out, "# HELP " METRICS_PREFIX "%s %s\n", metrics_counters[i].name, metrics_counters[i].help);
+        fprintf(out, "# TYPE " METRICS_PREFIX "%s counter\n", metrics_counters[i].name);
+        fprintf(out, METRICS_PREFIX "%s %llu\n", metrics_counters[i].name, (unsigned long long)total.counters[i]);
+    }
+
+    uint64_t accepted = total.counters[METRICS_CONNECTIONS_ACCEPTED];
+    uint64_t closed = total.counters[METRICS_CONNECTIONS_CLOSED];
+    fprintf(out, "# HELP " METRICS_PREFIX "connections_active Connections currently open\n");
+    fprintf(out, "# TYPE " METRICS_PREFIX "connections_active gauge\n");
+    fprintf(out, METRICS_PREFIX "connections_active %llu\n",
+            (unsigned long long)(accepted > closed ? accepted - closed : 0));
+
+    for (int i = 0; i < METRICS_HISTOGRAMS; i++)
+    {
+        const struct metrics_histogram_info_s *info = &metrics_histograms[i];
+        const struct metrics_histogram_s *h = &total.histograms[i];
+        uint64_t cumulative = 0;
+        uint64_t bound = info->base;
+
+        fprintf(out, "# HELP " METRICS_PREFIX "%s %s\n", info->name, info->help);
+        fprintf(out, "# TYPE " METRICS_PREFIX "%s histogram\n", info->name);
+        for (int j = 0; j < METRICS_BUCKETS - 1; j++, bound *= 4)
+        {
+            cumulative += h->buckets[j];
+            fprintf(out, METRICS_PREFIX "%s_bucket{le=\"%.9g\"} %llu\n", info->name, bound * info->scale,
+                    (unsigned long long)cumulative);
+        }
+        cumulative += h->buckets[METRICS_BUCKETS - 1];
+        fprintf(out, METRICS_PREFIX "%s_bucket{le=\"+Inf\"} %llu\n", info->name, (unsigned long long)cumulative);
+        fprintf(out, METRICS_PREFIX "%s_sum %.9g\n", info->name, h->sum * info->scale);
+        fprintf(out, METRICS_PREFIX "%s_count %llu\n", info->name, (unsigned long long)h->count);
+    }
+
+    struct mem_pool_s *pools[] = {&object_pool, &ring_pool};
+    struct mem_pool_stats_s stats[2];
+    for (int i = 0; i < 2; i++)
+    {
+        mem_pool_get_stats(pools[i], &stats[i]);
+    }
+    fprintf(out, "# HELP " METRICS_PREFIX "pool_allocations_total Allocations from the memory pools\n");
+    fprintf(out, "# TYPE " METRICS_PREFIX "pool_allocations_total counter\n");
+    for (int i = 0; i < 2; i++)
+    {
+        fprintf(out, METRICS_PREFIX "pool_allocations_total{pool=\"%s\"} %llu\n", pools[i]->name,
+                (unsigned long long)stats[i].allocations);
+    }
+    fprintf(out, "# HELP " METRICS_PREFIX "pool_hits_total Allocations served from a pool cache\n");
+    fprintf(out, "# TYPE " METRICS_PREFIX "pool_hits_total counter\n");
+    for (int i = 0; i < 2; i++)
+    {
+        fprintf(out, METRICS_PREFIX "pool_hits_total{pool=\"%s\"} %llu\n", pools[i]->name,
+                (unsigned long long)stats[i].hits);
+    }
+    fprintf(out, "# HELP " METRICS_PREFIX "pool_failures_total Allocations refused by the memory pools\n");
+    fprintf(out, "# TYPE " METRICS_PREFIX "pool_failures_total counter\n");
+    for (int i = 0; i < 2; i++)
+    {
+        fprintf(out, METRICS_PREFIX "pool_failures_total{pool=\"%s\"} %llu\n", pools[i]->name,
+                (unsigned long long)stats[i].failures);
+    }
+    fprintf(out, "# HELP " METRICS_PREFIX "pool_resident_bytes Bytes held by the memory pools\n");
+    fprintf(out, "# TYPE " METRICS_PREFIX "pool_resident_bytes gauge\n");
+    for (int i = 0; i < 2; i++)
+    {
+        fprintf(out, METRICS_PREFIX "pool_resident_bytes{pool=\"%s\"} %zu\n", pools[i]->name,
+                stats[i].resident_bytes);
+    }
+}
+
+/**
+ * Answers one scrape on @param client with the current metrics
+ */
+static void metrics_serve_client(int client)
+{
+    char request[1024];
+    // The request itself does not matter, but reading it avoids a reset on close
+    if (control_wait_readable(client) <= 0 || recv(client, request, sizeof(request), 0) < 0)
+    {
+        return;
+    }
+
+    char *body = NULL;
+    size_t body_length = 0;
+    FILE *out = open_memstream(&body, &body_length);
+    if (out == NULL)
+    {
+        logger_log(LOG_ERR, "Failed to format metrics: %s", strerror(errno));
+        return;
+    }
+    metrics_write(out);
+    fclose(out);
+
+    char header[256];
+    int header_length = snprintf(header, sizeof(header),
+                                 "HTTP/1.0 200 OK\r\n"
+                                 "Content-Type: text/plain; version=0.0.4\r\n"
+                                 "Content-Length: %zu\r\n\r\n",
+                                 body_length);
+    if (send(client, header, header_length, MSG_NOSIGNAL) == header_length)
+    {
+        size_t sent = 0;
+        while (sent < body_length)
+        {
+            ssize_t count = send(client, body + sent, body_length - sent, MSG_NOSIGNAL);
+            if (count <= 0)
+            {
+                break;
+            }
+            sent += count;
+        }
+    }
+    free(body);
+}
+
+static void *metrics_server(void *data)
+{
+    while (control_wait_readable(metrics_server_sock) > 0)
+    {
+        int client = accept(metrics_server_sock, NULL, NULL);
+        if (client == -1)
+        {
+            continue;
+        }
+        metrics_serve_client(client);
+        close(client);
+    }
+    return data;
+}
+
+int metrics_server_start(const char *endpoint)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+
+    memset(&addr, 0, sizeof(addr));
+    if (endpoint[0] == '/')
+    {
+        struct sockaddr_un *un = (struct sockaddr_un *)&addr;
+        if (strlen(endpoint) >= sizeof(un->sun_path))
+        {
+            logger_log(LOG_ERR, "Metrics socket path too long: %s", endpoint);
+            return -1;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, endpoint);
+        addr_len = sizeof(struct sockaddr_un);
+        // A socket left behind by an earlier run would make bind fail
+        unlink(endpoint);
+        strcpy(metrics_server_path, endpoint);
+    }
+    else
+    {
+        struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+        in->sin_family = AF_INET;
+        in->sin_port = htons(atoi(endpoint));
+        in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr_len = sizeof(struct sockaddr_in);
+    }
+
+    metrics_server_sock = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (metrics_server_sock == -1)
+    {
+        logger_log(LOG_ERR, "Failed to create metrics socket: %s", strerror(errno));
+        return -1;
+    }
+    int opt = 1;
+    if (addr.ss_family == AF_INET)
+    {
+        setsockopt(metrics_server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    }
+    if (bind(metrics_server_sock, (struct sockaddr *)&addr, addr_len) == -1 || listen(metrics_server_sock, 8) == -1)
+    {
+        logger_log(LOG_ERR, "Failed to listen for metrics on %s: %s", endpoint, strerror(errno));
+        close(metrics_server_sock);
+        metrics_server_sock = -1;
+        return -1;
+    }
+
+    if (0 != pthread_create(&metrics_server_thread, 0, metrics_server, NULL))
+    {
+        logger_log(LOG_ERR, "Failed to create metrics thread");
+        close(metrics_server_sock);
+        metrics_server_sock = -1;
+        return -1;
+    }
+    metrics_server_started = true;
+    logger_log(LOG_INFO, "Serving metrics on %s", endpoint);
+    return 0;
+}
+
+void metrics_server_join(void)
+{
+    if (!metrics_server_started)
+    {
+        return;
+    }
+    pthread_join(metrics_server_thread, NULL);
+    close(metrics_server_sock);
+    if (metrics_server_path[0] != '\0')
+    {
+        unlink(metrics_server_path);
+    }
+    metrics_server_started = false;
+}
@@ -0,0 +1,136 @@
+/*
+ * aesd-metrics.h
+ *
+ *  Per-thread counters and histograms for aesdsocket, served in the Prometheus
+ *  text format on a local port or UNIX socket
+ */
+
+#ifndef AESD_METRICS_H
+#define AESD_METRICS_H
+
+#include <stdint.h>
+
+/**
+ * Histogram buckets grow by a factor of four from the unit of the histogram.
+ * The last bucket is +Inf.
+ */
+#define METRICS_BUCKETS 13
+
+enum metrics_counter_e
+{
+    METRICS_CONNECTIONS_ACCEPTED,
+    METRICS_CONNECTIONS_CLOSED,
+    METRICS_BYTES_IN,
+    METRICS_BYTES_OUT,
+    METRICS_PACKETS,
+    METRICS_RESPONSES_DROPPED,
+    METRICS_SLOW_DISCONNECTS,
+    METRICS_READ_PAUSES,
+    METRICS_SYNCS,
+    METRICS_LOG_DROPPED,
+    METRICS_LOG_SUPPRESSED,
+    METRICS_COUNTERS,
+};
+
+enum metrics_histogram_e
+{
+    /**
+     * Time spent waiting for the data file mutex, in ns
+     */
+    METRICS_LOCK_WAIT,
+    /**
+     * Time the data file mutex was held, in ns
+     */
+    METRICS_LOCK_HOLD,
+    /**
+     * Time from a complete packet to its response being sent, in ns
+     */
+    METRICS_RESPONSE_LATENCY,
+    /**
+     * Bytes of the data file sent in one response
+     */
+    METRICS_REPLAY_SIZE,
+    /**
+     * Time a response waited for its packet to be durable, in ns
+     */
+    METRICS_SYNC_WAIT,
+    METRICS_HISTOGRAMS,
+};
+
+struct metrics_histogram_s
+{
+    uint64_t buckets[METRICS_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+};
+
+/**
+ * Metrics of one thread. Only the owning thread writes them, with relaxed atomic
+ * stores, so updates never take a lock and the exporter may read them at any time.
+ */
+struct metrics_shard_s
+{
+    uint64_t counters[METRICS_COUNTERS];
+    struct metrics_histogram_s histograms[METRICS_HISTOGRAMS];
+    struct metrics_shard_s *next;
+};
+
+extern __thread struct metrics_shard_s *metrics_current_shard;
+
+/**
+ * Creates and registers the calling thread's shard. When the thread exits its totals
+ * are folded into the totals of exited threads.
+ */
+struct metrics_shard_s *metrics_thread_shard(void);
+
+static inline struct metrics_shard_s *metrics_shard(void)
+{
+    struct metrics_shard_s *shard = metrics_current_shard;
+    return shard != NULL ? shard : metrics_thread_shard();
+}
+
+/**
+ * @return a CLOCK_MONOTONIC timestamp in ns for measuring durations
+ */
+uint64_t metrics_now(void);
+
+/**
+ * Adds @param value to a slot of the calling thread's shard, which only it writes
+ */
+static inline void metrics_increment(uint64_t *slot, uint64_t value)
+{
+    __atomic_store_n(slot, __atomic_load_n(slot, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_add(enum metrics_counter_e counter, uint64_t value)
+{
+    metrics_increment(&metrics_shard()->counters[counter], value);
+}
+
+/**
+ * @return the calling thread's own total for @param counter
+ */
+static inline uint64_t metrics_thread_value(enum metrics_counter_e counter)
+{
+    return metrics_shard()->counters[counter];
+}
+
+/**
+ * Records @param value in the calling thread's @param histogram
+ */
+void metrics_observe(enum metrics_histogram_e histogram, uint64_t value);
+
+/**
+ * Starts serving the metrics on @param endpoint: a UNIX socket path if it starts
+ * with '/', otherwise a TCP port on 127.0.0.1. Each request is answered with the
+ * current metrics as an HTTP response and the connection is closed.
+ * @return 0 on success, -1 on error (already logged)
+ */
+int metrics_server_start(const char *endpoint);
+
+/**
+ * Waits for the metrics server to exit after exit_flag is set
+ */
+void metrics_server_join(void);
+
+#endif /* AESD_METRICS_H */
@@ -0,0 +1,256 @@
+/**
+ * @file aesd-pool.c
+ * @brief Size class memory pools for aesdsocket connections
+ *
+ * Every request is rounded up to a power of two size class. Freed blocks go onto a
+ * per class free list and are handed to the next connection asking for that class,
+ * so connection churn stops going through malloc and mmap. Each class caches at
+ * most MEM_POOL_CLASS_CACHE_BYTES, and all pools share one limit on resident bytes.
+ * When an allocation would cross the limit the caches are released before it is
+ * refused.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <syslog.h>
+
+#include "aesd-pool.h"
+#include "aesd-framing.h"
+#include "aesd-logger.h"
+
+#define MEM_POOL_CLASSES_INITIALIZER {[0 ... MEM_POOL_CLASSES - 1] = {PTHREAD_MUTEX_INITIALIZER, NULL, 0}}
+
+static void *mem_pool_malloc(size_t size)
+{
+    return malloc(size);
+}
+
+static void mem_pool_malloc_release(void *block, size_t size)
+{
+    free(block);
+}
+
+struct mem_pool_s object_pool = {
+    .name = "object",
+    .allocate = mem_pool_malloc,
+    .release = mem_pool_malloc_release,
+    .classes = MEM_POOL_CLASSES_INITIALIZER,
+};
+
+struct mem_pool_s ring_pool = {
+    .name = "ring",
+    .allocate = packet_ring_map,
+    .release = packet_ring_unmap,
+    .classes = MEM_POOL_CLASSES_INITIALIZER,
+};
+
+static struct mem_pool_s *const mem_pools[] = {&object_pool, &ring_pool};
+
+/**
+ * Limit and total resident bytes across all pools, accessed atomically
+ */
+static size_t mem_pool_limit;
+static size_t mem_pool_total;
+
+void mem_pool_set_limit(size_t bytes)
+{
+    __atomic_store_n(&mem_pool_limit, bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * @return the index of the size class for @param size, or -1 if it is too large
+ */
+static int mem_pool_class_index(size_t size)
+{
+    int shift = MEM_POOL_MIN_SHIFT;
+    while (shift <= MEM_POOL_MAX_SHIFT && ((size_t)1 << shift) < size)
+    {
+        shift++;
+    }
+    return shift <= MEM_POOL_MAX_SHIFT ? shift - MEM_POOL_MIN_SHIFT : -1;
+}
+
+size_t mem_pool_class_size(size_t size)
+{
+    int index = mem_pool_class_index(size);
+    return index < 0 ? 0 : (size_t)1 << (index + MEM_POOL_MIN_SHIFT);
+}
+
+/**
+ * Releases the cached blocks of one size class to the system
+ */
+static void mem_pool_trim_class(struct mem_pool_s *pool, int index)
+{
+    struct mem_pool_class_s *class = &pool->classes[index];
+    size_t size = (size_t)1 << (index + MEM_POOL_MIN_SHIFT);
+
+    pthread_mutex_lock(&class->mutex);
+    void *block = class->free_list;
+    size_t count = class->free_count;
+    class->free_list = NULL;
+    class->free_count = 0;
+    pthread_mutex_unlock(&class->mutex);
+
+    while (block != NULL)
+    {
+        void *next = *(void **)block;
+        pool->release(block, size);
+        block = next;
+    }
+    __atomic_sub_fetch(&pool->resident_bytes, count * size, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&mem_pool_total, count * size, __ATOMIC_RELAXED);
+}
+
+void mem_pool_drain(void)
+{
+    for (size_t i = 0; i < sizeof(mem_pools) / sizeof(mem_pools[0]); i++)
+    {
+        for (int index = 0; index < MEM_POOL_CLASSES; index++)
+        {
+            mem_pool_trim_class(mem_pools[i], index);
+        }
+    }
+}
+
+/**
+ * Accounts @param size new resident bytes against the limit, releasing cached
+ * blocks if needed
+ * @return true if the bytes fit under the limit
+ */
+static bool mem_pool_reserve(size_t size)
+{
+    size_t limit = __atomic_load_n(&mem_pool_limit, __ATOMIC_RELAXED);
+
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        size_t total = __atomic_add_fetch(&mem_pool_total, size, __ATOMIC_RELAXED);
+        if (limit == 0 || total <= limit)
+        {
+            return true;
+        }
+        __atomic_sub_fetch(&mem_pool_total, size, __ATOMIC_RELAXED);
+        if (attempt == 0)
+        {
+            mem_pool_drain();
+        }
+    }
+    return false;
+}
+
+void *mem_pool_alloc(struct mem_pool_s *pool, size_t size)
+{
+    int index = mem_pool_class_index(size);
+
+    __atomic_add_fetch(&pool->allocations, 1, __ATOMIC_RELAXED);
+    if (index < 0)
+    {
+        logger_log(LOG_ERR, "Allocation of %zu bytes exceeds the largest %s pool class", size, pool->name);
+        __atomic_add_fetch(&pool->failures, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    size = (size_t)1 << (index + MEM_POOL_MIN_SHIFT);
+
+    struct mem_pool_class_s *class = &pool->classes[index];
+    pthread_mutex_lock(&class->mutex);
+    void *block = class->free_list;
+    if (block != NULL)
+    {
+        class->free_list = *(void **)block;
+        class->free_count--;
+    }
+    pthread_mutex_unlock(&class->mutex);
+
+    if (block != NULL)
+    {
+        __atomic_add_fetch(&pool->hits, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        if (!mem_pool_reserve(size))
+        {
+            logger_log(LOG_ERR, "Memory limit reached allocating %zu bytes from the %s pool", size, pool->name);
+            __atomic_add_fetch(&pool->failures, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        block = pool->allocate(size);
+        if (block == NULL)
+        {
+            logger_log(LOG_ERR, "Failed to allocate %zu bytes for the %s pool", size, pool->name);
+            __atomic_sub_fetch(&mem_pool_total, size, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&pool->failures, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        __atomic_add_fetch(&pool->resident_bytes, size, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&pool->used_bytes, size, __ATOMIC_RELAXED);
+    return block;
+}
+
+void mem_pool_free(struct mem_pool_s *pool, void *block, size_t size)
+{
+    if (block == NULL)
+    {
+        return;
+    }
+    int index = mem_pool_class_index(size);
+    size = (size_t)1 << (index + MEM_POOL_MIN_SHIFT);
+    __atomic_sub_fetch(&pool->used_bytes, size, __ATOMIC_RELAXED);
+
+    struct mem_pool_class_s *class = &pool->classes[index];
+    size_t max_cached = MEM_POOL_CLASS_CACHE_BYTES / size ? MEM_POOL_CLASS_CACHE_BYTES / size : 1;
+    pthread_mutex_lock(&class->mutex);
+    bool cached = class->free_count < max_cached;
+    if (cached)
+    {
+        *(void **)block = class->free_list;
+        class->free_list = block;
+        class->free_count++;
+    }
+    pthread_mutex_unlock(&class->mutex);
+
+    if (!cached)
+    {
+        pool->release(block, size);
+        __atomic_sub_fetch(&pool->resident_bytes, size, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&mem_pool_total, size, __ATOMIC_RELAXED);
+    }
+}
+
+void *mem_pool_resize(struct mem_pool_s *pool, void *block, size_t old_size, size_t new_size, size_t length)
+{
+    void *new_block = mem_pool_alloc(pool, new_size);
+    if (new_block == NULL)
+    {
+        return NULL;
+    }
+    if (length > 0)
+    {
+        memcpy(new_block, block, length);
+    }
+    mem_pool_free(pool, block, old_size);
+    return new_block;
+}
+
+void mem_pool_get_stats(struct mem_pool_s *pool, struct mem_pool_stats_s *stats)
+{
+    stats->allocations = __atomic_load_n(&pool->allocations, __ATOMIC_RELAXED);
+    stats->hits = __atomic_load_n(&pool->hits, __ATOMIC_RELAXED);
+    stats->failures = __atomic_load_n(&pool->failures, __ATOMIC_RELAXED);
+    stats->used_bytes = __atomic_load_n(&pool->used_bytes, __ATOMIC_RELAXED);
+    stats->resident_bytes = __atomic_load_n(&pool->resident_bytes, __ATOMIC_RELAXED);
+}
+
+void mem_pool_log_stats(void)
+{
+    for (size_t i = 0; i < sizeof(mem_pools) / sizeof(mem_pools[0]); i++)
+    {
+        struct mem_pool_stats_s stats;
+        mem_pool_get_stats(mem_pools[i], &stats);
+        logger_log(LOG_INFO, "%s pool: %llu allocations, %.1f%% hit rate, %llu failures, %zu bytes used, %zu bytes resident",
+               mem_pools[i]->name, (unsigned long long)stats.allocations,
+               stats.allocations ? 100.0 * stats.hits / stats.allocations : 0.0, (unsigned long long)stats.failures,
+               stats.used_bytes, stats.resident_bytes);
+    }
+}
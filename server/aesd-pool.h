@@ -0,0 +1,127 @@
+/*
+ * aesd-pool.h
+ *
+ *  Size class memory pools recycling aesdsocket connection objects and receive
+ *  buffers across connections, under a shared byte limit
+ */
+
+#ifndef AESD_POOL_H
+#define AESD_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/**
+ * Size classes are the powers of two from 2^MEM_POOL_MIN_SHIFT to 2^MEM_POOL_MAX_SHIFT
+ */
+#define MEM_POOL_MIN_SHIFT 6
+#define MEM_POOL_MAX_SHIFT 28
+#define MEM_POOL_CLASSES (MEM_POOL_MAX_SHIFT - MEM_POOL_MIN_SHIFT + 1)
+/**
+ * Bytes of free blocks kept per size class for reuse, at least one block
+ */
+#define MEM_POOL_CLASS_CACHE_BYTES (4 * 1024 * 1024)
+
+struct mem_pool_class_s
+{
+    pthread_mutex_t mutex;
+    /**
+     * Free blocks, linked through their first bytes
+     */
+    void *free_list;
+    size_t free_count;
+};
+
+struct mem_pool_s
+{
+    const char *name;
+    /**
+     * Obtains a new block of @param size bytes from the system, or returns NULL
+     */
+    void *(*allocate)(size_t size);
+    /**
+     * Returns a block obtained with allocate to the system
+     */
+    void (*release)(void *block, size_t size);
+    struct mem_pool_class_s classes[MEM_POOL_CLASSES];
+    /**
+     * Counters, accessed atomically
+     */
+    uint64_t allocations;
+    uint64_t hits;
+    uint64_t failures;
+    /**
+     * Bytes handed out and not yet freed, accessed atomically
+     */
+    size_t used_bytes;
+    /**
+     * Bytes held from the system, in use or cached, accessed atomically
+     */
+    size_t resident_bytes;
+};
+
+struct mem_pool_stats_s
+{
+    uint64_t allocations;
+    uint64_t hits;
+    uint64_t failures;
+    size_t used_bytes;
+    size_t resident_bytes;
+};
+
+/**
+ * Connection objects and epoll mode buffers, backed by malloc
+ */
+extern struct mem_pool_s object_pool;
+
+/**
+ * Mirrored receive rings (see aesd-framing.h), backed by a memfd mapped twice
+ */
+extern struct mem_pool_s ring_pool;
+
+/**
+ * Limits the bytes resident across all pools to @param bytes, 0 for no limit
+ */
+void mem_pool_set_limit(size_t bytes);
+
+/**
+ * @return the size class @param size is rounded up to, or 0 if it exceeds the largest one
+ */
+size_t mem_pool_class_size(size_t size);
+
+/**
+ * Returns a block of at least @param size bytes, reusing a free block of the same
+ * size class when one is cached. Cached blocks of other classes are released first
+ * if the limit would otherwise be exceeded.
+ * @return the block, or NULL if it is too large, over the limit or the system is out
+ * of memory (already logged)
+ */
+void *mem_pool_alloc(struct mem_pool_s *pool, size_t size);
+
+/**
+ * Returns @param block, allocated with @param size, to its size class cache, or to
+ * the system when the cache is full
+ */
+void mem_pool_free(struct mem_pool_s *pool, void *block, size_t size);
+
+/**
+ * Moves @param block, allocated with @param old_size, into a block of at least
+ * @param new_size bytes, keeping the first @param length bytes.
+ * @return the new block, or NULL on failure with @param block left untouched
+ */
+void *mem_pool_resize(struct mem_pool_s *pool, void *block, size_t old_size, size_t new_size, size_t length);
+
+void mem_pool_get_stats(struct mem_pool_s *pool, struct mem_pool_stats_s *stats);
+
+/**
+ * Logs the hit rate and resident bytes of every pool
+ */
+void mem_pool_log_stats(void);
+
+/**
+ * Releases every cached block of every pool to the system
+ */
+void mem_pool_drain(void);
+
+#endif /* AESD_POOL_H */
@@ -0,0 +1,655 @@
+/**
+ * @file aesd-reactor.c
+ * @brief Edge-triggered epoll reactor for aesdsocket
+ *
+ * Each reactor thread owns an epoll instance holding a listening socket, either
+ * shared (registered with EPOLLEXCLUSIVE so only one thread wakes per connection)
+ * or one of several SO_REUSEPORT listeners, and the nonblocking client sockets it
+ * accepted. A connection is a small state machine:
+ * it reads into a packet ring until a full packet, or frame of the binary protocol, is
+ * buffered, applies it to the data file and queues the response on its send queue,
+ * which is flushed as the socket takes it.
+ * Reading goes on while responses are queued until the queue's high-water policy
+ * says otherwise. Idle connections hold no buffers.
+ *
+ * A connection is driven for at most a budget of packets and received bytes per
+ * wakeup. One that still has input then waits on the thread's ready list and is
+ * driven again after the next batch of events, so a fast sender cannot starve the
+ * other connections of its thread.
+ *
+ * Under group commit a connection does not wait for the flusher in the reactor
+ * thread. Its responses stay queued with the ticket of their writes while it is
+ * parked, and the flusher's eventfd resumes it once the group is durable.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/queue.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "aesdsocket.h"
+#include "aesd-reactor.h"
+#include "aesd-pool.h"
+#include "aesd-framing.h"
+#include "aesd-metrics.h"
+#include "aesd-listener.h"
+#include "aesd-control.h"
+#include "aesd-binary.h"
+#include "aesd-durability.h"
+#include "aesd-logger.h"
+
+#define REACTOR_MAX_EVENTS 64
+
+/**
+ * Packets handled and bytes received per connection per wakeup
+ */
+#define REACTOR_PACKET_BUDGET 64
+#define REACTOR_BYTE_BUDGET (64 * 1024)
+
+/**
+ * Marks the shutdown eventfd in epoll events, the listening socket is marked NULL
+ */
+static char reactor_shutdown_event;
+/**
+ * Marks the eventfd the durability flusher writes after every sync
+ */
+static char reactor_durable_event;
+
+struct reactor_connection_s
+{
+    int client_sock;
+    struct sockaddr_in client_addr;
+    /**
+     * Receive ring, unmapped (buffer NULL) while the connection is idle
+     */
+    struct packet_ring_s ring;
+    struct send_queue_s queue;
+    /**
+     * Reference to the shared data file descriptor, the queue's ranges are read from it
+     */
+    struct storage_file_s *file;
+    enum binary_protocol_e protocol;
+    /**
+     * The client closed its side, the connection closes once the queue is sent
+     */
+    bool input_closed;
+    /**
+     * The connection used up its budget and is on the ready list
+     */
+    bool ready;
+    /**
+     * Group commit ticket the queued responses wait for, 0 when they are durable
+     */
+    uint64_t durable_ticket;
+    /**
+     * The connection waits for its ticket on the parked list
+     */
+    bool parked;
+    LIST_ENTRY(reactor_connection_s)
+    entries;
+    TAILQ_ENTRY(reactor_connection_s)
+    ready_entries;
+    LIST_ENTRY(reactor_connection_s)
+    parked_entries;
+};
+LIST_HEAD(reactor_connection_head_t, reactor_connection_s);
+TAILQ_HEAD(reactor_ready_head_t, reactor_connection_s);
+
+struct reactor_thread_s
+{
+    pthread_t thread;
+    bool started;
+    int epoll_fd;
+    int sock;
+    /**
+     * CPU index to pin the thread to, or -1
+     */
+    int cpu;
+    pthread_mutex_t *mutex;
+    struct segment_index_s *index;
+    struct reactor_connection_head_t connections;
+    /**
+     * Connections that used up their budget, in the order they are driven again
+     */
+    struct reactor_ready_head_t ready;
+    /**
+     * Connections waiting for a group commit, and the eventfd that wakes them, or -1
+     * without durability
+     */
+    struct reactor_connection_head_t parked;
+    int durable_fd;
+};
+
+struct reactor_s
+{
+    int workers;
+    struct reactor_thread_s *threads;
+};
+
+static void reactor_connection_close(struct reactor_thread_s *thread, struct reactor_connection_s *conn)
+{
+    LIST_REMOVE(conn, entries);
+    if (conn->ready)
+    {
+        TAILQ_REMOVE(&thread->ready, conn, ready_entries);
+    }
+    if (conn->parked)
+    {
+        LIST_REMOVE(conn, parked_entries);
+    }
+    close(conn->client_sock);
+    metrics_add(METRICS_CONNECTIONS_CLOSED, 1);
+    char client_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &conn->client_addr.sin_addr, client_ip, sizeof(client_ip));
+    logger_log(LOG_INFO, "Closed connection from %s", client_ip);
+    if (conn->ring.buffer != NULL)
+    {
+        packet_ring_destroy(&conn->ring);
+    }
+    send_queue_destroy(&conn->queue);
+    storage_release(&data_storage, conn->file);
+    mem_pool_free(&object_pool, conn, sizeof(struct reactor_connection_s));
+}
+
+/**
+ * Handles the next complete packet or frame already in the receive ring
+ * @return its size, 0 if none is complete, -1 to close the connection
+ */
+static ssize_t reactor_connection_handle(struct reactor_thread_s *thread, struct reactor_connection_s *conn)
+{
+    if (send_queue_empty(&conn->queue))
+    {
+        storage_refresh(&data_storage, &conn->file);
+    }
+    if (conn->protocol == BINARY_PROTOCOL_BINARY)
+    {
+        size_t length;
+        const char *data = packet_ring_peek(&conn->ring, &length);
+        ssize_t size =
+            binary_handle_frame(storage_file_fd(conn->file), thread->mutex, thread->index, &conn->queue, data, length);
+        if (size > 0)
+        {
+            packet_ring_consume(&conn->ring, size);
+        }
+        return size;
+    }
+
+    const char *packet;
+    size_t packet_size;
+    if (!packet_ring_next(&conn->ring, &packet, &packet_size))
+    {
+        return 0;
+    }
+    struct iovec iov = {(void *)packet, packet_size};
+    if (queue_response(storage_file_fd(conn->file), thread->mutex, thread->index, &conn->queue, &iov, 1) != 0)
+    {
+        return -1;
+    }
+    metrics_add(METRICS_PACKETS, 1);
+    return packet_size;
+}
+
+/**
+ * Advances the connection state machine as far as the socket and the wakeup budget allow.
+ * @return 0 to wait for the next event, 1 if the budget ran out before the socket
+ * would block, -1 to close the connection
+ */
+static int reactor_connection_drive(struct reactor_thread_s *thread, struct reactor_connection_s *conn)
+{
+    int packets = 0;
+    size_t received = 0;
+
+    while (!exit_flag)
+    {
+        if (conn->durable_ticket != 0)
+        {
+            // Nothing is sent or read until the queued responses are durable, the
+            // flusher's eventfd resumes the parked connection
+            int synced = durability_ticket_synced(conn->durable_ticket);
+            if (synced <= 0)
+            {
+                return synced;
+            }
+            conn->durable_ticket = 0;
+        }
+        if (send_queue_flush(&conn->queue) != 0)
+        {
+            return -1;
+        }
+        if (conn->input_closed)
+        {
+            return send_queue_empty(&conn->queue) ? -1 : 0;
+        }
+        if (!send_queue_accepts_input(&conn->queue))
+        {
+            // EPOLLOUT resumes the connection once the queue has drained
+            return 0;
+        }
+        if (packets >= REACTOR_PACKET_BUDGET || received >= REACTOR_BYTE_BUDGET)
+        {
+            return 1;
+        }
+
+        // The first bytes select the protocol, the magic of the binary one is consumed
+        size_t buffered = 0;
+        const char *data = conn->ring.buffer != NULL ? packet_ring_peek(&conn->ring, &buffered) : NULL;
+        if (conn->protocol == BINARY_PROTOCOL_UNKNOWN && buffered > 0)
+        {
+            conn->protocol = binary_detect(data, buffered);
+            if (conn->protocol == BINARY_PROTOCOL_BINARY)
+            {
+                packet_ring_consume(&conn->ring, BINARY_MAGIC_SIZE);
+                if (binary_start(&conn->queue) != 0)
+                {
+                    return -1;
+                }
+            }
+            if (conn->protocol != BINARY_PROTOCOL_UNKNOWN)
+            {
+                continue;
+            }
+        }
+        else if (conn->protocol != BINARY_PROTOCOL_UNKNOWN && buffered > 0)
+        {
+            durability_defer_begin();
+            ssize_t packet_size = reactor_connection_handle(thread, conn);
+            uint64_t ticket = durability_defer_end();
+            if (ticket != 0)
+            {
+                conn->durable_ticket = ticket;
+            }
+            if (packet_size < 0)
+            {
+                return -1;
+            }
+            if (packet_size > 0)
+            {
+                packets++;
+                continue;
+            }
+        }
+
+        // Map the ring again after an idle period, or make room for more data
+        if (conn->ring.buffer == NULL && packet_ring_init(&conn->ring, BUFFER_SIZE) != 0)
+        {
+            return -1;
+        }
+        size_t space;
+        char *write_space = packet_ring_write_space(&conn->ring, &space);
+        if (write_space == NULL)
+        {
+            logger_log(LOG_ERR, "Failed to grow receive ring, discarding packet");
+            return -1;
+        }
+
+        ssize_t count = recv(conn->client_sock, write_space, space, 0);
+        if (count == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                packet_ring_peek(&conn->ring, &buffered);
+                if (buffered == 0)
+                {
+                    // Idle connections should not pin receive memory
+                    packet_ring_destroy(&conn->ring);
+                }
+                return 0;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            logger_log(LOG_ERR, "Socket error: %s", strerror(errno));
+            return -1;
+        }
+        if (count == 0)
+        {
+            // Client closed connection, after its responses have been sent
+            conn->input_closed = true;
+            continue;
+        }
+        packet_ring_commit(&conn->ring, count);
+        received += count;
+        metrics_add(METRICS_BYTES_IN, count);
+    }
+    return -1;
+}
+
+static void reactor_accept(struct reactor_thread_s *thread)
+{
+    while (!exit_flag)
+    {
+        struct sockaddr_in client_addr = {0};
+        socklen_t client_addr_len = sizeof(client_addr);
+        int client_sock = accept4(thread->sock, (struct sockaddr *)&client_addr, &client_addr_len,
+                                  SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_sock == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                logger_log(LOG_ERR, "Failed to accept connection: %s", strerror(errno));
+            }
+            return;
+        }
+
+        struct reactor_connection_s *conn = mem_pool_alloc(&object_pool, sizeof(struct reactor_connection_s));
+        if (conn == NULL)
+        {
+            close(client_sock);
+            continue;
+        }
+        memset(conn, 0, sizeof(struct reactor_connection_s));
+        conn->client_sock = client_sock;
+        send_queue_init(&conn->queue, client_sock);
+        conn->client_addr = client_addr;
+        // Without an index the connection writes through the shared data file or device
+        if (thread->index == NULL && (conn->file = storage_acquire(&data_storage)) == NULL)
+        {
+            close(client_sock);
+            mem_pool_free(&object_pool, conn, sizeof(struct reactor_connection_s));
+            continue;
+        }
+
+        struct epoll_event event = {0};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = conn;
+        if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, client_sock, &event) == -1)
+        {
+            logger_log(LOG_ERR, "Failed to add connection to epoll: %s", strerror(errno));
+            close(client_sock);
+            storage_release(&data_storage, conn->file);
+            mem_pool_free(&object_pool, conn, sizeof(struct reactor_connection_s));
+            continue;
+        }
+
+        LIST_INSERT_HEAD(&thread->connections, conn, entries);
+        metrics_add(METRICS_CONNECTIONS_ACCEPTED, 1);
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &conn->client_addr.sin_addr, client_ip, sizeof(client_ip));
+        logger_log(LOG_INFO, "Accepted connection from %s", client_ip);
+    }
+}
+
+/**
+ * Drives @param conn and closes it, puts it on the ready list while it has input
+ * left over from its budget or parks it until its writes are durable
+ */
+static void reactor_connection_run(struct reactor_thread_s *thread, struct reactor_connection_s *conn)
+{
+    int ret = reactor_connection_drive(thread, conn);
+    if (ret < 0)
+    {
+        reactor_connection_close(thread, conn);
+        return;
+    }
+    if (ret > 0 && !conn->ready)
+    {
+        TAILQ_INSERT_TAIL(&thread->ready, conn, ready_entries);
+        conn->ready = true;
+    }
+    else if (ret == 0 && conn->ready)
+    {
+        TAILQ_REMOVE(&thread->ready, conn, ready_entries);
+        conn->ready = false;
+    }
+    if (ret == 0 && conn->durable_ticket != 0 && !conn->parked)
+    {
+        LIST_INSERT_HEAD(&thread->parked, conn, parked_entries);
+        conn->parked = true;
+    }
+}
+
+/**
+ * Resumes the parked connections whose group commit has completed or failed
+ */
+static void reactor_resume_parked(struct reactor_thread_s *thread)
+{
+    uint64_t count;
+    if (read(thread->durable_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+    {
+        logger_log(LOG_ERR, "Failed to read durability eventfd: %s", strerror(errno));
+    }
+    struct reactor_connection_s *conn = LIST_FIRST(&thread->parked);
+    while (conn != NULL)
+    {
+        // Parking again inserts at the head, so the rest is still visited once
+        struct reactor_connection_s *next = LIST_NEXT(conn, parked_entries);
+        if (durability_ticket_synced(conn->durable_ticket) != 0)
+        {
+            LIST_REMOVE(conn, parked_entries);
+            conn->parked = false;
+            reactor_connection_run(thread, conn);
+        }
+        conn = next;
+    }
+}
+
+static void *reactor_thread(void *data)
+{
+    struct reactor_thread_s *thread = (struct reactor_thread_s *)data;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    if (thread->cpu >= 0)
+    {
+        listener_pin_thread(thread->cpu);
+    }
+    while (!exit_flag)
+    {
+        // Connections with input left over only poll for new events
+        int count = epoll_wait(thread->epoll_fd, events, REACTOR_MAX_EVENTS, TAILQ_EMPTY(&thread->ready) ? -1 : 0);
+        if (count == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            logger_log(LOG_ERR, "epoll_wait() failed: %s", strerror(errno));
+            break;
+        }
+
+        bool durable = false;
+        for (int i = 0; i < count; i++)
+        {
+            struct reactor_connection_s *conn = events[i].data.ptr;
+            if (conn == (void *)&reactor_shutdown_event)
+            {
+                // exit_flag is set, the loop ends after this batch
+                continue;
+            }
+            if (conn == (void *)&reactor_durable_event)
+            {
+                // Resumed connections may close, which frees them under later events of this batch
+                durable = true;
+                continue;
+            }
+            if (conn == NULL)
+            {
+                reactor_accept(thread);
+                continue;
+            }
+            reactor_connection_run(thread, conn);
+        }
+        if (durable)
+        {
+            reactor_resume_parked(thread);
+        }
+
+        // One more turn for each connection that was ready before this batch, in order
+        struct reactor_connection_s *last = TAILQ_LAST(&thread->ready, reactor_ready_head_t);
+        while (!exit_flag && last != NULL)
+        {
+            struct reactor_connection_s *conn = TAILQ_FIRST(&thread->ready);
+            TAILQ_REMOVE(&thread->ready, conn, ready_entries);
+            conn->ready = false;
+            reactor_connection_run(thread, conn);
+            if (conn == last)
+            {
+                break;
+            }
+        }
+    }
+
+    while (!LIST_EMPTY(&thread->connections))
+    {
+        reactor_connection_close(thread, LIST_FIRST(&thread->connections));
+    }
+
+    return data;
+}
+
+/**
+ * Lifts the open file limit to the hard limit so a reactor can hold as many
+ * idle connections as the system allows
+ */
+static void reactor_raise_file_limit(void)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) == -1)
+        {
+            logger_log(LOG_WARNING, "Failed to raise open file limit: %s", strerror(errno));
+        }
+    }
+}
+
+struct reactor_s *reactor_start(const int *socks, int sock_count, int workers, bool pin_threads,
+                                pthread_mutex_t *mutex, struct segment_index_s *index)
+{
+    for (int i = 0; i < sock_count; i++)
+    {
+        int flags = fcntl(socks[i], F_GETFL, 0);
+        if (flags == -1 || fcntl(socks[i], F_SETFL, flags | O_NONBLOCK) == -1)
+        {
+            logger_log(LOG_ERR, "Failed to make listening socket nonblocking: %s", strerror(errno));
+            return NULL;
+        }
+    }
+
+    reactor_raise_file_limit();
+
+    struct reactor_s *reactor = calloc(1, sizeof(struct reactor_s));
+    if (reactor == NULL)
+    {
+        logger_log(LOG_ERR, "Failed to allocate memory for reactor");
+        return NULL;
+    }
+    reactor->threads = calloc(workers, sizeof(struct reactor_thread_s));
+    if (reactor->threads == NULL)
+    {
+        logger_log(LOG_ERR, "Failed to allocate memory for reactor threads");
+        free(reactor);
+        return NULL;
+    }
+    reactor->workers = workers;
+    for (int i = 0; i < workers; i++)
+    {
+        reactor->threads[i].epoll_fd = -1;
+        reactor->threads[i].durable_fd = -1;
+    }
+
+    for (int i = 0; i < workers; i++)
+    {
+        struct reactor_thread_s *thread = &reactor->threads[i];
+        LIST_INIT(&thread->connections);
+        TAILQ_INIT(&thread->ready);
+        LIST_INIT(&thread->parked);
+        thread->sock = socks[i % sock_count];
+        thread->cpu = pin_threads ? i : -1;
+        thread->mutex = mutex;
+        thread->index = index;
+
+        thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (thread->epoll_fd == -1)
+        {
+            logger_log(LOG_ERR, "Failed to create epoll instance: %s", strerror(errno));
+            goto error;
+        }
+
+        struct epoll_event event = {0};
+        event.events = EPOLLIN | EPOLLEXCLUSIVE;
+        event.data.ptr = NULL;
+        if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, thread->sock, &event) == -1)
+        {
+            logger_log(LOG_ERR, "Failed to add listening socket to epoll: %s", strerror(errno));
+            goto error;
+        }
+        // Stays readable once shutdown starts, waking every reactor
+        event.events = EPOLLIN;
+        event.data.ptr = &reactor_shutdown_event;
+        if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, control_shutdown_fd(), &event) == -1)
+        {
+            logger_log(LOG_ERR, "Failed to add shutdown eventfd to epoll: %s", strerror(errno));
+            goto error;
+        }
+        if (durability_enabled())
+        {
+            thread->durable_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (thread->durable_fd == -1)
+            {
+                logger_log(LOG_ERR, "Failed to create durability eventfd: %s", strerror(errno));
+                goto error;
+            }
+            event.events = EPOLLIN;
+            event.data.ptr = &reactor_durable_event;
+            if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, thread->durable_fd, &event) == -1 ||
+                durability_watch(thread->durable_fd) != 0)
+            {
+                logger_log(LOG_ERR, "Failed to watch durability eventfd: %s", strerror(errno));
+                close(thread->durable_fd);
+                thread->durable_fd = -1;
+                goto error;
+            }
+        }
+
+        if (0 != pthread_create(&thread->thread, 0, reactor_thread, (void *)thread))
+        {
+            logger_log(LOG_ERR, "Failed to create reactor thread");
+            goto error;
+        }
+        thread->started = true;
+    }
+
+    logger_log(LOG_INFO, "Started %d epoll reactor threads", workers);
+    return reactor;
+
+error:
+    control_shutdown();
+    reactor_join(reactor);
+    return NULL;
+}
+
+void reactor_join(struct reactor_s *reactor)
+{
+    for (int i = 0; i < reactor->workers; i++)
+    {
+        struct reactor_thread_s *thread = &reactor->threads[i];
+        if (thread->started)
+        {
+            pthread_join(thread->thread, NULL);
+        }
+        if (thread->epoll_fd >= 0)
+        {
+            close(thread->epoll_fd);
+        }
+        if (thread->durable_fd >= 0)
+        {
+            durability_unwatch(thread->durable_fd);
+            close(thread->durable_fd);
+        }
+    }
+    free(reactor->threads);
+    free(reactor);
+}
@@ -0,0 +1,34 @@
+/*
+ * aesd-reactor.h
+ *
+ *  Edge-triggered epoll event loop servicing aesdsocket connections from a
+ *  fixed number of threads.
+ */
+
+#ifndef AESD_REACTOR_H
+#define AESD_REACTOR_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include "aesd-index.h"
+
+struct reactor_s;
+
+/**
+ * Starts @param workers reactor threads which accept from the @param sock_count listening
+ * sockets in @param socks, thread i from socks[i % sock_count], and service all
+ * connections. With @param pin_threads thread i is pinned to the i-th CPU. @param mutex
+ * protects the data file. @param index is the data file segment index when using
+ * snapshot replay, otherwise NULL.
+ * @return the reactor, or NULL on failure (already logged)
+ */
+struct reactor_s *reactor_start(const int *socks, int sock_count, int workers, bool pin_threads,
+                                pthread_mutex_t *mutex, struct segment_index_s *index);
+
+/**
+ * Waits for all reactor threads to exit after exit_flag is set, closes any remaining
+ * connections and frees @param reactor
+ */
+void reactor_join(struct reactor_s *reactor);
+
+#endif /* AESD_REACTOR_H */
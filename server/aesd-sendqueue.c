@@ -0,0 +1,405 @@
+/**
+ * @file aesd-sendqueue.c
+ * @brief Bounded per-connection output queues for aesdsocket
+ *
+ * Responses are queued while the data file mutex is held and sent once it is
+ * released. The data file is only ever appended to, so its responses are queued as
+ * byte ranges and read when the socket has room; ranges of the segmented log are
+ * pinned and sent from the mapped segments; the char device drops old writes, so
+ * its responses are copied. A connection whose queue reaches the high-water mark
+ * is paused, has responses dropped or is closed, following the configured policy.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+
+#include "aesdsocket.h"
+#include "aesd-sendqueue.h"
+#include "aesd-pool.h"
+#include "aesd-metrics.h"
+#include "aesd-logger.h"
+
+static size_t send_queue_high_water = SEND_QUEUE_DEFAULT_HIGH_WATER;
+static enum send_queue_policy_e send_queue_policy = SEND_QUEUE_PAUSE;
+static bool send_queue_zero_copy = true;
+
+void send_queue_configure(size_t high_water, enum send_queue_policy_e policy, bool zero_copy)
+{
+    send_queue_high_water = high_water;
+    send_queue_policy = policy;
+    send_queue_zero_copy = zero_copy;
+}
+
+int send_queue_parse_policy(const char *name, enum send_queue_policy_e *policy)
+{
+    if (strcmp(name, "pause") == 0)
+    {
+        *policy = SEND_QUEUE_PAUSE;
+    }
+    else if (strcmp(name, "drop") == 0)
+    {
+        *policy = SEND_QUEUE_DROP;
+    }
+    else if (strcmp(name, "disconnect") == 0)
+    {
+        *policy = SEND_QUEUE_DISCONNECT;
+    }
+    else
+    {
+        return -1;
+    }
+    return 0;
+}
+
+void send_queue_init(struct send_queue_s *queue, int sock)
+{
+    memset(queue, 0, sizeof(struct send_queue_s));
+    queue->sock = sock;
+    STAILQ_INIT(&queue->segments);
+    queue->sendfile_unsupported = !send_queue_zero_copy;
+}
+
+static void send_queue_free_segment(struct send_queue_segment_s *segment)
+{
+    if (segment->data != NULL)
+    {
+        mem_pool_free(&object_pool, segment->data, segment->capacity);
+    }
+    if (segment->index != NULL)
+    {
+        segment_index_unpin(segment->index, segment->pinned_start, segment->end);
+    }
+    mem_pool_free(&object_pool, segment, sizeof(struct send_queue_segment_s));
+}
+
+/**
+ * Applies the policy to a response of @param size bytes. Whatever is queued, a
+ * response is always accepted into an empty queue.
+ * @return 0 to queue the response, 1 to drop it, -1 to close the connection
+ */
+static int send_queue_admit(struct send_queue_s *queue, size_t size)
+{
+    if (send_queue_policy == SEND_QUEUE_PAUSE || (send_queue_policy == SEND_QUEUE_DROP && queue->framed) ||
+        queue->length == 0 ||
+        queue->length + size <= send_queue_high_water)
+    {
+        return 0;
+    }
+    if (send_queue_policy == SEND_QUEUE_DROP)
+    {
+        metrics_add(METRICS_RESPONSES_DROPPED, 1);
+        return 1;
+    }
+    logger_log(LOG_WARNING, "Closing slow connection with %zu bytes of responses queued", queue->length);
+    metrics_add(METRICS_SLOW_DISCONNECTS, 1);
+    return -1;
+}
+
+/**
+ * Queues @param segment, or frees it if the policy says so
+ * @return as send_queue_file_range
+ */
+static int send_queue_push(struct send_queue_s *queue, struct send_queue_segment_s *segment)
+{
+    size_t size = segment->end - segment->offset + segment->header_length;
+    metrics_observe(METRICS_REPLAY_SIZE, size);
+    if (size == 0)
+    {
+        metrics_observe(METRICS_RESPONSE_LATENCY, metrics_now() - segment->started);
+        send_queue_free_segment(segment);
+        return 0;
+    }
+
+    int ret = send_queue_admit(queue, size);
+    if (ret != 0)
+    {
+        send_queue_free_segment(segment);
+        return ret > 0 ? 0 : -1;
+    }
+    STAILQ_INSERT_TAIL(&queue->segments, segment, entries);
+    queue->length += size;
+    return 0;
+}
+
+int send_queue_file_range(struct send_queue_s *queue, int fd, off_t start, off_t end, uint64_t started)
+{
+    struct send_queue_segment_s *segment = mem_pool_alloc(&object_pool, sizeof(struct send_queue_segment_s));
+    if (segment == NULL)
+    {
+        return -1;
+    }
+    memset(segment, 0, sizeof(struct send_queue_segment_s));
+    segment->fd = fd;
+    segment->offset = start;
+    segment->end = end;
+    segment->started = started;
+    return send_queue_push(queue, segment);
+}
+
+int send_queue_index_range(struct send_queue_s *queue, struct segment_index_s *index, off_t start, off_t end,
+                           uint64_t started)
+{
+    if (index->log == NULL)
+    {
+        // Records whose write failed are left out
+        off_t hole_start, hole_end;
+        while (segment_index_next_hole(index, start, end, &hole_start, &hole_end))
+        {
+            if (hole_start > start && send_queue_file_range(queue, index->fd, start, hole_start, started) != 0)
+            {
+                return -1;
+            }
+            start = hole_end < end ? hole_end : end;
+        }
+        return send_queue_file_range(queue, index->fd, start, end, started);
+    }
+
+    struct send_queue_segment_s *segment = mem_pool_alloc(&object_pool, sizeof(struct send_queue_segment_s));
+    if (segment == NULL)
+    {
+        return -1;
+    }
+    memset(segment, 0, sizeof(struct send_queue_segment_s));
+    segment_index_pin(index, &start, end);
+    segment->fd = -1;
+    segment->index = index;
+    segment->pinned_start = start;
+    segment->offset = start;
+    segment->end = end;
+    segment->started = started;
+    return send_queue_push(queue, segment);
+}
+
+int send_queue_framed_range(struct send_queue_s *queue, struct segment_index_s *index, int fd, off_t start,
+                            off_t end, const void *header, size_t header_length, uint64_t started)
+{
+    struct send_queue_segment_s *segment = mem_pool_alloc(&object_pool, sizeof(struct send_queue_segment_s));
+    if (segment == NULL)
+    {
+        return -1;
+    }
+    memset(segment, 0, sizeof(struct send_queue_segment_s));
+    segment->fd = fd;
+    if (index != NULL && index->log != NULL)
+    {
+        // The header already gives the length, so the range cannot shrink
+        off_t pinned = start;
+        segment_index_pin(index, &pinned, end);
+        if (pinned != start)
+        {
+            segment_index_unpin(index, pinned, end);
+            mem_pool_free(&object_pool, segment, sizeof(struct send_queue_segment_s));
+            return 1;
+        }
+        segment->fd = -1;
+        segment->index = index;
+        segment->pinned_start = start;
+    }
+    else if (index != NULL)
+    {
+        // The header already gives the length, so a range with records whose write
+        // failed cannot be sent
+        off_t hole_start, hole_end;
+        if (segment_index_next_hole(index, start, end, &hole_start, &hole_end))
+        {
+            mem_pool_free(&object_pool, segment, sizeof(struct send_queue_segment_s));
+            return 1;
+        }
+        segment->fd = index->fd;
+    }
+    memcpy(segment->header, header, header_length);
+    segment->header_length = header_length;
+    segment->offset = start;
+    segment->end = end;
+    segment->started = started;
+    return send_queue_push(queue, segment);
+}
+
+int send_queue_sink(void *context, const char *data, size_t length)
+{
+    struct send_queue_s *queue = (struct send_queue_s *)context;
+    struct send_queue_segment_s *segment = queue->open;
+
+    if (segment == NULL)
+    {
+        segment = mem_pool_alloc(&object_pool, sizeof(struct send_queue_segment_s));
+        if (segment == NULL)
+        {
+            return -1;
+        }
+        memset(segment, 0, sizeof(struct send_queue_segment_s));
+        segment->fd = -1;
+        queue->open = segment;
+    }
+
+    size_t used = segment->end;
+    if (used + length > segment->capacity)
+    {
+        size_t new_capacity = segment->capacity ? segment->capacity : BUFFER_SIZE;
+        while (new_capacity < used + length)
+        {
+            new_capacity *= 2;
+        }
+        char *new_data = segment->data == NULL
+                             ? mem_pool_alloc(&object_pool, new_capacity)
+                             : mem_pool_resize(&object_pool, segment->data, segment->capacity, new_capacity, used);
+        if (new_data == NULL)
+        {
+            return -1;
+        }
+        segment->data = new_data;
+        segment->capacity = new_capacity;
+    }
+    memcpy(segment->data + used, data, length);
+    segment->end += length;
+    return 0;
+}
+
+int send_queue_commit(struct send_queue_s *queue, uint64_t started)
+{
+    struct send_queue_segment_s *segment = queue->open;
+    queue->open = NULL;
+
+    if (segment == NULL)
+    {
+        // Nothing was read, queue an empty response for the metrics
+        return send_queue_file_range(queue, -1, 0, 0, started);
+    }
+    segment->started = started;
+    return send_queue_push(queue, segment);
+}
+
+void send_queue_discard(struct send_queue_s *queue)
+{
+    if (queue->open != NULL)
+    {
+        send_queue_free_segment(queue->open);
+        queue->open = NULL;
+    }
+}
+
+/**
+ * Sends the next part of @param segment
+ * @return the bytes sent, or -1 with errno set
+ */
+static ssize_t send_queue_send_segment(struct send_queue_s *queue, struct send_queue_segment_s *segment)
+{
+    size_t remaining = segment->end - segment->offset;
+
+    if (segment->header_offset < segment->header_length)
+    {
+        return send(queue->sock, segment->header + segment->header_offset,
+                    segment->header_length - segment->header_offset,
+                    MSG_NOSIGNAL | MSG_DONTWAIT | (remaining > 0 ? MSG_MORE : 0));
+    }
+    if (segment->data != NULL)
+    {
+        return send(queue->sock, segment->data + segment->offset, remaining, MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+    if (segment->index != NULL)
+    {
+        size_t contiguous;
+        const char *data = segment_log_data(segment->index->log, segment->offset, &contiguous);
+        return send(queue->sock, data, remaining < contiguous ? remaining : contiguous, MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+
+    if (!queue->sendfile_unsupported)
+    {
+        off_t offset = segment->offset;
+        ssize_t sent = sendfile(queue->sock, segment->fd, &offset, remaining < ZERO_COPY_CHUNK ? remaining
+                                                                                             : ZERO_COPY_CHUNK);
+        if (sent != -1 || (errno != EINVAL && errno != ENOSYS))
+        {
+            return sent;
+        }
+        queue->sendfile_unsupported = true;
+    }
+
+    // Bytes the socket does not take are read again on the next flush
+    char buffer[BUFFER_SIZE];
+    ssize_t bytes_read = pread(segment->fd, buffer, remaining < sizeof(buffer) ? remaining : sizeof(buffer),
+                               segment->offset);
+    if (bytes_read <= 0)
+    {
+        return bytes_read;
+    }
+    return send(queue->sock, buffer, bytes_read, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+int send_queue_flush(struct send_queue_s *queue)
+{
+    struct send_queue_segment_s *segment;
+
+    while ((segment = STAILQ_FIRST(&queue->segments)) != NULL)
+    {
+        while (segment->header_offset < segment->header_length || segment->offset < segment->end)
+        {
+            ssize_t sent = send_queue_send_segment(queue, segment);
+            if (sent == -1)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    return 0;
+                }
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                logger_log(LOG_ERR, "Failed to send response: %s", strerror(errno));
+                return -1;
+            }
+            if (sent == 0)
+            {
+                logger_log(LOG_ERR, "Data file is shorter than a queued response");
+                return -1;
+            }
+            if (segment->header_offset < segment->header_length)
+            {
+                segment->header_offset += sent;
+            }
+            else
+            {
+                segment->offset += sent;
+            }
+            queue->length -= sent;
+            metrics_add(METRICS_BYTES_OUT, sent);
+        }
+
+        metrics_observe(METRICS_RESPONSE_LATENCY, metrics_now() - segment->started);
+        STAILQ_REMOVE_HEAD(&queue->segments, entries);
+        send_queue_free_segment(segment);
+    }
+    return 0;
+}
+
+bool send_queue_accepts_input(struct send_queue_s *queue)
+{
+    if (send_queue_policy == SEND_QUEUE_DISCONNECT || (send_queue_policy == SEND_QUEUE_DROP && !queue->framed))
+    {
+        return true;
+    }
+    bool paused = queue->length >= send_queue_high_water;
+    if (paused && !queue->paused)
+    {
+        metrics_add(METRICS_READ_PAUSES, 1);
+    }
+    queue->paused = paused;
+    return !paused;
+}
+
+void send_queue_destroy(struct send_queue_s *queue)
+{
+    send_queue_discard(queue);
+    while (!STAILQ_EMPTY(&queue->segments))
+    {
+        struct send_queue_segment_s *segment = STAILQ_FIRST(&queue->segments);
+        STAILQ_REMOVE_HEAD(&queue->segments, entries);
+        send_queue_free_segment(segment);
+    }
+    queue->length = 0;
+}
@@ -0,0 +1,184 @@
+/*
+ * aesd-sendqueue.h
+ *
+ *  Bounded per-connection output queues, so responses are sent after the data
+ *  file mutex is released and a slow reader only holds up its own connection
+ */
+
+#ifndef AESD_SENDQUEUE_H
+#define AESD_SENDQUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#include "aesd-index.h"
+
+#define SEND_QUEUE_DEFAULT_HIGH_WATER (1024 * 1024)
+// Largest header sent ahead of a queued range
+#define SEND_QUEUE_HEADER_MAX 16
+
+/**
+ * What happens to a connection whose queued responses reach the high-water mark,
+ * selected with -O on the command line
+ */
+enum send_queue_policy_e
+{
+    /**
+     * Stop reading packets from the connection until the queue drains below the mark
+     */
+    SEND_QUEUE_PAUSE,
+    /**
+     * Keep appending the connection's packets but discard responses that would take
+     * the queue past the mark
+     */
+    SEND_QUEUE_DROP,
+    /**
+     * Close the connection
+     */
+    SEND_QUEUE_DISCONNECT,
+};
+
+/**
+ * One queued response: bytes copied while the data file mutex was held, a byte
+ * range of the append-only data file that is read when it is sent, or a pinned
+ * range of a segmented log sent from its mapping
+ */
+struct send_queue_segment_s
+{
+    STAILQ_ENTRY(send_queue_segment_s)
+    entries;
+    /**
+     * Copied response, or NULL for a range of the file open on fd or of index
+     */
+    char *data;
+    size_t capacity;
+    int fd;
+    /**
+     * Index whose log holds the range, pinned from pinned_start to end
+     */
+    struct segment_index_s *index;
+    off_t pinned_start;
+    /**
+     * Next byte to send and end of the response, offsets into data or the file
+     */
+    off_t offset;
+    off_t end;
+    /**
+     * Bytes sent before the range, and how many of them are sent
+     */
+    char header[SEND_QUEUE_HEADER_MAX];
+    uint8_t header_length;
+    uint8_t header_offset;
+    /**
+     * metrics_now() when the packet of the response was complete
+     */
+    uint64_t started;
+};
+STAILQ_HEAD(send_queue_segment_head_t, send_queue_segment_s);
+
+struct send_queue_s
+{
+    int sock;
+    /**
+     * Bytes queued and not yet accepted by the socket
+     */
+    size_t length;
+    struct send_queue_segment_head_t segments;
+    /**
+     * Response being copied through send_queue_sink, queued by send_queue_commit
+     */
+    struct send_queue_segment_s *open;
+    bool sendfile_unsupported;
+    /**
+     * Every response of the connection is a frame its client waits for, so
+     * SEND_QUEUE_DROP pauses reading instead of dropping one
+     */
+    bool framed;
+    /**
+     * Reading is paused under SEND_QUEUE_PAUSE
+     */
+    bool paused;
+};
+
+/**
+ * Sets the high-water mark in bytes, the policy applied when a connection reaches it
+ * and whether file ranges are sent with sendfile, for every queue
+ */
+void send_queue_configure(size_t high_water, enum send_queue_policy_e policy, bool zero_copy);
+
+/**
+ * Parses a policy name: pause, drop or disconnect
+ * @return 0 on success, -1 if @param name is not a policy
+ */
+int send_queue_parse_policy(const char *name, enum send_queue_policy_e *policy);
+
+void send_queue_init(struct send_queue_s *queue, int sock);
+
+/**
+ * Queues bytes [@param start, @param end) of the append-only file open on @param fd,
+ * which must stay open until the queue is flushed or destroyed
+ * @return 0 if the response was queued or dropped, -1 on error or if the connection
+ * must be closed (already logged)
+ */
+int send_queue_file_range(struct send_queue_s *queue, int fd, off_t start, off_t end, uint64_t started);
+
+/**
+ * Queues bytes [@param start, @param end) of the records in @param index, from the
+ * data file or pinned in the log. @param start may be advanced past records the log
+ * has dropped since, and tombstones of records whose write failed are left out.
+ * @return as send_queue_file_range
+ */
+int send_queue_index_range(struct send_queue_s *queue, struct segment_index_s *index, off_t start, off_t end,
+                           uint64_t started);
+
+/**
+ * Queues @param header, at most SEND_QUEUE_HEADER_MAX bytes, followed by bytes
+ * [@param start, @param end) of the records in @param index or, when it is NULL, of
+ * the append-only file open on @param fd, as a single response
+ * @return 0 if the response was queued or dropped, 1 if the log has dropped part of
+ * the range since or it holds a tombstone, -1 on error or if the connection must be
+ * closed (already logged)
+ */
+int send_queue_framed_range(struct send_queue_s *queue, struct segment_index_s *index, int fd, off_t start,
+                            off_t end, const void *header, size_t header_length, uint64_t started);
+
+/**
+ * response_sink_t copying a response into the open segment of the send_queue_s
+ * @param context, to be queued with send_queue_commit or freed with send_queue_discard
+ */
+int send_queue_sink(void *context, const char *data, size_t length);
+
+/**
+ * Queues the response copied through send_queue_sink
+ * @return as send_queue_file_range
+ */
+int send_queue_commit(struct send_queue_s *queue, uint64_t started);
+
+void send_queue_discard(struct send_queue_s *queue);
+
+/**
+ * Sends as much of the queue as the socket accepts without blocking
+ * @return 0 on success, even if bytes remain queued, -1 on error (already logged)
+ */
+int send_queue_flush(struct send_queue_s *queue);
+
+/**
+ * @return false while the connection's packets must be left unread, which only
+ * happens under SEND_QUEUE_PAUSE
+ */
+bool send_queue_accepts_input(struct send_queue_s *queue);
+
+static inline bool send_queue_empty(const struct send_queue_s *queue)
+{
+    return STAILQ_EMPTY(&queue->segments);
+}
+
+/**
+ * Frees every queued response
+ */
+void send_queue_destroy(struct send_queue_s *queue);
+
+#endif /* AESD_SENDQUEUE_H */
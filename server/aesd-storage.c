@@ -0,0 +1,261 @@
+/**
+ * @file aesd-storage.c
+ * @brief Shared, reference counted descriptor of the aesdsocket data file or device
+ *
+ * Opening the path per connection cost a path lookup and an open/close pair for
+ * every short-lived client. The path is now opened once. An inotify watch on its
+ * directory notices when the name is rotated away, deleted or taken by a new file
+ * or device node, without any work on the connection paths. The watcher then opens
+ * the path again and swaps the current descriptor. Descriptors are reference
+ * counted, because queued responses may still be reading from the old one.
+ * A device is closed with its last user, so the server does not keep its module
+ * loaded while no client is connected.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <libgen.h>
+#include <limits.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "aesd-storage.h"
+#include "aesd-control.h"
+#include "aesd-logger.h"
+
+/**
+ * Opens the storage path
+ * @return a descriptor with the storage's reference, or NULL on error (already logged)
+ */
+static struct storage_file_s *storage_file_open(struct storage_s *storage)
+{
+    struct storage_file_s *file = malloc(sizeof(struct storage_file_s));
+    if (file == NULL)
+    {
+        logger_log(LOG_ERR, "Failed to allocate memory for storage");
+        return NULL;
+    }
+    file->fd = open(storage->path, storage->flags | O_CLOEXEC, 0644);
+    if (file->fd < 0)
+    {
+        logger_log(LOG_ERR, "Failed to open file: %s, %s", storage->path, strerror(errno));
+        free(file);
+        return NULL;
+    }
+    file->refs = 1;
+    return file;
+}
+
+/**
+ * Makes the path current again if another file or node has taken its name, or
+ * recreates a regular file that was rotated away or deleted
+ */
+static void storage_check(struct storage_s *storage)
+{
+    pthread_mutex_lock(&storage->mutex);
+    struct storage_file_s *current = storage->current;
+    if (current == NULL)
+    {
+        // An idle device is opened by path for its next user anyway
+        pthread_mutex_unlock(&storage->mutex);
+        return;
+    }
+    if (storage->close_idle)
+    {
+        // The users of the old node keep it until they release it, the next one opens
+        // the path again
+        __atomic_store_n(&storage->current, NULL, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&storage->mutex);
+        return;
+    }
+    pthread_mutex_unlock(&storage->mutex);
+
+    struct stat path_st, file_st;
+    if (fstat(current->fd, &file_st) == -1)
+    {
+        logger_log(LOG_ERR, "Failed to stat %s: %s", storage->path, strerror(errno));
+        return;
+    }
+    if (stat(storage->path, &path_st) == 0)
+    {
+        if (path_st.st_dev == file_st.st_dev && path_st.st_ino == file_st.st_ino)
+        {
+            return;
+        }
+    }
+    else if (errno != ENOENT || !(storage->flags & O_CREAT) || !S_ISREG(file_st.st_mode))
+    {
+        // A removed device node is picked up when the driver creates it again
+        return;
+    }
+
+    struct storage_file_s *file = storage_file_open(storage);
+    if (file == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&storage->mutex);
+    __atomic_store_n(&storage->current, file, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&storage->mutex);
+    storage_release(storage, current);
+    logger_log(LOG_INFO, "Reopened %s", storage->path);
+}
+
+/**
+ * Watcher thread, follows the directory of the path until shutdown
+ */
+static void *storage_watcher(void *arg)
+{
+    struct storage_s *storage = (struct storage_s *)arg;
+    const char *name = strrchr(storage->path, '/');
+    name = name != NULL ? name + 1 : storage->path;
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (control_wait_readable(storage->watch_fd) > 0)
+    {
+        ssize_t length = read(storage->watch_fd, buffer, sizeof(buffer));
+        bool changed = false;
+        for (char *next = buffer; length > 0 && next < buffer + length;)
+        {
+            struct inotify_event *event = (struct inotify_event *)next;
+            if ((event->mask & IN_Q_OVERFLOW) || (event->len > 0 && strcmp(event->name, name) == 0))
+            {
+                changed = true;
+            }
+            next += sizeof(struct inotify_event) + event->len;
+        }
+        if (changed)
+        {
+            storage_check(storage);
+        }
+    }
+    return NULL;
+}
+
+int storage_open(struct storage_s *storage, const char *path, int flags)
+{
+    memset(storage, 0, sizeof(struct storage_s));
+    storage->path = path;
+    storage->flags = flags;
+    storage->watch_fd = -1;
+    storage->current = storage_file_open(storage);
+    if (storage->current == NULL)
+    {
+        storage->path = NULL;
+        return -1;
+    }
+    pthread_mutex_init(&storage->mutex, NULL);
+
+    // Opening the device once checks it is there, then it is left to the first user
+    struct stat st;
+    if (fstat(storage->current->fd, &st) == 0 && S_ISCHR(st.st_mode))
+    {
+        storage->close_idle = true;
+        storage_release(storage, storage->current);
+    }
+
+    // Serving goes on without the watch, only rotation is not followed
+    char directory[PATH_MAX];
+    snprintf(directory, sizeof(directory), "%s", path);
+    storage->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (storage->watch_fd == -1 ||
+        inotify_add_watch(storage->watch_fd, dirname(directory), IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO) ==
+            -1)
+    {
+        logger_log(LOG_WARNING, "Failed to watch %s for rotation: %s", path, strerror(errno));
+    }
+    else if (0 != pthread_create(&storage->watcher, 0, storage_watcher, (void *)storage))
+    {
+        logger_log(LOG_WARNING, "Failed to create storage watcher thread");
+    }
+    else
+    {
+        storage->watching = true;
+    }
+    return 0;
+}
+
+struct storage_file_s *storage_acquire(struct storage_s *storage)
+{
+    pthread_mutex_lock(&storage->mutex);
+    struct storage_file_s *file = storage->current;
+    if (file == NULL)
+    {
+        // The first user after an idle period opens the device again
+        file = storage_file_open(storage);
+        if (file == NULL)
+        {
+            pthread_mutex_unlock(&storage->mutex);
+            return NULL;
+        }
+        file->refs = 0;
+        __atomic_store_n(&storage->current, file, __ATOMIC_RELEASE);
+    }
+    file->refs++;
+    pthread_mutex_unlock(&storage->mutex);
+    return file;
+}
+
+void storage_release(struct storage_s *storage, struct storage_file_s *file)
+{
+    if (file == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&storage->mutex);
+    bool last = --file->refs == 0;
+    if (last && storage->current == file)
+    {
+        // Only an idle device, or the storage closing, drops the current descriptor
+        __atomic_store_n(&storage->current, NULL, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&storage->mutex);
+    if (last)
+    {
+        close(file->fd);
+        free(file);
+    }
+}
+
+void storage_refresh(struct storage_s *storage, struct storage_file_s **file)
+{
+    if (__atomic_load_n(&storage->current, __ATOMIC_ACQUIRE) == *file)
+    {
+        return;
+    }
+    struct storage_file_s *current = storage_acquire(storage);
+    if (current == NULL)
+    {
+        return;
+    }
+    storage_release(storage, *file);
+    *file = current;
+}
+
+void storage_close(struct storage_s *storage)
+{
+    if (storage->path == NULL)
+    {
+        return;
+    }
+    if (storage->watching)
+    {
+        pthread_join(storage->watcher, NULL);
+    }
+    if (storage->watch_fd >= 0)
+    {
+        close(storage->watch_fd);
+    }
+    if (!storage->close_idle)
+    {
+        storage_release(storage, storage->current);
+    }
+    pthread_mutex_destroy(&storage->mutex);
+    memset(storage, 0, sizeof(struct storage_s));
+}
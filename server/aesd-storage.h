@@ -0,0 +1,98 @@
+/*
+ * aesd-storage.h
+ *
+ *  The data file or device, opened once and shared by every connection, and opened
+ *  again when the path is rotated or the device node is recreated
+ */
+
+#ifndef AESD_STORAGE_H
+#define AESD_STORAGE_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+/**
+ * One open descriptor of the storage path
+ */
+struct storage_file_s
+{
+    int fd;
+    /**
+     * Held by the storage while the descriptor is current and by each user, guarded
+     * by the storage mutex. The descriptor is closed with the last one.
+     */
+    unsigned int refs;
+};
+
+/**
+ * Writes go through the shared descriptor and reads use pread, so users keep their
+ * read positions themselves. A watcher thread follows the directory of the path and,
+ * when another file or node takes the name, opens it and makes it current. Users move
+ * to the new descriptor with storage_refresh once nothing they queued refers to the
+ * old one.
+ *
+ * An open descriptor of a char device keeps its module loaded, so a device is only
+ * held open while some user has acquired it and is opened again for the next user
+ * after an idle period.
+ */
+struct storage_s
+{
+    const char *path;
+    int flags;
+    pthread_mutex_t mutex;
+    /**
+     * Current descriptor, loaded atomically by storage_refresh. NULL while a device
+     * is idle.
+     */
+    struct storage_file_s *current;
+    /**
+     * The path is a device, the storage holds no reference to its descriptor
+     */
+    bool close_idle;
+    int watch_fd;
+    pthread_t watcher;
+    bool watching;
+};
+
+/**
+ * Opens @param path with @param flags, mode 0644 when it is created, and starts
+ * watching it. Must be called after control_init.
+ * @return 0 on success, -1 on error (already logged)
+ */
+int storage_open(struct storage_s *storage, const char *path, int flags);
+
+/**
+ * @return a reference to the current descriptor, released with storage_release, or
+ * NULL if an idle device could not be opened again (already logged)
+ */
+struct storage_file_s *storage_acquire(struct storage_s *storage);
+
+/**
+ * Drops the reference in @param file, does nothing for NULL
+ */
+void storage_release(struct storage_s *storage, struct storage_file_s *file);
+
+/**
+ * Replaces the reference in @param file with one to the current descriptor if the
+ * path was opened again since, or keeps it if the path cannot be opened. Costs a
+ * single load otherwise.
+ */
+void storage_refresh(struct storage_s *storage, struct storage_file_s **file);
+
+/**
+ * Stops the watcher after shutdown has started and drops the current descriptor,
+ * which closes once every user has released it. Does nothing for a storage that was
+ * never opened or failed to open.
+ */
+void storage_close(struct storage_s *storage);
+
+/**
+ * @return the descriptor of @param file, or -1 for a user that writes through an
+ * index instead of the storage
+ */
+static inline int storage_file_fd(const struct storage_file_s *file)
+{
+    return file != NULL ? file->fd : -1;
+}
+
+#endif /* AESD_STORAGE_H */
@@ -0,0 +1,433 @@
+/**
+ * @file aesd-threadpool.c
+ * @brief Fixed-size worker thread pool with work-stealing deques
+ *
+ * Every worker owns a bounded deque. The submitting thread deals tasks to the
+ * deques round robin. A worker pops the oldest task from the top of its own deque,
+ * so tasks run in the order they were dealt, and when that is empty steals the
+ * oldest task from the top of the other workers' deques, so a burst landing on busy
+ * workers is picked up by idle ones. Idle workers sleep on a shared condition variable.
+ *
+ * Tasks waiting for a file descriptor to become ready are parked in the pool's epoll
+ * set, registered one-shot, and a watcher thread submits each one when its
+ * descriptor fires. A task therefore holds a worker only while it has work to do.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "aesdsocket.h"
+#include "aesd-threadpool.h"
+#include "aesd-control.h"
+#include "aesd-logger.h"
+
+#define THREADPOOL_MAX_EVENTS 64
+
+/**
+ * Marks the shutdown eventfd in the watcher's epoll events
+ */
+static char threadpool_shutdown_event;
+
+struct threadpool_task_s
+{
+    threadpool_function_t function;
+    void *arg;
+};
+
+struct threadpool_deque_s
+{
+    pthread_mutex_t mutex;
+    struct threadpool_task_s tasks[THREADPOOL_DEQUE_CAPACITY];
+    /**
+     * Index of the oldest task, popped by the owner and stolen by other workers
+     */
+    size_t top;
+    /**
+     * Index one past the newest task, pushed by the submitter
+     */
+    size_t bottom;
+};
+
+struct threadpool_worker_s
+{
+    pthread_t thread;
+    bool started;
+    int index;
+    struct threadpool_s *pool;
+    struct threadpool_deque_s deque;
+};
+
+struct threadpool_s
+{
+    int workers;
+    struct threadpool_worker_s *worker;
+    /**
+     * Count of submissions, selecting the worker that receives the next task,
+     * accessed atomically
+     */
+    unsigned int next;
+    pthread_mutex_t idle_mutex;
+    pthread_cond_t idle_cond;
+    /**
+     * Number of tasks queued across all deques, protected by idle_mutex
+     */
+    size_t pending;
+    /**
+     * Epoll set of the parked tasks' descriptors, waited on by the watcher thread
+     */
+    int epoll_fd;
+    pthread_t watcher;
+    bool watcher_started;
+    /**
+     * Number of parked tasks, protected by idle_mutex
+     */
+    size_t parked;
+    /**
+     * The watcher thread still submits parked tasks, protected by idle_mutex
+     */
+    bool watching;
+};
+
+static bool threadpool_deque_push(struct threadpool_deque_s *deque, const struct threadpool_task_s *task)
+{
+    bool pushed = false;
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->bottom - deque->top < THREADPOOL_DEQUE_CAPACITY)
+    {
+        deque->tasks[deque->bottom % THREADPOOL_DEQUE_CAPACITY] = *task;
+        deque->bottom++;
+        pushed = true;
+    }
+    pthread_mutex_unlock(&deque->mutex);
+    return pushed;
+}
+
+static bool threadpool_deque_pop(struct threadpool_deque_s *deque, struct threadpool_task_s *task)
+{
+    bool popped = false;
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->bottom != deque->top)
+    {
+        *task = deque->tasks[deque->top % THREADPOOL_DEQUE_CAPACITY];
+        deque->top++;
+        popped = true;
+    }
+    pthread_mutex_unlock(&deque->mutex);
+    return popped;
+}
+
+static bool threadpool_deque_steal(struct threadpool_deque_s *deque, struct threadpool_task_s *task)
+{
+    bool stolen = false;
+    // Never wait on a busy victim, just try the next one
+    if (pthread_mutex_trylock(&deque->mutex) != 0)
+    {
+        return false;
+    }
+    if (deque->bottom != deque->top)
+    {
+        *task = deque->tasks[deque->top % THREADPOOL_DEQUE_CAPACITY];
+        deque->top++;
+        stolen = true;
+    }
+    pthread_mutex_unlock(&deque->mutex);
+    return stolen;
+}
+
+/**
+ * Takes a task from the worker's own deque or steals one from another worker
+ * @return true if @param task was filled in
+ */
+static bool threadpool_take(struct threadpool_worker_s *worker, struct threadpool_task_s *task)
+{
+    struct threadpool_s *pool = worker->pool;
+    bool found = threadpool_deque_pop(&worker->deque, task);
+
+    for (int i = 1; !found && i < pool->workers; i++)
+    {
+        struct threadpool_worker_s *victim = &pool->worker[(worker->index + i) % pool->workers];
+        found = threadpool_deque_steal(&victim->deque, task);
+    }
+
+    if (found)
+    {
+        pthread_mutex_lock(&pool->idle_mutex);
+        pool->pending--;
+        pthread_mutex_unlock(&pool->idle_mutex);
+    }
+    return found;
+}
+
+/**
+ * Pushes @param task onto the next deque in turn that has room and wakes a worker.
+ * With @param unpark the task stops counting as parked in the same step, so a worker
+ * never sees it as neither.
+ * @return 0 on success, -1 if every worker deque is full
+ */
+static int threadpool_queue(struct threadpool_s *pool, const struct threadpool_task_s *task, bool unpark)
+{
+    // Several accept loops may submit at once
+    unsigned int next = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < pool->workers; i++)
+    {
+        struct threadpool_worker_s *worker = &pool->worker[(next + i) % pool->workers];
+        if (threadpool_deque_push(&worker->deque, task))
+        {
+            pthread_mutex_lock(&pool->idle_mutex);
+            pool->pending++;
+            if (unpark)
+            {
+                pool->parked--;
+            }
+            pthread_cond_signal(&pool->idle_cond);
+            pthread_mutex_unlock(&pool->idle_mutex);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Submits the parked tasks as their descriptors become ready. After shutdown starts
+ * it keeps going until every parked task has been submitted, their descriptors are
+ * shut down by then and fire at once.
+ */
+static void *threadpool_watcher_thread(void *data)
+{
+    struct threadpool_s *pool = (struct threadpool_s *)data;
+    struct epoll_event events[THREADPOOL_MAX_EVENTS];
+
+    while (true)
+    {
+        // Stopping under the mutex, a task is either parked before or refused after
+        pthread_mutex_lock(&pool->idle_mutex);
+        if (exit_flag && pool->parked == 0)
+        {
+            pool->watching = false;
+            pthread_mutex_unlock(&pool->idle_mutex);
+            break;
+        }
+        pthread_mutex_unlock(&pool->idle_mutex);
+
+        int count = epoll_wait(pool->epoll_fd, events, THREADPOOL_MAX_EVENTS, -1);
+        if (count == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            logger_log(LOG_ERR, "epoll_wait() failed: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            struct threadpool_wait_s *wait = events[i].data.ptr;
+            if (wait == (void *)&threadpool_shutdown_event)
+            {
+                // Stays readable, only the parked descriptors are waited for from now on
+                epoll_ctl(pool->epoll_fd, EPOLL_CTL_DEL, control_shutdown_fd(), NULL);
+                continue;
+            }
+            struct threadpool_task_s task = {wait->function, wait->arg};
+            if (threadpool_queue(pool, &task, true) != 0)
+            {
+                // Still ready, so rearming retries once a worker made room
+                logger_log(LOG_WARNING, "Thread pool queue full, delaying ready task");
+                struct epoll_event event = {0};
+                event.events = wait->events | EPOLLONESHOT;
+                event.data.ptr = wait;
+                epoll_ctl(pool->epoll_fd, EPOLL_CTL_MOD, wait->fd, &event);
+            }
+        }
+    }
+
+    pthread_mutex_lock(&pool->idle_mutex);
+    pool->watching = false;
+    pthread_cond_broadcast(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_mutex);
+    return data;
+}
+
+static void *threadpool_worker_thread(void *data)
+{
+    struct threadpool_worker_s *worker = (struct threadpool_worker_s *)data;
+    struct threadpool_s *pool = worker->pool;
+    struct threadpool_task_s task;
+
+    while (true)
+    {
+        if (threadpool_take(worker, &task))
+        {
+            task.function(task.arg);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->idle_mutex);
+        // Tasks still queued or parked at exit are run so they can release their resources
+        if (exit_flag && pool->pending == 0 && !pool->watching)
+        {
+            pthread_mutex_unlock(&pool->idle_mutex);
+            break;
+        }
+        // threadpool_join broadcasts once exit_flag is set, so there is no need to time out
+        if (pool->pending == 0)
+        {
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_mutex);
+        }
+        pthread_mutex_unlock(&pool->idle_mutex);
+    }
+
+    return data;
+}
+
+struct threadpool_s *threadpool_start(int workers)
+{
+    struct threadpool_s *pool = calloc(1, sizeof(struct threadpool_s));
+    if (pool == NULL)
+    {
+        logger_log(LOG_ERR, "Failed to allocate memory for thread pool");
+        return NULL;
+    }
+    pool->worker = calloc(workers, sizeof(struct threadpool_worker_s));
+    if (pool->worker == NULL)
+    {
+        logger_log(LOG_ERR, "Failed to allocate memory for thread pool workers");
+        free(pool);
+        return NULL;
+    }
+    pool->workers = workers;
+    pthread_mutex_init(&pool->idle_mutex, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+
+    for (int i = 0; i < workers; i++)
+    {
+        struct threadpool_worker_s *worker = &pool->worker[i];
+        worker->index = i;
+        worker->pool = pool;
+        pthread_mutex_init(&worker->deque.mutex, NULL);
+    }
+
+    pool->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (pool->epoll_fd == -1)
+    {
+        logger_log(LOG_ERR, "Failed to create epoll instance: %s", strerror(errno));
+        control_shutdown();
+        threadpool_join(pool);
+        return NULL;
+    }
+    // Wakes the watcher when shutdown starts
+    struct epoll_event event = {0};
+    event.events = EPOLLIN;
+    event.data.ptr = &threadpool_shutdown_event;
+    if (epoll_ctl(pool->epoll_fd, EPOLL_CTL_ADD, control_shutdown_fd(), &event) == -1)
+    {
+        logger_log(LOG_ERR, "Failed to add shutdown eventfd to epoll: %s", strerror(errno));
+        control_shutdown();
+        threadpool_join(pool);
+        return NULL;
+    }
+    pool->watching = true;
+    if (0 != pthread_create(&pool->watcher, 0, threadpool_watcher_thread, (void *)pool))
+    {
+        logger_log(LOG_ERR, "Failed to create pool watcher thread");
+        pool->watching = false;
+        control_shutdown();
+        threadpool_join(pool);
+        return NULL;
+    }
+    pool->watcher_started = true;
+
+    for (int i = 0; i < workers; i++)
+    {
+        struct threadpool_worker_s *worker = &pool->worker[i];
+        if (0 != pthread_create(&worker->thread, 0, threadpool_worker_thread, (void *)worker))
+        {
+            logger_log(LOG_ERR, "Failed to create worker thread");
+            control_shutdown();
+            threadpool_join(pool);
+            return NULL;
+        }
+        worker->started = true;
+    }
+
+    logger_log(LOG_INFO, "Started %d pool worker threads", workers);
+    return pool;
+}
+
+int threadpool_submit(struct threadpool_s *pool, threadpool_function_t function, void *arg)
+{
+    struct threadpool_task_s task = {function, arg};
+    return threadpool_queue(pool, &task, false);
+}
+
+int threadpool_submit_when_ready(struct threadpool_s *pool, struct threadpool_wait_s *wait, uint32_t events)
+{
+    pthread_mutex_lock(&pool->idle_mutex);
+    bool watching = pool->watching;
+    if (watching)
+    {
+        // Counted before arming, the watcher may submit it right away
+        pool->parked++;
+    }
+    pthread_mutex_unlock(&pool->idle_mutex);
+    if (!watching)
+    {
+        return -1;
+    }
+
+    // Once armed the task may already run on another worker, so nothing is written after
+    int op = wait->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    wait->events = events;
+    wait->registered = true;
+    struct epoll_event event = {0};
+    event.events = events | EPOLLONESHOT;
+    event.data.ptr = wait;
+    if (epoll_ctl(pool->epoll_fd, op, wait->fd, &event) == -1)
+    {
+        logger_log(LOG_ERR, "Failed to park task in epoll: %s", strerror(errno));
+        wait->registered = op == EPOLL_CTL_MOD;
+        pthread_mutex_lock(&pool->idle_mutex);
+        pool->parked--;
+        pthread_mutex_unlock(&pool->idle_mutex);
+        return -1;
+    }
+    return 0;
+}
+
+void threadpool_join(struct threadpool_s *pool)
+{
+    pthread_mutex_lock(&pool->idle_mutex);
+    pthread_cond_broadcast(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_mutex);
+
+    if (pool->watcher_started)
+    {
+        pthread_join(pool->watcher, NULL);
+    }
+
+    for (int i = 0; i < pool->workers; i++)
+    {
+        if (pool->worker[i].started)
+        {
+            pthread_join(pool->worker[i].thread, NULL);
+        }
+        pthread_mutex_destroy(&pool->worker[i].deque.mutex);
+    }
+
+    if (pool->epoll_fd >= 0)
+    {
+        close(pool->epoll_fd);
+    }
+    pthread_cond_destroy(&pool->idle_cond);
+    pthread_mutex_destroy(&pool->idle_mutex);
+    free(pool->worker);
+    free(pool);
+}
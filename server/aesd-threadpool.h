@@ -0,0 +1,69 @@
+/*
+ * aesd-threadpool.h
+ *
+ *  Fixed-size worker thread pool with per-worker work-stealing deques
+ */
+
+#ifndef AESD_THREADPOOL_H
+#define AESD_THREADPOOL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Tasks queued per worker before threadpool_submit spills to the next worker
+ */
+#define THREADPOOL_DEQUE_CAPACITY 256
+
+typedef void *(*threadpool_function_t)(void *arg);
+
+struct threadpool_s;
+
+/**
+ * A task parked until its file descriptor is ready, owned by the caller and
+ * reused for every wait on the same descriptor
+ */
+struct threadpool_wait_s
+{
+    int fd;
+    threadpool_function_t function;
+    void *arg;
+    /**
+     * Epoll events waited for
+     */
+    uint32_t events;
+    /**
+     * The descriptor is in the pool's epoll set, it leaves it when closed
+     */
+    bool registered;
+};
+
+/**
+ * Starts @param workers worker threads
+ * @return the pool, or NULL on failure (already logged)
+ */
+struct threadpool_s *threadpool_start(int workers);
+
+/**
+ * Queues @param function to be called with @param arg on one of the workers, the
+ * next one in turn that has room. Safe to call from several threads.
+ * @return 0 on success, -1 if every worker deque is full
+ */
+int threadpool_submit(struct threadpool_s *pool, threadpool_function_t function, void *arg);
+
+/**
+ * Parks @param wait until its descriptor reports one of the epoll @param events, then
+ * queues its function like threadpool_submit. The caller must not touch @param wait
+ * again until the function runs.
+ * @return 0 on success, -1 if the task could not be parked or shutdown has drained
+ * the parked tasks, in which case the caller still owns it
+ */
+int threadpool_submit_when_ready(struct threadpool_s *pool, struct threadpool_wait_s *wait, uint32_t events);
+
+/**
+ * Waits for the workers to run every queued and parked task and exit after exit_flag
+ * is set, then frees @param pool
+ */
+void threadpool_join(struct threadpool_s *pool);
+
+#endif /* AESD_THREADPOOL_H */
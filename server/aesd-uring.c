@@ -0,0 +1,548 @@
+/**
+ * @file aesd-uring.c
+ * @brief io_uring backend for the aesdsocket append and replay path
+ *
+ * Talks to the kernel through the raw io_uring syscalls so no liburing is needed.
+ * A data packet is appended with a WRITE linked to the first READ_FIXED of the
+ * replay, so both complete in one io_uring_enter under the data file mutex. The
+ * append-only data file's replay is then sent after releasing the mutex, alternating
+ * between two registered buffers, sending one while the next chunk of the file is
+ * read into the other, again linked and submitted together. Compared to the
+ * write, lseek and 1 KB read/send loop this is one syscall per 64 KB of replay.
+ * The char driver drops its oldest writes, so there the replay is read through the
+ * ring while the mutex is held and sent from the connection's send queue.
+ * Packets are received through the ring as well.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "aesdsocket.h"
+#include "aesd-uring.h"
+#include "aesd-metrics.h"
+#include "aesd-logger.h"
+
+#ifdef HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 8
+
+enum uring_op_e
+{
+    URING_OP_WRITE = 1,
+    URING_OP_READ,
+    URING_OP_SEND,
+    URING_OP_RECV,
+};
+
+struct uring_s
+{
+    int ring_fd;
+    unsigned int sq_entries;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+    unsigned int to_submit;
+    char *buffers[2];
+};
+
+static pthread_key_t uring_key;
+static pthread_once_t uring_key_once = PTHREAD_ONCE_INIT;
+// Stored for threads where ring creation failed so it is only attempted once
+static char uring_unavailable;
+
+static void uring_destroy(struct uring_s *ring)
+{
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+    {
+        munmap(ring->cq_ptr, ring->cq_size);
+    }
+    if (ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED)
+    {
+        munmap(ring->sq_ptr, ring->sq_size);
+    }
+    if (ring->ring_fd >= 0)
+    {
+        close(ring->ring_fd);
+    }
+    free(ring->buffers[0]);
+    free(ring->buffers[1]);
+    free(ring);
+}
+
+static struct uring_s *uring_create(void)
+{
+    struct uring_s *ring = calloc(1, sizeof(struct uring_s));
+    if (ring == NULL)
+    {
+        logger_log(LOG_ERR, "Failed to allocate memory for io_uring");
+        return NULL;
+    }
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->ring_fd < 0)
+    {
+        logger_log(LOG_WARNING, "io_uring not available, using read/send path: %s", strerror(errno));
+        ring->ring_fd = -1;
+        uring_destroy(ring);
+        return NULL;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        // IORING_OP_SEND and friends need a newer kernel than this anyway
+        logger_log(LOG_WARNING, "io_uring too old, using read/send path");
+        uring_destroy(ring);
+        return NULL;
+    }
+
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (ring->cq_size > ring->sq_size)
+    {
+        ring->sq_size = ring->cq_size;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->ring_fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+    {
+        logger_log(LOG_ERR, "Failed to map io_uring rings: %s", strerror(errno));
+        uring_destroy(ring);
+        return NULL;
+    }
+    ring->cq_ptr = ring->sq_ptr;
+    ring->cq_size = ring->sq_size;
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        logger_log(LOG_ERR, "Failed to map io_uring submission entries: %s", strerror(errno));
+        uring_destroy(ring);
+        return NULL;
+    }
+
+    char *sq = ring->sq_ptr;
+    char *cq = ring->cq_ptr;
+    ring->sq_entries = params.sq_entries;
+    ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    struct iovec iov[2];
+    for (int i = 0; i < 2; i++)
+    {
+        ring->buffers[i] = malloc(URING_BUFFER_SIZE);
+        if (ring->buffers[i] == NULL)
+        {
+            logger_log(LOG_ERR, "Failed to allocate memory for io_uring buffers");
+            uring_destroy(ring);
+            return NULL;
+        }
+        iov[i].iov_base = ring->buffers[i];
+        iov[i].iov_len = URING_BUFFER_SIZE;
+    }
+    if (syscall(__NR_io_uring_register, ring->ring_fd, IORING_REGISTER_BUFFERS, iov, 2) < 0)
+    {
+        logger_log(LOG_WARNING, "Failed to register io_uring buffers, using read/send path: %s", strerror(errno));
+        uring_destroy(ring);
+        return NULL;
+    }
+
+    return ring;
+}
+
+static void uring_thread_exit(void *data)
+{
+    if (data != &uring_unavailable)
+    {
+        uring_destroy((struct uring_s *)data);
+    }
+}
+
+static void uring_key_create(void)
+{
+    pthread_key_create(&uring_key, uring_thread_exit);
+}
+
+struct uring_s *uring_thread_ring(void)
+{
+    pthread_once(&uring_key_once, uring_key_create);
+
+    void *ring = pthread_getspecific(uring_key);
+    if (ring == NULL)
+    {
+        ring = uring_create();
+        pthread_setspecific(uring_key, ring ? ring : &uring_unavailable);
+    }
+    return ring == &uring_unavailable ? NULL : ring;
+}
+
+/**
+ * Claims the next submission queue entry. The ring only ever holds the two
+ * linked operations of one step, so it cannot run out of entries.
+ */
+static struct io_uring_sqe *uring_get_sqe(struct uring_s *ring, uint8_t opcode, int fd, uint64_t user_data)
+{
+    unsigned int tail = *ring->sq_tail + ring->to_submit;
+    unsigned int index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    ring->to_submit++;
+    return sqe;
+}
+
+static void uring_prep_read(struct uring_s *ring, int fd, int buffer, off_t offset, size_t length)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, IORING_OP_READ_FIXED, fd, URING_OP_READ);
+    sqe->addr = (uintptr_t)ring->buffers[buffer];
+    sqe->len = length < URING_BUFFER_SIZE ? length : URING_BUFFER_SIZE;
+    sqe->off = offset;
+    sqe->buf_index = buffer;
+}
+
+/**
+ * Submits every prepared entry and waits for @param count completions, storing
+ * the result of each operation by its enum uring_op_e index in @param results
+ * @return 0 on success, -1 if io_uring_enter failed
+ */
+static int uring_submit_and_wait(struct uring_s *ring, unsigned int count, int results[])
+{
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->to_submit, __ATOMIC_RELEASE);
+    unsigned int to_submit = ring->to_submit;
+    ring->to_submit = 0;
+
+    while (count > 0)
+    {
+        unsigned int head = *ring->cq_head;
+        if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            if (syscall(__NR_io_uring_enter, ring->ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+            {
+                if (errno == EINTR)
+                {
+                    to_submit = 0;
+                    continue;
+                }
+                logger_log(LOG_ERR, "io_uring_enter failed: %s", strerror(errno));
+                return -1;
+            }
+            to_submit = 0;
+            continue;
+        }
+
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        results[cqe->user_data] = cqe->res;
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+        count--;
+    }
+    return 0;
+}
+
+/**
+ * Applies the packet on @param fd and reads the first chunk of its response into
+ * buffer 0, the append linked to the read. Called with the data file mutex held.
+ * @param offset set to the file offset the response starts at
+ * @return 0 on success with the read's result in @param results, -1 on error (already logged)
+ */
+static int uring_apply_packet(struct uring_s *ring, int fd, const char *packet, size_t packet_size, off_t *offset,
+                              int results[])
+{
+    struct command_s command;
+
+    *offset = 0;
+    if (command_parse(packet, packet_size, &command) == COMMAND_SEEKTO)
+    {
+        if (ioctl(fd, AESDCHAR_IOCSEEKTO, &command.seekto) < 0)
+        {
+            logger_log(LOG_ERR, "IOCTL error %s", strerror(errno));
+            return -1;
+        }
+        *offset = lseek(fd, 0, SEEK_CUR);
+        if (*offset < 0)
+        {
+            logger_log(LOG_ERR, "Failed to get file position: %s", strerror(errno));
+            return -1;
+        }
+        uring_prep_read(ring, fd, 0, *offset, URING_BUFFER_SIZE);
+        return uring_submit_and_wait(ring, 1, results);
+    }
+
+    // Append the packet, then read from the start of the file
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, IORING_OP_WRITE, fd, URING_OP_WRITE);
+    sqe->addr = (uintptr_t)packet;
+    sqe->len = packet_size;
+    sqe->off = (uint64_t)-1;
+    sqe->flags = IOSQE_IO_LINK;
+    uring_prep_read(ring, fd, 0, 0, URING_BUFFER_SIZE);
+    if (uring_submit_and_wait(ring, 2, results) != 0)
+    {
+        return -1;
+    }
+    if (results[URING_OP_WRITE] < 0)
+    {
+        logger_log(LOG_ERR, "Failed to write data to file: %s", strerror(-results[URING_OP_WRITE]));
+        return -1;
+    }
+    return 0;
+}
+
+#ifdef USE_AESD_CHAR_DEVICE
+/**
+ * Copies the response from @param offset onto @param queue, the first chunk already
+ * read into buffer 0, reading the rest through the ring. Called with the data file
+ * mutex held.
+ * @return 0 on success, -1 on error (already logged)
+ */
+static int uring_copy_response(struct uring_s *ring, int fd, off_t offset, int results[], struct send_queue_s *queue)
+{
+    while (results[URING_OP_READ] > 0)
+    {
+        if (send_queue_sink(queue, ring->buffers[0], results[URING_OP_READ]) != 0)
+        {
+            return -1;
+        }
+        offset += results[URING_OP_READ];
+        uring_prep_read(ring, fd, 0, offset, URING_BUFFER_SIZE);
+        if (uring_submit_and_wait(ring, 1, results) != 0)
+        {
+            return -1;
+        }
+    }
+    if (results[URING_OP_READ] < 0)
+    {
+        logger_log(LOG_ERR, "Failed to read file: %s", strerror(-results[URING_OP_READ]));
+        return -1;
+    }
+    return 0;
+}
+#else
+static int uring_send_remaining(int sock, const char *data, size_t length)
+{
+    size_t bytes_sent = 0;
+    while (bytes_sent < length)
+    {
+        ssize_t sent = send(sock, data + bytes_sent, length - bytes_sent, 0);
+        if (sent == -1)
+        {
+            logger_log(LOG_ERR, "Failed to send buffer: %s", strerror(errno));
+            return -1;
+        }
+        bytes_sent += sent;
+    }
+    return 0;
+}
+
+/**
+ * Sends bytes [@param offset, @param end) of @param fd to the blocking socket @param sock,
+ * the first chunk already read into buffer 0. Each chunk is sent while the next one is
+ * read into the other buffer, linked and submitted together.
+ * @return 0 on success, -1 on error (already logged)
+ */
+static int uring_send_response(struct uring_s *ring, int fd, int sock, off_t offset, off_t end, int results[])
+{
+    int buffer = 0;
+
+    while (results[URING_OP_READ] > 0)
+    {
+        // Reads stop at end, so bytes appended since are not part of the response
+        int ready = results[URING_OP_READ];
+        offset += ready;
+
+        // Send this chunk while the next one is read into the other buffer
+        struct io_uring_sqe *sqe = uring_get_sqe(ring, IORING_OP_SEND, sock, URING_OP_SEND);
+        sqe->addr = (uintptr_t)ring->buffers[buffer];
+        sqe->len = ready;
+        if (offset < end)
+        {
+            sqe->flags = IOSQE_IO_LINK;
+            uring_prep_read(ring, fd, !buffer, offset, end - offset);
+        }
+        else
+        {
+            results[URING_OP_READ] = 0;
+        }
+        if (uring_submit_and_wait(ring, offset < end ? 2 : 1, results) != 0)
+        {
+            return -1;
+        }
+
+        if (results[URING_OP_SEND] < 0)
+        {
+            logger_log(LOG_ERR, "Failed to send buffer: %s", strerror(-results[URING_OP_SEND]));
+            return -1;
+        }
+        if (results[URING_OP_SEND] < ready)
+        {
+            // A short send breaks the link, finish it here and redo the read
+            if (uring_send_remaining(sock, ring->buffers[buffer] + results[URING_OP_SEND],
+                                     ready - results[URING_OP_SEND]) != 0)
+            {
+                return -1;
+            }
+            if (offset < end && results[URING_OP_READ] == -ECANCELED)
+            {
+                uring_prep_read(ring, fd, !buffer, offset, end - offset);
+                if (uring_submit_and_wait(ring, 1, results) != 0)
+                {
+                    return -1;
+                }
+            }
+        }
+        metrics_add(METRICS_BYTES_OUT, ready);
+        buffer = !buffer;
+    }
+
+    if (results[URING_OP_READ] < 0)
+    {
+        logger_log(LOG_ERR, "Failed to read file: %s", strerror(-results[URING_OP_READ]));
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+int uring_handle_packet(struct uring_s *ring, int fd, pthread_mutex_t *mutex, struct send_queue_s *queue,
+                        const char *packet, size_t packet_size)
+{
+    int results[URING_OP_RECV + 1];
+    uint64_t started = metrics_now();
+    uint64_t locked_at;
+    off_t offset;
+
+    if (0 != data_file_lock(mutex, &locked_at))
+    {
+        return -1;
+    }
+    int ret = uring_apply_packet(ring, fd, packet, packet_size, &offset, results);
+#ifdef USE_AESD_CHAR_DEVICE
+    // The driver drops its oldest writes, so the response is copied while they are still there
+    if (ret == 0)
+    {
+        ret = uring_copy_response(ring, fd, offset, results, queue);
+    }
+#else
+    // Only appends follow, so the response ends at the current end of the file for good
+    off_t end = offset + (results[URING_OP_READ] > 0 ? results[URING_OP_READ] : 0);
+    struct stat st;
+    if (ret == 0 && results[URING_OP_READ] == URING_BUFFER_SIZE)
+    {
+        if (fstat(fd, &st) == -1)
+        {
+            logger_log(LOG_ERR, "Failed to stat data file: %s", strerror(errno));
+            ret = -1;
+        }
+        end = st.st_size;
+    }
+#endif
+    if (0 != data_file_unlock(mutex, locked_at))
+    {
+        ret = -1;
+    }
+
+#ifdef USE_AESD_CHAR_DEVICE
+    if (ret != 0)
+    {
+        send_queue_discard(queue);
+        return -1;
+    }
+    return send_queue_commit(queue, started);
+#else
+    if (ret != 0)
+    {
+        return -1;
+    }
+    uint64_t sent_before = metrics_thread_value(METRICS_BYTES_OUT);
+    ret = uring_send_response(ring, fd, queue->sock, offset, end, results);
+    metrics_observe(METRICS_REPLAY_SIZE, metrics_thread_value(METRICS_BYTES_OUT) - sent_before);
+    metrics_observe(METRICS_RESPONSE_LATENCY, metrics_now() - started);
+    return ret;
+#endif
+}
+
+ssize_t uring_recv(struct uring_s *ring, int sock, void *buffer, size_t length, int flags)
+{
+    int results[URING_OP_RECV + 1];
+
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, IORING_OP_RECV, sock, URING_OP_RECV);
+    sqe->addr = (uintptr_t)buffer;
+    sqe->len = length;
+    sqe->msg_flags = flags;
+    if (uring_submit_and_wait(ring, 1, results) != 0)
+    {
+        return -1;
+    }
+    if (results[URING_OP_RECV] < 0)
+    {
+        errno = -results[URING_OP_RECV];
+        return -1;
+    }
+    return results[URING_OP_RECV];
+}
+
+#else
+
+struct uring_s *uring_thread_ring(void)
+{
+    static bool logged = false;
+    if (!logged)
+    {
+        logged = true;
+        logger_log(LOG_WARNING, "Built without io_uring support, using read/send path");
+    }
+    return NULL;
+}
+
+int uring_handle_packet(struct uring_s *ring, int fd, pthread_mutex_t *mutex, struct send_queue_s *queue,
+                        const char *packet, size_t packet_size)
+{
+    return -1;
+}
+
+ssize_t uring_recv(struct uring_s *ring, int sock, void *buffer, size_t length, int flags)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
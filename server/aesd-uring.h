@@ -0,0 +1,48 @@
+/*
+ * aesd-uring.h
+ *
+ *  Optional io_uring backend for the aesdsocket append and replay path.
+ *  Built when the toolchain provides linux/io_uring.h (HAVE_IO_URING), otherwise
+ *  uring_thread_ring() always reports the backend as unavailable.
+ */
+
+#ifndef AESD_URING_H
+#define AESD_URING_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "aesd-sendqueue.h"
+
+/**
+ * Size of each of the two registered buffers the data file is replayed through
+ */
+#define URING_BUFFER_SIZE 65536
+
+struct uring_s;
+
+/**
+ * Returns the calling thread's ring, creating it on first use. The ring is torn
+ * down when the thread exits.
+ * @return the ring, or NULL if io_uring is not available (logged once per thread)
+ */
+struct uring_s *uring_thread_ring(void);
+
+/**
+ * Applies the packet on @param fd like apply_packet under the data file @param mutex
+ * and answers it with the resulting file contents through linked requests. The
+ * append-only data file is sent to the blocking socket of the empty @param queue
+ * after the mutex is released, the char device's contents are copied onto
+ * @param queue while it is held.
+ * @return 0 on success, -1 on any error (already logged)
+ */
+int uring_handle_packet(struct uring_s *ring, int fd, pthread_mutex_t *mutex, struct send_queue_s *queue,
+                        const char *packet, size_t packet_size);
+
+/**
+ * recv() through the ring
+ * @return as recv(), with errno set on error
+ */
+ssize_t uring_recv(struct uring_s *ring, int sock, void *buffer, size_t length, int flags);
+
+#endif /* AESD_URING_H */
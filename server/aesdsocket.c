@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,22 +11,25 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <poll.h>
+#include <sys/epoll.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/queue.h>
 #include <pthread.h>
 #include <time.h>
-#include "../aesd-char-driver/aesd_ioctl.h"
-#include <sys/ioctl.h>
-
-#define TAG "aesdsocket"
-#ifdef USE_AESD_CHAR_DEVICE
-#define WRITE_FILE "/dev/aesdchar"
-#else
-#define WRITE_FILE "/var/tmp/aesdsocketdata"
-#endif
-#define PORT 9000
-#define BUFFER_SIZE 4096
+#include <sys/timerfd.h>
+#include "aesdsocket.h"
+#include "aesd-reactor.h"
+#include "aesd-threadpool.h"
+#include "aesd-uring.h"
+#include "aesd-framing.h"
+#include "aesd-pool.h"
+#include "aesd-metrics.h"
+#include "aesd-listener.h"
+#include "aesd-control.h"
+#include "aesd-binary.h"
+#include "aesd-logger.h"
 
 struct thread_data_s
 {
@@ -35,294 +39,1338 @@ struct thread_data_s
     socklen_t client_addr_len;
     int client_sock;
     pthread_t thread;
-    int fd;
+    /**
+     * Reference to the shared data file descriptor
+     */
+    struct storage_file_s *file;
     pthread_mutex_t *mutex;
+    /**
+     * Segment index of the data file when using snapshot replay, otherwise NULL
+     */
+    struct segment_index_s *index;
+    enum binary_protocol_e protocol;
+    struct packet_ring_s ring;
+    struct send_queue_s queue;
+    /**
+     * The ring may hold complete packets not handled yet
+     */
+    bool packets_buffered;
+    /**
+     * The client closed its side, the connection closes once the queue is sent
+     */
+    bool input_closed;
+    char client_ip[INET_ADDRSTRLEN];
+    /**
+     * Pool servicing the connection in the pool mode, otherwise NULL
+     */
+    struct threadpool_s *pool;
+    /**
+     * Readiness wait the connection parks on between its pool tasks
+     */
+    struct threadpool_wait_s wait;
     SLIST_ENTRY(thread_data_s)
     entries;
+    LIST_ENTRY(thread_data_s)
+    active_entries;
 };
 SLIST_HEAD(thread_data_head_t, thread_data_s);
 
+/**
+ * An accept loop serving one of the listening sockets
+ */
+struct listener_shard_s
+{
+    pthread_t thread;
+    bool started;
+    int shard;
+    int sock;
+    pthread_mutex_t *mutex;
+    struct segment_index_s *index;
+    /**
+     * Pool receiving the accepted connections in the pool mode, otherwise NULL
+     */
+    struct threadpool_s *pool;
+};
+
+struct listener_set_s
+{
+    struct listener_shard_s *shards;
+    struct threadpool_s *pool;
+};
+
 struct timestamp_data_s
 {
-    int fd;
     pthread_mutex_t *mutex;
+    struct segment_index_s *index;
 };
 
-static volatile sig_atomic_t exit_flag = false;
+volatile sig_atomic_t exit_flag = false;
+struct storage_s data_storage;
+static struct server_config_s config;
+
+/**
+ * Connections serviced by connection_thread, so shutdown can wake the ones blocked
+ * on their socket
+ */
+static LIST_HEAD(active_connection_head_t, thread_data_s) active_connections = LIST_HEAD_INITIALIZER(active_connections);
+static pthread_mutex_t active_connections_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int data_file_lock(pthread_mutex_t *mutex, uint64_t *locked_at)
+{
+    uint64_t start = metrics_now();
+    if (0 != pthread_mutex_lock(mutex))
+    {
+        logger_log(LOG_ERR, "Failed to lock mutex");
+        return -1;
+    }
+    *locked_at = metrics_now();
+    metrics_observe(METRICS_LOCK_WAIT, *locked_at - start);
+    return 0;
+}
+
+int data_file_unlock(pthread_mutex_t *mutex, uint64_t locked_at)
+{
+    metrics_observe(METRICS_LOCK_HOLD, metrics_now() - locked_at);
+    if (0 != pthread_mutex_unlock(mutex))
+    {
+        logger_log(LOG_ERR, "Failed to unlock mutex");
+        return -1;
+    }
+    return 0;
+}
+
+int apply_packet(int fd, const char *packet, size_t packet_size, off_t *start)
+{
+    int ret = 0;
+
+    // Check to see if it is a command packet
+    struct command_s command;
 
-void signal_handler(int signal)
+    if (command_parse(packet, packet_size, &command) == COMMAND_SEEKTO)
+    {
+        // Write the command, the descriptor is shared so its position is only read
+        // back under the data file mutex
+        if (ioctl(fd, AESDCHAR_IOCSEEKTO, &command.seekto) < 0)
+        {
+            logger_log(LOG_ERR, "IOCTL error %s", strerror(errno));
+            ret = -1;
+        }
+        else if ((*start = lseek(fd, 0, SEEK_CUR)) < 0)
+        {
+            logger_log(LOG_ERR, "Failed to get file position: %s", strerror(errno));
+            ret = -1;
+        }
+    }
+    else
+    {
+        // Write packet to file
+        if (write(fd, packet, packet_size) == -1)
+        {
+            logger_log(LOG_ERR, "Failed to write data to file: %s", strerror(errno));
+            ret = -1;
+        }
+        *start = 0;
+    }
+
+    return ret;
+}
+
+int apply_packet_batch(int fd, const struct iovec *iov, int count)
 {
-    syslog(LOG_INFO, "Caught signal, exiting");
-    exit_flag = true;
+    int ret = 0;
+
+    // writev may stop short, so work on a copy that can be advanced
+    struct iovec remaining[count];
+    memcpy(remaining, iov, count * sizeof(struct iovec));
+    struct iovec *next = remaining;
+    while (count > 0)
+    {
+        ssize_t written = writev(fd, next, count);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            logger_log(LOG_ERR, "Failed to write data to file: %s", strerror(errno));
+            ret = -1;
+            break;
+        }
+        while (count > 0 && (size_t)written >= next->iov_len)
+        {
+            written -= next->iov_len;
+            next++;
+            count--;
+        }
+        if (count > 0)
+        {
+            next->iov_base = (char *)next->iov_base + written;
+            next->iov_len -= written;
+        }
+    }
+
+    return ret;
+}
+
+int replay_file(int fd, off_t offset, off_t end, response_sink_t sink, void *context)
+{
+    int ret = 0;
+    char send_buffer[REPLAY_CHUNK];
+    ssize_t bytes_read = 0;
+    while (ret == 0 && (end < 0 || offset < end))
+    {
+        size_t chunk = end < 0 || end - offset > (off_t)sizeof(send_buffer) ? sizeof(send_buffer) : end - offset;
+        if ((bytes_read = pread(fd, send_buffer, chunk, offset)) <= 0)
+        {
+            break;
+        }
+        offset += bytes_read;
+        if (sink(context, send_buffer, bytes_read) != 0)
+        {
+            ret = -1;
+        }
+    }
+
+    if (bytes_read == -1)
+    {
+        logger_log(LOG_ERR, "Failed to read file: %s", strerror(errno));
+        ret = -1;
+    }
+
+    return ret;
+}
+
+int snapshot_apply_packet(struct segment_index_s *index, const char *packet, size_t packet_size,
+                          off_t *start, off_t *end)
+{
+    struct command_s command;
+
+    if (command_parse(packet, packet_size, &command) == COMMAND_SEEKTO)
+    {
+        struct aesd_seekto *seekto = &command.seekto;
+        if (segment_index_seek(index, seekto->write_cmd, seekto->write_cmd_offset, start) != 0)
+        {
+            logger_log(LOG_ERR, "Invalid seek to %u,%u", seekto->write_cmd, seekto->write_cmd_offset);
+            return -1;
+        }
+        *end = segment_index_length(index);
+    }
+    else
+    {
+        if (segment_index_append(index, packet, packet_size, end) != 0 ||
+            durability_sync(index->fd, *end - packet_size, *end) != 0)
+        {
+            return -1;
+        }
+        *start = segment_index_start(index);
+        if (*start > *end)
+        {
+            *start = *end;
+        }
+    }
+
+    return 0;
+}
+
+int queue_response(int fd, pthread_mutex_t *mutex, struct segment_index_s *index, struct send_queue_s *queue,
+                   const struct iovec *iov, int count)
+{
+    uint64_t started = metrics_now();
+    int ret;
+
+    if (index != NULL)
+    {
+        // The index coordinates concurrent appends, no data file lock is needed
+        off_t start, end;
+        ret = count == 1 ? snapshot_apply_packet(index, iov[0].iov_base, iov[0].iov_len, &start, &end)
+                         : segment_index_appendv(index, iov, count, &end);
+        if (ret != 0)
+        {
+            return -1;
+        }
+        if (count > 1)
+        {
+            size_t size = 0;
+            for (int i = 0; i < count; i++)
+            {
+                size += iov[i].iov_len;
+            }
+            if (durability_sync(index->fd, end - size, end) != 0)
+            {
+                return -1;
+            }
+            start = segment_index_start(index);
+            start = start < end ? start : end;
+        }
+        return send_queue_index_range(queue, index, start, end, started);
+    }
+
+    uint64_t locked_at;
+    if (0 != data_file_lock(mutex, &locked_at))
+    {
+        return -1;
+    }
+    off_t start = 0;
+    ret = count == 1 ? apply_packet(fd, iov[0].iov_base, iov[0].iov_len, &start) : apply_packet_batch(fd, iov, count);
+#ifdef USE_AESD_CHAR_DEVICE
+    // The driver drops its oldest writes, so the response is copied while they are still there
+    if (ret == 0)
+    {
+        ret = replay_file(fd, start, -1, send_queue_sink, queue);
+    }
+#else
+    // Only appends follow, so the first st_size bytes are the response for good
+    struct stat st;
+    if (ret == 0 && fstat(fd, &st) == -1)
+    {
+        logger_log(LOG_ERR, "Failed to stat data file: %s", strerror(errno));
+        ret = -1;
+    }
+#endif
+    if (0 != data_file_unlock(mutex, locked_at))
+    {
+        ret = -1;
+    }
+
+#ifdef USE_AESD_CHAR_DEVICE
+    if (ret != 0)
+    {
+        send_queue_discard(queue);
+        return -1;
+    }
+    return send_queue_commit(queue, started);
+#else
+    if (ret == 0 && durability_enabled())
+    {
+        // Synced outside the mutex, so a group can gather the writes of other connections
+        size_t size = 0;
+        for (int i = 0; i < count; i++)
+        {
+            size += iov[i].iov_len;
+        }
+        ret = durability_sync(fd, st.st_size - size, st.st_size);
+    }
+    return ret == 0 ? send_queue_file_range(queue, fd, 0, st.st_size, started) : -1;
+#endif
+}
+
+/**
+ * Handles the @param count packets in @param iov, queueing one response for all of
+ * them on @param queue and sending as much of it as the socket takes. A single packet
+ * on an empty queue goes through the io_uring chain instead when @param ring is set.
+ * @return 0 on success, -1 if the connection must be closed (already logged)
+ */
+static int respond(struct thread_data_s *thread_data, struct uring_s *ring, struct send_queue_s *queue,
+                   const struct iovec *iov, int count)
+{
+    metrics_add(METRICS_PACKETS, count);
+    // Queued ranges refer to the old descriptor until they are sent
+    if (send_queue_empty(queue))
+    {
+        storage_refresh(&data_storage, &thread_data->file);
+    }
+
+    if (ring == NULL || count > 1 || thread_data->index != NULL || !send_queue_empty(queue) || durability_enabled())
+    {
+        if (queue_response(storage_file_fd(thread_data->file), thread_data->mutex, thread_data->index, queue, iov, count) != 0)
+        {
+            return -1;
+        }
+        return send_queue_flush(queue);
+    }
+
+    // The chain appends and reads under the data file mutex, its sends happen after it
+    if (uring_handle_packet(ring, storage_file_fd(thread_data->file), thread_data->mutex, queue, iov[0].iov_base,
+                            iov[0].iov_len) != 0)
+    {
+        return -1;
+    }
+    return send_queue_flush(queue);
+}
+
+/**
+ * Handles the complete frames of a binary connection in @param ring until none is
+ * left or the send queue pauses reading
+ * @return as handle_packets
+ */
+static int handle_frames(struct thread_data_s *thread_data, struct send_queue_s *queue, struct packet_ring_s *ring)
+{
+    while (true)
+    {
+        size_t length;
+        const char *data = packet_ring_peek(ring, &length);
+        if (send_queue_empty(queue))
+        {
+            storage_refresh(&data_storage, &thread_data->file);
+        }
+        ssize_t size = binary_handle_frame(storage_file_fd(thread_data->file), thread_data->mutex, thread_data->index,
+                                           queue, data, length);
+        if (size <= 0)
+        {
+            return size;
+        }
+        packet_ring_consume(ring, size);
+        if (send_queue_flush(queue) != 0)
+        {
+            return -1;
+        }
+        if (!send_queue_accepts_input(queue))
+        {
+            return 1;
+        }
+    }
+}
+
+/**
+ * Handles the complete packets in @param ring until none is left or the send queue
+ * pauses reading, gathering data packets into one append when batching. The first
+ * bytes of a connection select the binary protocol instead.
+ * @return 0 when no complete packet is left, 1 if reading paused first, -1 if the
+ * connection must be closed
+ */
+static int handle_packets(struct thread_data_s *thread_data, struct uring_s *uring, struct send_queue_s *queue,
+                          struct packet_ring_s *ring)
+{
+    const char *packet;
+    size_t packet_size;
+    struct iovec batch[APPEND_BATCH_MAX];
+    int batch_count = 0;
+
+    if (thread_data->protocol == BINARY_PROTOCOL_UNKNOWN)
+    {
+        size_t length;
+        const char *data = packet_ring_peek(ring, &length);
+        thread_data->protocol = binary_detect(data, length);
+        if (thread_data->protocol == BINARY_PROTOCOL_UNKNOWN)
+        {
+            return 0;
+        }
+        if (thread_data->protocol == BINARY_PROTOCOL_BINARY)
+        {
+            packet_ring_consume(ring, BINARY_MAGIC_SIZE);
+            if (binary_start(queue) != 0)
+            {
+                return -1;
+            }
+        }
+    }
+    if (thread_data->protocol == BINARY_PROTOCOL_BINARY)
+    {
+        return handle_frames(thread_data, queue, ring);
+    }
+
+    while (packet_ring_next(ring, &packet, &packet_size))
+    {
+        // Data packets are gathered when batching, commands end the batch
+        struct command_s command;
+        bool batched = config.batch_append && command_parse(packet, packet_size, &command) == COMMAND_NONE;
+        if (batched)
+        {
+            batch[batch_count].iov_base = (void *)packet;
+            batch[batch_count].iov_len = packet_size;
+            batch_count++;
+        }
+        if (batch_count > 0 && (!batched || batch_count == APPEND_BATCH_MAX))
+        {
+            if (respond(thread_data, uring, queue, batch, batch_count) != 0)
+            {
+                return -1;
+            }
+            batch_count = 0;
+        }
+        struct iovec single = {(void *)packet, packet_size};
+        if (!batched && respond(thread_data, uring, queue, &single, 1) != 0)
+        {
+            return -1;
+        }
+        // Gathered packets are already taken from the ring and must be answered first
+        if (batch_count == 0 && !send_queue_accepts_input(queue))
+        {
+            return 1;
+        }
+    }
+    if (batch_count > 0 && respond(thread_data, uring, queue, batch, batch_count) != 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Adds @param thread_data to the active connections, unless shutdown has started
+ * @return true if it was added
+ */
+static bool track_connection(struct thread_data_s *thread_data)
+{
+    thread_data->active_entries.le_prev = NULL;
+    pthread_mutex_lock(&active_connections_mutex);
+    bool tracked = !exit_flag;
+    if (tracked)
+    {
+        LIST_INSERT_HEAD(&active_connections, thread_data, active_entries);
+    }
+    pthread_mutex_unlock(&active_connections_mutex);
+    return tracked;
+}
+
+static void untrack_connection(struct thread_data_s *thread_data)
+{
+    pthread_mutex_lock(&active_connections_mutex);
+    if (thread_data->active_entries.le_prev != NULL)
+    {
+        LIST_REMOVE(thread_data, active_entries);
+        thread_data->active_entries.le_prev = NULL;
+    }
+    pthread_mutex_unlock(&active_connections_mutex);
+}
+
+/**
+ * Shuts down the socket of every active connection, waking threads blocked in
+ * recv() or send() so they exit without waiting for their clients.
+ * Called once exit_flag is set.
+ */
+static void shutdown_active_connections(void)
+{
+    pthread_mutex_lock(&active_connections_mutex);
+    struct thread_data_s *current;
+    LIST_FOREACH(current, &active_connections, active_entries)
+    {
+        shutdown(current->client_sock, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&active_connections_mutex);
+}
+
+/**
+ * Sets up the receive ring, send queue and data file reference of a newly accepted
+ * connection, which is closed instead if that fails or shutdown has started
+ * @return 0 on success, -1 if the connection was closed
+ */
+static int connection_open(struct thread_data_s *thread_data)
+{
+    inet_ntop(AF_INET, &thread_data->client_addr.sin_addr, thread_data->client_ip, sizeof(thread_data->client_ip));
+    logger_log(LOG_INFO, "Accepted connection from %s", thread_data->client_ip);
+
+    // Without an index the connection writes through the shared data file or device,
+    // then map the receive ring
+    thread_data->file = NULL;
+    if (!track_connection(thread_data) ||
+        (thread_data->index == NULL && (thread_data->file = storage_acquire(&data_storage)) == NULL) ||
+        packet_ring_init(&thread_data->ring, BUFFER_SIZE) != 0)
+    {
+        storage_release(&data_storage, thread_data->file);
+        thread_data->file = NULL;
+        untrack_connection(thread_data);
+        close(thread_data->client_sock);
+        metrics_add(METRICS_CONNECTIONS_CLOSED, 1);
+        thread_data->finished = true;
+        return -1;
+    }
+    send_queue_init(&thread_data->queue, thread_data->client_sock);
+    thread_data->packets_buffered = false;
+    thread_data->input_closed = false;
+    return 0;
+}
+
+static void connection_close(struct thread_data_s *thread_data)
+{
+    packet_ring_destroy(&thread_data->ring);
+    send_queue_destroy(&thread_data->queue);
+    untrack_connection(thread_data);
+    close(thread_data->client_sock);
+    metrics_add(METRICS_CONNECTIONS_CLOSED, 1);
+    logger_log(LOG_INFO, "Closed connection from %s", thread_data->client_ip);
+    storage_release(&data_storage, thread_data->file);
+    thread_data->file = NULL;
+    thread_data->finished = true;
+}
+
+/**
+ * Receives and answers packets until the socket would block, or until @param budget
+ * bytes have been received and no complete packet is left. Blocks in recv() instead
+ * of returning while nothing is queued when the socket is blocking.
+ * @return the poll events to wait for before calling again, or 0 once the connection
+ * is done and must be closed
+ */
+static short connection_service(struct thread_data_s *thread_data, struct uring_s *uring, size_t budget)
+{
+    struct send_queue_s *queue = &thread_data->queue;
+    size_t received = 0;
+
+    while (!exit_flag)
+    {
+        if (send_queue_flush(queue) != 0)
+        {
+            return 0;
+        }
+
+        // Handle every complete packet (terminated by newline) unless reading is paused
+        bool reading = send_queue_accepts_input(queue);
+        if (reading && thread_data->packets_buffered)
+        {
+            int ret = handle_packets(thread_data, uring, queue, &thread_data->ring);
+            if (ret < 0)
+            {
+                return 0;
+            }
+            thread_data->packets_buffered = ret > 0;
+            continue;
+        }
+
+        bool want_input = reading && !thread_data->input_closed;
+        if (!want_input && send_queue_empty(queue))
+        {
+            // Client closed connection and every response has been sent
+            return 0;
+        }
+
+        ssize_t count = -1;
+        errno = EAGAIN;
+        if (want_input && received < budget)
+        {
+            size_t space;
+            char *write_space = packet_ring_write_space(&thread_data->ring, &space);
+            if (write_space == NULL)
+            {
+                return 0;
+            }
+            // Do not wait for packets on a blocking socket while responses are queued
+            int flags = send_queue_empty(queue) ? 0 : MSG_DONTWAIT;
+            count = uring != NULL ? uring_recv(uring, thread_data->client_sock, write_space, space, flags)
+                                  : recv(thread_data->client_sock, write_space, space, flags);
+        }
+        if (count > 0)
+        {
+            packet_ring_commit(&thread_data->ring, count);
+            metrics_add(METRICS_BYTES_IN, count);
+            received += count;
+            thread_data->packets_buffered = true;
+            continue;
+        }
+        if (count == 0)
+        {
+            // Client closed its side, the queued responses are still sent
+            thread_data->input_closed = true;
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            logger_log(LOG_ERR, "Socket error: %s", strerror(errno));
+            return 0;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+
+        // Wait for packets, unless paused, and for room for the queued responses
+        short events = want_input ? POLLIN : 0;
+        if (!send_queue_empty(queue))
+        {
+            events |= POLLOUT;
+        }
+        return events;
+    }
+    return 0;
+}
+
+void *connection_thread(void *data)
+{
+    struct thread_data_s *thread_data = (struct thread_data_s *)data;
+
+    if (connection_open(thread_data) != 0)
+    {
+        return data;
+    }
+    struct uring_s *uring = config.io_uring ? uring_thread_ring() : NULL;
+
+    // Queued responses are sent as the socket takes them, only the io_uring chain
+    // needs a blocking socket
+    if (uring == NULL && fcntl(thread_data->client_sock, F_SETFL, O_NONBLOCK) == -1)
+    {
+        logger_log(LOG_ERR, "Failed to make socket nonblocking: %s", strerror(errno));
+        connection_close(thread_data);
+        return data;
+    }
+
+    short events;
+    while ((events = connection_service(thread_data, uring, SIZE_MAX)) != 0)
+    {
+        struct pollfd poll_fd = {thread_data->client_sock, events, 0};
+        if (poll(&poll_fd, 1, -1) == -1 && errno != EINTR)
+        {
+            logger_log(LOG_ERR, "Failed to poll socket: %s", strerror(errno));
+            break;
+        }
+    }
+
+    connection_close(thread_data);
+    return data;
+}
+
+#ifndef USE_AESD_CHAR_DEVICE
+void *timestamp_thread(void *data)
+{
+    struct timestamp_data_s *timestamp_data = (struct timestamp_data_s *)data;
+
+    int timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    struct itimerspec interval = {{10, 0}, {10, 0}};
+    if (timer == -1 || timerfd_settime(timer, 0, &interval, NULL) == -1)
+    {
+        logger_log(LOG_ERR, "Failed to start timestamp timer: %s", strerror(errno));
+        if (timer != -1)
+        {
+            close(timer);
+        }
+        return NULL;
+    }
+    // The index keeps the descriptor it appends through itself
+    struct storage_file_s *file = timestamp_data->index == NULL ? storage_acquire(&data_storage) : NULL;
+
+    while (control_wait_readable(timer) > 0)
+    {
+        uint64_t expirations;
+        if (read(timer, &expirations, sizeof(expirations)) != sizeof(expirations))
+        {
+            continue;
+        }
+
+        char timestamp[200];
+        time_t now = time(NULL);
+        struct tm *tm_info = localtime(&now);
+        strftime(timestamp, sizeof(timestamp), "timestamp:%a, %d %b %Y %H:%M:%S %z\n", tm_info);
+
+        if (timestamp_data->index != NULL)
+        {
+            segment_index_append(timestamp_data->index, timestamp, strlen(timestamp), NULL);
+            continue;
+        }
+
+        uint64_t locked_at;
+        if (0 != data_file_lock(timestamp_data->mutex, &locked_at))
+        {
+            continue;
+        }
+        storage_refresh(&data_storage, &file);
+        ssize_t written = write(storage_file_fd(file), timestamp, strlen(timestamp));
+        if (written == -1)
+        {
+            logger_log(LOG_ERR, "Failed to write timestamp: %s", strerror(errno));
+        }
+
+        data_file_unlock(timestamp_data->mutex, locked_at);
+    }
+
+    storage_release(&data_storage, file);
+    close(timer);
+    return NULL;
+}
+#endif
+
+/**
+ * Accepts a connection on the nonblocking listening socket @param sock into a new
+ * struct thread_data_s sharing @param mutex and @param index. Waits for one only
+ * when none is queued, so a burst is accepted without a poll() per connection.
+ * @return the new connection, or NULL on error or shutdown (errors are logged)
+ */
+static struct thread_data_s *accept_connection(int sock, pthread_mutex_t *mutex, struct segment_index_s *index)
+{
+    struct sockaddr_in client_addr = {0};
+    socklen_t client_addr_len = sizeof(client_addr);
+
+    int client_sock = accept(sock, (struct sockaddr *)&client_addr, &client_addr_len);
+    if (client_sock == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        // Sleep until a connection arrives or shutdown starts
+        if (control_wait_readable(sock) <= 0)
+        {
+            return NULL;
+        }
+        client_addr_len = sizeof(client_addr);
+        client_sock = accept(sock, (struct sockaddr *)&client_addr, &client_addr_len);
+    }
+
+    if (client_sock == -1)
+    {
+        // Another thread or a reset may have taken the connection poll() saw
+        if (!exit_flag && errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED)
+        {
+            logger_log(LOG_ERR, "Failed to accept connection: %s", strerror(errno));
+        }
+        return NULL;
+    }
+
+    // Create a new node
+    struct thread_data_s *new_thread_data = mem_pool_alloc(&object_pool, sizeof(struct thread_data_s));
+    if (new_thread_data == NULL)
+    {
+        close(client_sock);
+        return NULL;
+    }
+
+    new_thread_data->finished = false;
+    new_thread_data->joined = false;
+    new_thread_data->client_addr = client_addr;
+    new_thread_data->client_addr_len = client_addr_len;
+    new_thread_data->client_sock = client_sock;
+    new_thread_data->mutex = mutex;
+    new_thread_data->index = index;
+    new_thread_data->protocol = BINARY_PROTOCOL_UNKNOWN;
+    new_thread_data->pool = NULL;
+
+    metrics_add(METRICS_CONNECTIONS_ACCEPTED, 1);
+    return new_thread_data;
+}
+
+/**
+ * Accepts connections on @param sock until exit_flag is set, servicing each one
+ * from its own connection_thread
+ */
+static void serve_thread_per_connection(int sock, pthread_mutex_t *mutex, struct segment_index_s *index)
+{
+    // Linked list head
+    struct thread_data_head_t thread_data_head;
+    SLIST_INIT(&thread_data_head);
+
+    // Main server loop
+    while (!exit_flag)
+    {
+        struct thread_data_s *new_thread_data = accept_connection(sock, mutex, index);
+        if (new_thread_data == NULL)
+        {
+            continue;
+        }
+
+        // Spawn a new thread
+        if (0 != pthread_create(&new_thread_data->thread, 0, connection_thread, (void *)new_thread_data))
+        {
+            logger_log(LOG_ERR, "Failed to create new thread");
+            close(new_thread_data->client_sock);
+            mem_pool_free(&object_pool, new_thread_data, sizeof(struct thread_data_s));
+            continue;
+        }
+        // Add the new thread data to the linked list
+        SLIST_INSERT_HEAD(&thread_data_head, new_thread_data, entries);
+
+        // Cleanup any dead threads
+        struct thread_data_s *current;
+        SLIST_FOREACH(current, &thread_data_head, entries)
+        {
+            // Join any finished threads
+            if (current->finished && !current->joined)
+            {
+                pthread_join(current->thread, NULL);
+                current->joined = true;
+            }
+        }
+        while (true)
+        {
+            // Safely delete any joined thread at the top of the list
+            struct thread_data_s *first = SLIST_FIRST(&thread_data_head);
+            if (first != NULL && first->joined)
+            {
+                SLIST_REMOVE_HEAD(&thread_data_head, entries);
+                mem_pool_free(&object_pool, first, sizeof(struct thread_data_s));
+            }
+            else
+            {
+                break;
+            }
+        }
+    }
+
+    // Join remaining connections
+    while (true)
+    {
+        // Join and delete from the head
+        struct thread_data_s *first = SLIST_FIRST(&thread_data_head);
+        if (first != NULL)
+        {
+            if (!first->joined)
+            {
+                pthread_join(first->thread, NULL);
+                first->joined = true;
+            }
+            SLIST_REMOVE_HEAD(&thread_data_head, entries);
+            mem_pool_free(&object_pool, first, sizeof(struct thread_data_s));
+        }
+        else
+        {
+            break;
+        }
+    }
+}
+
+/**
+ * Parks a pool connection until its socket reports @param events, or closes it if
+ * @param events is 0 or it cannot be parked
+ */
+static void pool_connection_park(struct thread_data_s *thread_data, short events)
+{
+    uint32_t wait_events = (events & POLLIN ? EPOLLIN : 0) | (events & POLLOUT ? EPOLLOUT : 0);
+    if (events != 0 && threadpool_submit_when_ready(thread_data->pool, &thread_data->wait, wait_events) == 0)
+    {
+        return;
+    }
+    connection_close(thread_data);
+    mem_pool_free(&object_pool, thread_data, sizeof(struct thread_data_s));
+}
+
+/**
+ * Services a pool connection for one readiness event. A connection with input left
+ * after POOL_TASK_BUDGET bytes parks again and, its socket still readable, queues
+ * behind the tasks already waiting.
+ */
+static void *pool_connection_task(void *data)
+{
+    struct thread_data_s *thread_data = (struct thread_data_s *)data;
+
+    pool_connection_park(thread_data, connection_service(thread_data, NULL, POOL_TASK_BUDGET));
+    return NULL;
+}
+
+/**
+ * Accepts connections on @param sock until exit_flag is set, parking each one in
+ * @param pool until it has packets for the worker threads
+ */
+static void serve_thread_pool(int sock, pthread_mutex_t *mutex, struct segment_index_s *index,
+                              struct threadpool_s *pool)
+{
+    // Main server loop
+    while (!exit_flag)
+    {
+        struct thread_data_s *new_thread_data = accept_connection(sock, mutex, index);
+        if (new_thread_data == NULL)
+        {
+            continue;
+        }
+
+        // Pool tasks must never block, so the io_uring chain is not used here
+        new_thread_data->pool = pool;
+        new_thread_data->wait.fd = new_thread_data->client_sock;
+        new_thread_data->wait.function = pool_connection_task;
+        new_thread_data->wait.arg = new_thread_data;
+        new_thread_data->wait.registered = false;
+        if (fcntl(new_thread_data->client_sock, F_SETFL, O_NONBLOCK) == -1)
+        {
+            logger_log(LOG_ERR, "Failed to make socket nonblocking: %s", strerror(errno));
+            close(new_thread_data->client_sock);
+            mem_pool_free(&object_pool, new_thread_data, sizeof(struct thread_data_s));
+            continue;
+        }
+        if (connection_open(new_thread_data) != 0)
+        {
+            mem_pool_free(&object_pool, new_thread_data, sizeof(struct thread_data_s));
+            continue;
+        }
+        pool_connection_park(new_thread_data, POLLIN);
+    }
+}
+
+static void *listener_shard_thread(void *data)
+{
+    struct listener_shard_s *shard = (struct listener_shard_s *)data;
+
+    // Connection threads started from here inherit the CPU, keeping them local to
+    // the listener that accepted them
+    if (config.pin_threads)
+    {
+        listener_pin_thread(shard->shard);
+    }
+    if (shard->pool != NULL)
+    {
+        serve_thread_pool(shard->sock, shard->mutex, shard->index, shard->pool);
+    }
+    else
+    {
+        serve_thread_per_connection(shard->sock, shard->mutex, shard->index);
+    }
+    return data;
+}
+
+/**
+ * Starts an accept loop thread for each of the config.listeners sockets in
+ * @param socks into @param set. In the pool mode they all feed one pool of
+ * config.workers threads.
+ * @return 0 on success, -1 if the pool or an accept thread could not be started,
+ * in which case the set must still be joined after shutdown
+ */
+static int start_listeners(struct listener_set_s *set, const int *socks, pthread_mutex_t *mutex,
+                           struct segment_index_s *index)
+{
+    set->pool = NULL;
+    set->shards = calloc(config.listeners, sizeof(struct listener_shard_s));
+    if (set->shards == NULL)
+    {
+        logger_log(LOG_ERR, "Failed to allocate memory for listeners");
+        return -1;
+    }
+
+    if (config.mode == SERVER_MODE_POOL)
+    {
+        set->pool = threadpool_start(config.workers);
+        if (set->pool == NULL)
+        {
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < config.listeners; i++)
+    {
+        struct listener_shard_s *shard = &set->shards[i];
+        shard->shard = i;
+        shard->sock = socks[i];
+        shard->mutex = mutex;
+        shard->index = index;
+        shard->pool = set->pool;
+        if (0 != pthread_create(&shard->thread, 0, listener_shard_thread, (void *)shard))
+        {
+            logger_log(LOG_ERR, "Failed to create accept thread");
+            return -1;
+        }
+        shard->started = true;
+    }
+    if (config.listeners > 1)
+    {
+        logger_log(LOG_INFO, "Accepting on %d SO_REUSEPORT listeners", config.listeners);
+    }
+    return 0;
 }
 
-void *connection_thread(void *data)
+/**
+ * Waits for the accept loops of @param set and their connections to exit after
+ * shutdown has started
+ */
+static void join_listeners(struct listener_set_s *set)
 {
-
-    struct thread_data_s *thread_data = (struct thread_data_s *)data;
-
-    char *client_ip = inet_ntoa(thread_data->client_addr.sin_addr);
-    syslog(LOG_INFO, "Accepted connection from %s", client_ip);
-
-    // Allocate receive buffer
-    char *buffer = malloc(BUFFER_SIZE);
-    if (buffer == NULL)
+    for (int i = 0; set->shards != NULL && i < config.listeners; i++)
     {
-        syslog(LOG_ERR, "Failed to allocate memory for receive buffer");
-        close(thread_data->client_sock);
-        thread_data->finished = true;
-        return data;
+        if (set->shards[i].started)
+        {
+            pthread_join(set->shards[i].thread, NULL);
+        }
     }
-    size_t buffer_length = 0;
-    size_t buffer_capacity = BUFFER_SIZE;
-    bool connection_error = false;
-
-    // Open the file
-    thread_data->fd = open(WRITE_FILE, O_RDWR | O_APPEND | O_CREAT, 0644);
-    if (thread_data->fd < 0)
+    free(set->shards);
+    if (set->pool != NULL)
     {
-        syslog(LOG_ERR, "Failed to open file: %s, %s", WRITE_FILE, strerror(errno));
-        connection_error = true;
+        threadpool_join(set->pool);
     }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-d] [-m thread|epoll|pool] [-w workers] [-u] [-Z] [-i] [-b] [-M bytes] [-e endpoint]\n"
+                    "       [-L listeners] [-a] [-q backlog] [-o bytes] [-O pause|drop|disconnect] [-l bytes]\n"
+                    "       [-r bytes] [-R segments] [-D none|packet|group] [-g usec] [-G bytes] [-s] [-y rate]\n",
+            name);
+    fprintf(stderr, "  -d          run as a daemon\n");
+    fprintf(stderr, "  -m mode     connection handling: thread per connection (default), epoll reactor\n");
+    fprintf(stderr, "              or fixed worker thread pool\n");
+    fprintf(stderr, "  -w workers  service threads for the epoll and pool modes (default: online cores)\n");
+    fprintf(stderr, "  -u          use io_uring for the append and replay path in the thread mode,\n");
+    fprintf(stderr, "              falling back to read/send when unavailable\n");
+    fprintf(stderr, "  -Z          send queued responses through a read/send copy loop instead of sendfile\n");
+    fprintf(stderr, "  -i          snapshot replay: append concurrently through a segment index and stream\n");
+    fprintf(stderr, "              responses without the data file lock (not with the char device)\n");
+    fprintf(stderr, "  -b          batch appends: write all complete packets from one receive at once and\n");
+    fprintf(stderr, "              send a single response for them, in the thread and pool modes\n");
+    fprintf(stderr, "  -M bytes    limit the memory pooled for connections and their buffers (default:\n");
+    fprintf(stderr, "              no limit), packets that do not fit close their connection\n");
+    fprintf(stderr, "  -e endpoint serve Prometheus metrics on 127.0.0.1:<port>, or on a UNIX socket\n");
+    fprintf(stderr, "              when the endpoint is an absolute path\n");
+    fprintf(stderr, "  -L listeners SO_REUSEPORT listening sockets with an accept loop each (default: 1,\n");
+    fprintf(stderr, "              0 for one per online core), the epoll mode runs a reactor per listener\n");
+    fprintf(stderr, "  -a          pin each accept loop or reactor thread to its own CPU, connection\n");
+    fprintf(stderr, "              threads stay on the CPU of the listener that accepted them\n");
+    fprintf(stderr, "  -q backlog  listen backlog of each listening socket (default: %d)\n", SOMAXCONN);
+    fprintf(stderr, "  -o bytes    high-water mark of each connection's queue of unsent responses\n");
+    fprintf(stderr, "              (default: %d)\n", SEND_QUEUE_DEFAULT_HIGH_WATER);
+    fprintf(stderr, "  -O policy   at the high-water mark, pause reading from the connection (default),\n");
+    fprintf(stderr, "              drop responses that do not fit or disconnect the client\n");
+    fprintf(stderr, "  -l bytes    store the data in memory-mapped log segments of this size, a multiple\n");
+    fprintf(stderr, "              of the page size, instead of the data file; implies -i\n");
+    fprintf(stderr, "  -r bytes    keep about this many bytes of the log, dropping the oldest segments\n");
+    fprintf(stderr, "  -R segments keep at most this many log segments\n");
+    fprintf(stderr, "  -D mode     durability of acknowledged packets: page cache only (none, default),\n");
+    fprintf(stderr, "              synced before each response (packet) or synced in groups (group)\n");
+    fprintf(stderr, "  -g usec     longest a group commit waits for more writes (default: %d)\n",
+            DURABILITY_DEFAULT_INTERVAL_US);
+    fprintf(stderr, "  -G bytes    unsynced bytes that start a group commit early (default: %d)\n",
+            DURABILITY_DEFAULT_BYTES);
+    fprintf(stderr, "  -s          log to stderr instead of syslog\n");
+    fprintf(stderr, "  -y rate     log records written per second at most, the rest are counted as\n");
+    fprintf(stderr, "              dropped (default: %d, 0 for no limit)\n", LOGGER_DEFAULT_RATE);
+}
 
-    // Receive buffer loop
-    while (!exit_flag && !connection_error)
+/**
+ * Parses the command line into @param config
+ * @return 0 on success, -1 on invalid arguments
+ */
+static int parse_arguments(int argc, char **argv, struct server_config_s *config)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+    config->daemon_mode = false;
+    config->mode = SERVER_MODE_THREAD;
+    config->workers = cores > 0 ? (int)cores : 1;
+    config->io_uring = false;
+    config->zero_copy = true;
+    config->snapshot_replay = false;
+    config->batch_append = false;
+    config->memory_limit = 0;
+    config->metrics_endpoint = NULL;
+    config->listeners = 1;
+    config->pin_threads = false;
+    config->backlog = SOMAXCONN;
+    config->send_high_water = SEND_QUEUE_DEFAULT_HIGH_WATER;
+    config->send_policy = SEND_QUEUE_PAUSE;
+    config->log_segment_size = 0;
+    config->log_retain_bytes = 0;
+    config->log_retain_segments = 0;
+    config->durability = DURABILITY_NONE;
+    config->sync_interval_us = DURABILITY_DEFAULT_INTERVAL_US;
+    config->sync_bytes = DURABILITY_DEFAULT_BYTES;
+    config->log_target = LOGGER_SYSLOG;
+    config->log_rate = LOGGER_DEFAULT_RATE;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "dm:w:uZibM:e:L:aq:o:O:l:r:R:D:g:G:sy:")) != -1)
     {
-        // Check if we need to expand buffer
-        if (buffer_length >= buffer_capacity)
+        switch (opt)
         {
-            size_t new_capacity = buffer_capacity * 2;
-            char *new_buffer = realloc(buffer, new_capacity);
-            if (new_buffer == NULL)
+        case 'd':
+            config->daemon_mode = true;
+            break;
+        case 'm':
+            if (strcmp(optarg, "thread") == 0)
             {
-                syslog(LOG_ERR, "Failed to reallocate memory, discarding packet");
-                connection_error = true;
-                break;
+                config->mode = SERVER_MODE_THREAD;
             }
-            buffer = new_buffer;
-            buffer_capacity = new_capacity;
-        }
-
-        int count = recv(thread_data->client_sock, buffer + buffer_length, buffer_capacity - buffer_length, 0);
-
-        if (count == -1)
+            else if (strcmp(optarg, "epoll") == 0)
+            {
+                config->mode = SERVER_MODE_EPOLL;
+            }
+            else if (strcmp(optarg, "pool") == 0)
+            {
+                config->mode = SERVER_MODE_POOL;
+            }
+            else
+            {
+                fprintf(stderr, "Unknown mode: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'w':
+            config->workers = atoi(optarg);
+            if (config->workers <= 0)
+            {
+                fprintf(stderr, "Invalid worker count: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'u':
+            config->io_uring = true;
+            break;
+        case 'Z':
+            config->zero_copy = false;
+            break;
+        case 'i':
+#ifdef USE_AESD_CHAR_DEVICE
+            // The device drops old records, so earlier bytes do not stay put
+            fprintf(stderr, "Snapshot replay needs the append-only data file, not %s\n", WRITE_FILE);
+            return -1;
+#else
+            config->snapshot_replay = true;
+            break;
+#endif
+        case 'b':
+            config->batch_append = true;
+            break;
+        case 'M':
         {
-            syslog(LOG_ERR, "Socket error: %s", strerror(errno));
-            connection_error = true;
+            char *end;
+            config->memory_limit = strtoull(optarg, &end, 10);
+            if (*end != '\0' || config->memory_limit == 0)
+            {
+                fprintf(stderr, "Invalid memory limit: %s\n", optarg);
+                return -1;
+            }
             break;
         }
-
-        if (count == 0)
+        case 'e':
+            config->metrics_endpoint = optarg;
+            break;
+        case 'L':
+            config->listeners = atoi(optarg);
+            if (config->listeners < 0)
+            {
+                fprintf(stderr, "Invalid listener count: %s\n", optarg);
+                return -1;
+            }
+            if (config->listeners == 0)
+            {
+                config->listeners = cores > 0 ? (int)cores : 1;
+            }
+            break;
+        case 'a':
+            config->pin_threads = true;
+            break;
+        case 'q':
+            config->backlog = atoi(optarg);
+            if (config->backlog <= 0)
+            {
+                fprintf(stderr, "Invalid listen backlog: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'o':
         {
-            // Client closed connection
+            char *end;
+            config->send_high_water = strtoull(optarg, &end, 10);
+            if (*end != '\0' || config->send_high_water == 0)
+            {
+                fprintf(stderr, "Invalid send queue high-water mark: %s\n", optarg);
+                return -1;
+            }
             break;
         }
-
-        buffer_length += count;
-
-        // Check for complete packets (terminated by newline)
-        char *search_start = buffer;
-        char *end_of_packet;
-        while ((end_of_packet = memchr(search_start, '\n', buffer_length - (search_start - buffer))) != NULL)
+        case 'O':
+            if (send_queue_parse_policy(optarg, &config->send_policy) != 0)
+            {
+                fprintf(stderr, "Unknown send queue policy: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'l':
+        case 'r':
+        case 'R':
         {
-            int packet_size = end_of_packet - buffer + 1;
-
-            // Lock the file to prevent other threads from accessing it
-            if (0 != pthread_mutex_lock(thread_data->mutex))
+#ifdef USE_AESD_CHAR_DEVICE
+            fprintf(stderr, "The segmented log replaces the data file, not %s\n", WRITE_FILE);
+            return -1;
+#else
+            char *end;
+            size_t value = strtoull(optarg, &end, 10);
+            if (*end != '\0' || value == 0)
             {
-                syslog(LOG_ERR, "Failed to lock mutex");
-                connection_error = true;
-                break;
+                fprintf(stderr, "Invalid log %s: %s\n", opt == 'l' ? "segment size" : "retention", optarg);
+                return -1;
             }
-
-            // Check to see if it is a command packet
-            unsigned int x, y;
-
-            if (sscanf(buffer, "AESDCHAR_IOCSEEKTO:%u,%u", &x, &y) == 2)
+            if (opt == 'l')
+            {
+                config->log_segment_size = value;
+                config->snapshot_replay = true;
+            }
+            else if (opt == 'r')
             {
-                // Found the command
-                struct aesd_seekto seekto;
-                seekto.write_cmd = x;
-                seekto.write_cmd_offset = y;
-                // Write the command
-                if(ioctl(thread_data->fd, AESDCHAR_IOCSEEKTO, &seekto) < 0)
-                {
-                    syslog(LOG_ERR, "IOCTL error %s", strerror(errno));
-                    connection_error = true;
-                }
+                config->log_retain_bytes = value;
             }
             else
             {
-                // Write packet to file
-                if (write(thread_data->fd, buffer, packet_size) == -1)
-                {
-                    syslog(LOG_ERR, "Failed to write data to file: %s", strerror(errno));
-                    connection_error = true;
-                }
-                // Seek to the beginning
-                if (lseek(thread_data->fd, 0, SEEK_SET) < 0)
-                {
-                    syslog(LOG_ERR, "Failed to seek to beginning of the file: %s", strerror(errno));
-                    connection_error = true;
-                }
-            }
-
-            char send_buffer[1024];
-            ssize_t bytes_read = 0;
-            while ((bytes_read = read(thread_data->fd, send_buffer, sizeof(send_buffer))) > 0 && !connection_error)
-            {
-                ssize_t bytes_sent = 0;
-                while (bytes_sent < bytes_read)
-                {
-                    ssize_t sent = send(thread_data->client_sock, send_buffer + bytes_sent, bytes_read - bytes_sent, 0);
-                    if (sent == -1)
-                    {
-                        syslog(LOG_ERR, "Failed to send buffer: %s", strerror(errno));
-                        connection_error = true;
-                        break;
-                    }
-                    bytes_sent += sent;
-                }
-            }
-
-            if (0 != pthread_mutex_unlock(thread_data->mutex))
-            {
-                syslog(LOG_ERR, "Failed to unlock mutex");
-                connection_error = true;
-                break;
+                config->log_retain_segments = value;
             }
-
-            if (bytes_read == -1)
+            break;
+#endif
+        }
+        case 'D':
+            if (durability_parse_mode(optarg, &config->durability) != 0)
             {
-                syslog(LOG_ERR, "Failed to read file: %s", strerror(errno));
-                connection_error = true;
-                break;
+                fprintf(stderr, "Unknown durability mode: %s\n", optarg);
+                return -1;
             }
-
-            // Remove processed packet from buffer
-            memmove(buffer, buffer + packet_size, buffer_length - packet_size);
-            buffer_length -= packet_size;
-            search_start = buffer;
-
-            if(connection_error) {
-                break;
+#ifdef USE_AESD_CHAR_DEVICE
+            if (config->durability != DURABILITY_NONE)
+            {
+                // The device keeps its records in memory only
+                fprintf(stderr, "%s cannot be synced to stable storage\n", WRITE_FILE);
+                return -1;
             }
-        }
-    }
-
-    free(buffer);
-    close(thread_data->client_sock);
-    syslog(LOG_INFO, "Closed connection from %s", client_ip);
-    close(thread_data->fd);
-    thread_data->fd = 0;
-    thread_data->finished = true;
-
-    return data;
-}
-
-#ifndef USE_AESD_CHAR_DEVICE
-void *timestamp_thread(void *data)
-{
-    struct timestamp_data_s *timestamp_data = (struct timestamp_data_s *)data;
-
-    struct timespec next_time;
-    clock_gettime(CLOCK_MONOTONIC, &next_time);
-
-    while (!exit_flag)
-    {
-        next_time.tv_sec += 10;
-        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next_time, NULL) == EINTR && !exit_flag)
+#endif
+            break;
+        case 'g':
+        case 'G':
         {
+            char *end;
+            unsigned long long value = strtoull(optarg, &end, 10);
+            if (*end != '\0' || value == 0 || (opt == 'g' && value > UINT32_MAX))
+            {
+                fprintf(stderr, "Invalid group commit %s: %s\n", opt == 'g' ? "interval" : "size", optarg);
+                return -1;
+            }
+            if (opt == 'g')
+            {
+                config->sync_interval_us = value;
+            }
+            else
+            {
+                config->sync_bytes = value;
+            }
+            break;
         }
-
-        if (exit_flag)
+        case 's':
+            config->log_target = LOGGER_STDERR;
+            break;
+        case 'y':
         {
+            char *end;
+            unsigned long long value = strtoull(optarg, &end, 10);
+            if (*end != '\0' || value > UINT32_MAX)
+            {
+                fprintf(stderr, "Invalid log rate: %s\n", optarg);
+                return -1;
+            }
+            config->log_rate = value;
             break;
         }
-
-        pthread_mutex_lock(timestamp_data->mutex);
-        char timestamp[200];
-        time_t now = time(NULL);
-        struct tm *tm_info = localtime(&now);
-        strftime(timestamp, sizeof(timestamp), "timestamp:%a, %d %b %Y %H:%M:%S %z\n", tm_info);
-
-        ssize_t written = write(timestamp_data->fd, timestamp, strlen(timestamp));
-        if (written == -1)
-        {
-            syslog(LOG_ERR, "Failed to write timestamp: %s", strerror(errno));
+        default:
+            return -1;
         }
-
-        pthread_mutex_unlock(timestamp_data->mutex);
     }
-
-    return NULL;
+    return 0;
 }
-#endif
 
 int main(int argc, char **argv)
 {
-    bool daemon_mode = false;
-    int sock = -1;
     int ret = 0;
 
     // Parse command line arguments
-    if (argc > 1 && strcmp(argv[1], "-d") == 0)
-    {
-        daemon_mode = true;
-    }
-
-    openlog(TAG, 0, LOG_USER);
-
-    // Register signal handlers
-    struct sigaction sa;
-    sa.sa_handler = signal_handler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
-    if (sigaction(SIGINT, &sa, NULL) == -1 || sigaction(SIGTERM, &sa, NULL) == -1)
+    if (parse_arguments(argc, argv, &config) != 0)
     {
-        syslog(LOG_ERR, "Failed to register signal handlers");
+        usage(argv[0]);
         return -1;
     }
 
-    // Create socket
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock == -1)
-    {
-        syslog(LOG_ERR, "Failed to create socket: %s", strerror(errno));
-        return -1;
-    }
+    openlog(TAG, 0, LOG_USER);
+    logger_configure(config.log_target, config.log_rate);
+    mem_pool_set_limit(config.memory_limit);
+    send_queue_configure(config.send_high_water, config.send_policy, config.zero_copy);
 
-    // Set socket options to allow reuse of address
-    int opt = 1;
-    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1)
+    // Create the listening sockets, sharing the port when there are several
+    int *socks = malloc(config.listeners * sizeof(int));
+    if (socks == NULL)
     {
-        syslog(LOG_ERR, "Failed to set socket options: %s", strerror(errno));
-        close(sock);
+        logger_log(LOG_ERR, "Failed to allocate memory for listening sockets");
         return -1;
     }
-
-    // Create address
-    struct sockaddr_in addr = {0};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(PORT);
-    addr.sin_addr.s_addr = INADDR_ANY;
-
-    // Bind to address
-    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    for (int i = 0; i < config.listeners; i++)
     {
-        syslog(LOG_ERR, "Failed to bind to port %d: %s", PORT, strerror(errno));
-        close(sock);
-        return -1;
+        socks[i] = listener_bind(PORT, config.listeners > 1);
+        if (socks[i] == -1)
+        {
+            listener_close_all(socks, i);
+            free(socks);
+            return -1;
+        }
     }
 
     // Daemonize if requested
-    if (daemon_mode)
+    if (config.daemon_mode)
     {
         pid_t pid = fork();
         if (pid < 0)
         {
-            syslog(LOG_ERR, "Failed to fork: %s", strerror(errno));
-            close(sock);
+            logger_log(LOG_ERR, "Failed to fork: %s", strerror(errno));
+            listener_close_all(socks, config.listeners);
+            free(socks);
             return -1;
         }
         if (pid > 0)
@@ -333,14 +1381,15 @@ int main(int argc, char **argv)
         // Child process continues
         if (setsid() == -1)
         {
-            syslog(LOG_ERR, "Failed to create new session: %s", strerror(errno));
-            close(sock);
+            logger_log(LOG_ERR, "Failed to create new session: %s", strerror(errno));
+            listener_close_all(socks, config.listeners);
+            free(socks);
             return -1;
         }
         // Change working directory to root
         if (chdir("/") == -1)
         {
-            syslog(LOG_ERR, "Failed to change directory: %s", strerror(errno));
+            logger_log(LOG_ERR, "Failed to change directory: %s", strerror(errno));
         }
         // Redirect standard file descriptors
         close(STDIN_FILENO);
@@ -352,18 +1401,45 @@ int main(int argc, char **argv)
     }
 
     // Listen for connections
-    if (listen(sock, 10) == -1)
+    for (int i = 0; i < config.listeners; i++)
+    {
+        if (listen(socks[i], config.backlog) == -1)
+        {
+            logger_log(LOG_ERR, "Failed to listen: %s", strerror(errno));
+            listener_close_all(socks, config.listeners);
+            free(socks);
+            return -1;
+        }
+    }
+
+    // Signals are only received through the signalfd, by the threads started below too
+    if (control_init() != 0)
     {
-        syslog(LOG_ERR, "Failed to listen: %s", strerror(errno));
-        close(sock);
+        listener_close_all(socks, config.listeners);
+        free(socks);
         return -1;
     }
+    // Without the drainer records are written directly
+    logger_start();
 
-    // Linked list head
-    struct thread_data_head_t thread_data_head;
-    SLIST_INIT(&thread_data_head);
     pthread_mutex_t mutex;
     pthread_mutex_init(&mutex, NULL);
+    struct segment_index_s *index = NULL;
+    struct reactor_s *reactor = NULL;
+    struct listener_set_s listener_set;
+    ret = -1;
+
+    // Every connection writes through one shared descriptor, appending keeps the file
+    // append-only. Snapshot replay and the log write through their index instead.
+    if (!config.snapshot_replay && storage_open(&data_storage, WRITE_FILE, STORAGE_FLAGS) != 0)
+    {
+        goto cleanup;
+    }
+
+    if (config.metrics_endpoint != NULL && metrics_server_start(config.metrics_endpoint) != 0)
+    {
+        goto cleanup;
+    }
 
     // Start timestamp thread
 
@@ -371,153 +1447,109 @@ int main(int argc, char **argv)
 
     pthread_t timestamp_pthread;
     struct timestamp_data_s timestamp_data;
-    timestamp_data.fd = open(WRITE_FILE, O_RDWR | O_CREAT, 0644);
-    if (timestamp_data.fd < 0)
-    {
-        syslog(LOG_ERR, "Failed to open file: %s", strerror(errno));
-        close(sock);
-        return -1;
-    }
+    struct segment_index_s segment_index;
     timestamp_data.mutex = &mutex;
 
-    if (0 != pthread_create(&timestamp_pthread, 0, timestamp_thread, (void *)&timestamp_data))
-    {
-        syslog(LOG_ERR, "Failed to create timestamp thread");
-        close(timestamp_data.fd);
-        close(sock);
-        return -1;
-    }
-#endif
-
-    // Main server loop
-    while (!exit_flag)
+    if (config.log_segment_size > 0)
     {
-        // Make a file descriptor for accept select
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(sock, &readfds);
-
-        // Create a select timeout for polling exit_flag
-        struct timeval timeout;
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 100000;
-
-        // Wait for connection or timeout
-        int select_ret = select(sock + 1, &readfds, NULL, NULL, &timeout);
-        if (select_ret == -1)
+        size_t retain_segments = config.log_retain_segments;
+        if (config.log_retain_bytes > 0)
         {
-            if (errno == EINTR)
+            size_t segments = config.log_retain_bytes / config.log_segment_size;
+            segments = segments > 0 ? segments : 1;
+            if (retain_segments == 0 || segments < retain_segments)
             {
-                // Interrupted by signal, check exit_flag
-                continue;
+                retain_segments = segments;
             }
-            syslog(LOG_ERR, "select() failed: %s", strerror(errno));
-            break;
         }
-        if (select_ret == 0)
+        if (segment_index_init_log(&segment_index, WRITE_FILE, config.log_segment_size, retain_segments) != 0)
         {
-            // Timeout - no connection available, loop back to check exit_flag
-            continue;
+            goto cleanup;
         }
-
-        // Create a new node
-        struct thread_data_s *new_thread_data = malloc(sizeof(struct thread_data_s));
-
-        new_thread_data->finished = false;
-        new_thread_data->joined = false;
-        memset(&new_thread_data->client_addr, 0, sizeof(new_thread_data->client_addr));
-        new_thread_data->client_addr_len = sizeof(new_thread_data->client_addr);
-        new_thread_data->client_sock = accept(sock, (struct sockaddr *)&new_thread_data->client_addr, &new_thread_data->client_addr_len);
-        new_thread_data->mutex = &mutex;
-
-        if (new_thread_data->client_sock == -1)
+        index = &segment_index;
+    }
+    else if (config.snapshot_replay)
+    {
+        if (segment_index_init(&segment_index, WRITE_FILE) != 0)
         {
-            free(new_thread_data);
-            if (exit_flag)
-            {
-                break;
-            }
-            syslog(LOG_ERR, "Failed to accept connection: %s", strerror(errno));
-            continue;
+            goto cleanup;
         }
+        index = &segment_index;
+    }
+    timestamp_data.index = index;
 
-        // Spawn a new thread
-        if (0 != pthread_create(&new_thread_data->thread, 0, connection_thread, (void *)new_thread_data))
-        {
-            syslog(LOG_ERR, "Failed to create new thread");
-            close(new_thread_data->client_sock);
-            free(new_thread_data);
-            continue;
-        }
+    if (durability_start(config.durability, &data_storage, index, config.sync_interval_us, config.sync_bytes) != 0)
+    {
+        goto cleanup_index;
+    }
 
-        // Add the new thread data to the linked list
-        SLIST_INSERT_HEAD(&thread_data_head, new_thread_data, entries);
+    if (0 != pthread_create(&timestamp_pthread, 0, timestamp_thread, (void *)&timestamp_data))
+    {
+        logger_log(LOG_ERR, "Failed to create timestamp thread");
+        goto cleanup_durability;
+    }
+#endif
 
-        // Cleanup any dead threads
-        struct thread_data_s *current;
-        SLIST_FOREACH(current, &thread_data_head, entries)
-        {
-            // Join any finished threads
-            if (current->finished && !current->joined)
-            {
-                pthread_join(current->thread, NULL);
-                current->joined = true;
-            }
-        }
-        while (true)
-        {
-            // Safely delete any joined thread at the top of the list
-            struct thread_data_s *first = SLIST_FIRST(&thread_data_head);
-            if (first != NULL && first->joined)
-            {
-                SLIST_REMOVE_HEAD(&thread_data_head, entries);
-                free(first);
-            }
-            else
-            {
-                break;
-            }
-        }
+    if (config.mode == SERVER_MODE_EPOLL)
+    {
+        // Every listener needs a reactor thread of its own
+        int workers = config.workers > config.listeners ? config.workers : config.listeners;
+        reactor = reactor_start(socks, config.listeners, workers, config.pin_threads, &mutex, index);
+        ret = reactor != NULL ? 0 : -1;
+    }
+    else
+    {
+        ret = start_listeners(&listener_set, socks, &mutex, index);
+    }
+
+    // Sleep until SIGINT/SIGTERM, then wake every thread and connection
+    if (ret == 0)
+    {
+        control_wait();
+    }
+    control_shutdown();
+    shutdown_active_connections();
+    if (reactor != NULL)
+    {
+        reactor_join(reactor);
+    }
+    else if (config.mode != SERVER_MODE_EPOLL)
+    {
+        join_listeners(&listener_set);
     }
 
-    shutdown(sock, SHUT_RDWR);
-    // Cleanup
+    // Cleanup, the error paths above join in where everything they started is undone
 
 #ifndef USE_AESD_CHAR_DEVICE
     pthread_join(timestamp_pthread, NULL);
-    close(timestamp_data.fd);
-#endif
-
-    // Join remaining connections
-    while (true)
+cleanup_durability:
+    durability_stop();
+cleanup_index:
+    if (index != NULL)
     {
-        // Join and delete from the head
-        struct thread_data_s *first = SLIST_FIRST(&thread_data_head);
-        if (first != NULL)
-        {
-            if (!first->joined)
-            {
-                pthread_join(first->thread, NULL);
-                first->joined = true;
-            }
-            SLIST_REMOVE_HEAD(&thread_data_head, entries);
-            free(first);
-        }
-        else
-        {
-            break;
-        }
+        segment_index_destroy(index);
     }
+#endif
 
+cleanup:
+    // Wakes the storage watcher and metrics server too when starting up failed
+    control_shutdown();
+    storage_close(&data_storage);
+    metrics_server_join();
     pthread_mutex_destroy(&mutex);
-    close(sock);
+    listener_close_all(socks, config.listeners);
+    free(socks);
+    control_destroy();
+    mem_pool_log_stats();
+    mem_pool_drain();
 
 #ifndef USE_AESD_CHAR_DEVICE
     // Only delete the file if we are using the temp file
     unlink(WRITE_FILE);
 #endif
 
+    logger_stop();
     closelog();
 
     return ret;
-}
\ No newline at end of file
+}
@@ -0,0 +1,216 @@
+/*
+ * aesdsocket.h
+ *
+ *  Definitions shared between the aesdsocket connection handling backends
+ */
+
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include "../aesd-char-driver/aesd_ioctl.h"
+#include "aesd-index.h"
+#include "aesd-sendqueue.h"
+#include "aesd-durability.h"
+#include "aesd-storage.h"
+#include "aesd-command.h"
+#include "aesd-logger.h"
+
+#define TAG "aesdsocket"
+#ifdef USE_AESD_CHAR_DEVICE
+#define WRITE_FILE "/dev/aesdchar"
+// The node belongs to the driver, creating a regular file in its place would hide it
+#define STORAGE_FLAGS (O_RDWR | O_APPEND)
+#else
+#define WRITE_FILE "/var/tmp/aesdsocketdata"
+#define STORAGE_FLAGS (O_RDWR | O_APPEND | O_CREAT)
+#endif
+#define PORT 9000
+#define BUFFER_SIZE 4096
+// Bytes read per call when replaying the data file, the char driver fills it across write commands
+#define REPLAY_CHUNK (16 * 1024)
+// Largest single sendfile transfer when sending a queued response
+#define ZERO_COPY_CHUNK (1024 * 1024)
+// Most packets gathered into one write when batching appends
+#define APPEND_BATCH_MAX 256
+// Bytes a pool task receives before its connection queues behind the other ready ones
+#define POOL_TASK_BUDGET (64 * 1024)
+
+/**
+ * How accepted connections are serviced, selected with -m on the command line
+ */
+enum server_mode_e
+{
+    /**
+     * One pthread per accepted connection, polling its nonblocking socket and sending
+     * the responses through its send queue. The socket stays blocking only for io_uring
+     */
+    SERVER_MODE_THREAD,
+    /**
+     * A fixed number of edge-triggered epoll reactor threads, nonblocking sockets
+     */
+    SERVER_MODE_EPOLL,
+    /**
+     * Accepted connections are queued to a fixed pool of worker threads
+     */
+    SERVER_MODE_POOL,
+};
+
+struct server_config_s
+{
+    bool daemon_mode;
+    enum server_mode_e mode;
+    /**
+     * Number of service threads for the modes using a fixed number of threads
+     */
+    int workers;
+    /**
+     * Use the io_uring backend in the thread mode when available, on blocking sockets
+     */
+    bool io_uring;
+    /**
+     * Send queued ranges of the data file with sendfile
+     */
+    bool zero_copy;
+    /**
+     * Append through a segment index of the append-only data file and stream the
+     * response without holding the data file mutex
+     */
+    bool snapshot_replay;
+    /**
+     * Append every complete packet from one receive with a single write and answer
+     * them with one response, in the thread and pool modes
+     */
+    bool batch_append;
+    /**
+     * Size of the mapped segments storing the data instead of the data file, 0 to use
+     * the data file. Implies snapshot_replay.
+     */
+    size_t log_segment_size;
+    /**
+     * Retention of the segmented log, in bytes and in segments, 0 for no limit. The
+     * smaller of the two applies.
+     */
+    size_t log_retain_bytes;
+    size_t log_retain_segments;
+    enum durability_mode_e durability;
+    /**
+     * Longest a group commit waits for more writes, and the unsynced bytes that
+     * start it early
+     */
+    unsigned int sync_interval_us;
+    size_t sync_bytes;
+    /**
+     * Limit on the bytes held by the connection memory pools, 0 for no limit
+     */
+    size_t memory_limit;
+    /**
+     * Where to serve metrics, a TCP port on 127.0.0.1 or a UNIX socket path, or NULL
+     */
+    const char *metrics_endpoint;
+    /**
+     * Listening sockets sharing the port through SO_REUSEPORT, each with its own
+     * accept loop or reactor thread
+     */
+    int listeners;
+    /**
+     * Pin accept loops and reactor threads to a CPU each
+     */
+    bool pin_threads;
+    /**
+     * listen() backlog of each listening socket
+     */
+    int backlog;
+    /**
+     * Bytes of queued responses at which send_policy applies to a connection
+     */
+    size_t send_high_water;
+    enum send_queue_policy_e send_policy;
+    enum logger_target_e log_target;
+    /**
+     * Log records written per second at most, 0 for no limit
+     */
+    unsigned int log_rate;
+};
+
+extern volatile sig_atomic_t exit_flag;
+
+/**
+ * The data file or device shared by every connection
+ */
+extern struct storage_s data_storage;
+
+/**
+ * Called by replay_file with each chunk of the response for a packet.
+ * @return 0 on success, -1 if the response could not be delivered
+ */
+typedef int (*response_sink_t)(void *context, const char *data, size_t length);
+
+/**
+ * Locks the data file @param mutex, recording the wait in the thread's metrics and
+ * the time it was acquired in @param locked_at
+ * @return 0 on success, -1 on error (already logged)
+ */
+int data_file_lock(pthread_mutex_t *mutex, uint64_t *locked_at);
+
+/**
+ * Unlocks the data file @param mutex taken with data_file_lock at @param locked_at,
+ * recording the hold time in the thread's metrics
+ * @return 0 on success, -1 on error (already logged)
+ */
+int data_file_unlock(pthread_mutex_t *mutex, uint64_t locked_at);
+
+/**
+ * Applies a single newline terminated packet to the data file open on @param fd and
+ * sets @param start to the offset the response starts at.
+ * The caller must hold the data file mutex.
+ * @return 0 on success, -1 on any error (already logged)
+ */
+int apply_packet(int fd, const char *packet, size_t packet_size, off_t *start);
+
+/**
+ * Appends the @param count data packets in @param iov to the data file open on @param fd
+ * with writev. The response starts at offset 0.
+ * The caller must hold the data file mutex.
+ * @return 0 on success, -1 on any error (already logged)
+ */
+int apply_packet_batch(int fd, const struct iovec *iov, int count);
+
+/**
+ * Passes the file open on @param fd from @param offset up to @param end, or to its
+ * end when @param end is -1, to @param sink in chunks, without moving the shared
+ * file position.
+ * The caller must hold the data file mutex.
+ * @return 0 on success, -1 on any error (already logged)
+ */
+int replay_file(int fd, off_t offset, off_t end, response_sink_t sink, void *context);
+
+/**
+ * Snapshot replay variant of apply_packet for the append-only data file: appends the
+ * packet through @param index, or resolves a seek command through it.
+ * Sets [@param start, @param end) to the byte range of the response, which stays valid
+ * while other connections append. Needs no data file mutex.
+ * @return 0 on success, -1 on any error (already logged)
+ */
+int snapshot_apply_packet(struct segment_index_s *index, const char *packet, size_t packet_size,
+                          off_t *start, off_t *end);
+
+/**
+ * Applies the @param count packets in @param iov to the data file open on @param fd,
+ * a single packet or a batch of data packets, and queues one response for them on
+ * @param queue. Only the append holds @param mutex, or nothing does when @param index
+ * is set: ranges of the append-only data file are queued as they are, responses from
+ * the char device are copied before the mutex is released.
+ * @return 0 if the response was queued or dropped by the send queue policy, -1 on
+ * error or if the connection must be closed (already logged)
+ */
+int queue_response(int fd, pthread_mutex_t *mutex, struct segment_index_s *index, struct send_queue_s *queue,
+                   const struct iovec *iov, int count);
+
+#endif /* AESDSOCKET_H */